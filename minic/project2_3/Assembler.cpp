@@ -0,0 +1,98 @@
+//
+// In-process assembler for the code GeneratorPass emits
+//
+// Runs the generated assembly through LLVM's MC layer (the same parser and
+// object streamer llvm-mc and clang's integrated assembler use), so the
+// pipeline can write an ELF object without starting `as`. The generator
+// writes AT&T text, which is parsed back here, because building MCInsts
+// in the generator would need the X86 opcode enums, and those aren't among
+// LLVM's installed headers.
+//
+#include "llvm/ADT/Triple.h"
+#include "llvm/Config/llvm-config.h"
+#include "llvm/MC/MCAsmBackend.h"
+#include "llvm/MC/MCAsmInfo.h"
+#include "llvm/MC/MCCodeEmitter.h"
+#include "llvm/MC/MCContext.h"
+#include "llvm/MC/MCInstrInfo.h"
+#include "llvm/MC/MCObjectFileInfo.h"
+#include "llvm/MC/MCObjectWriter.h"
+#include "llvm/MC/MCParser/MCAsmParser.h"
+#include "llvm/MC/MCParser/MCTargetAsmParser.h"
+#include "llvm/MC/MCRegisterInfo.h"
+#include "llvm/MC/MCStreamer.h"
+#include "llvm/MC/MCSubtargetInfo.h"
+#include "llvm/MC/MCTargetOptions.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/SourceMgr.h"
+#include "llvm/Support/TargetSelect.h"
+#include "llvm/Support/raw_ostream.h"
+#if LLVM_VERSION_MAJOR >= 14
+#include "llvm/MC/TargetRegistry.h"
+#else
+#include "llvm/Support/TargetRegistry.h"
+#endif
+#include "Assembler.h"
+#include <mutex>
+
+using namespace llvm;
+
+// The generated code only ever runs on x86-64 Linux
+#define TRIPLE "x86_64-unknown-linux-gnu"
+
+bool assembleObject(StringRef Assembly, StringRef Name, SmallVectorImpl<char> &Object)
+{
+    static std::once_flag Initialized;
+    std::call_once(Initialized, []()
+                   {
+                       LLVMInitializeX86TargetInfo();
+                       LLVMInitializeX86TargetMC();
+                       LLVMInitializeX86AsmParser();
+                   });
+
+    std::string Error;
+    Triple TheTriple(TRIPLE);
+    const Target *T = TargetRegistry::lookupTarget(TRIPLE, Error);
+    if (!T)
+    {
+        errs() << Name << ": " << Error << "\n";
+        return false;
+    }
+
+    MCTargetOptions Options;
+    std::unique_ptr<MCRegisterInfo> MRI(T->createMCRegInfo(TRIPLE));
+    std::unique_ptr<MCAsmInfo> MAI(T->createMCAsmInfo(*MRI, TRIPLE, Options));
+    std::unique_ptr<MCInstrInfo> MCII(T->createMCInstrInfo());
+    // Accept the AVX2 the generator emits for vectorized loops; it only uses it when the function allows it
+    std::unique_ptr<MCSubtargetInfo> STI(T->createMCSubtargetInfo(TRIPLE, "", "+avx2"));
+
+    SourceMgr SrcMgr;
+    SrcMgr.AddNewSourceBuffer(MemoryBuffer::getMemBuffer(Assembly, Name), SMLoc());
+
+    // The context and object file info were made separately before LLVM 13
+#if LLVM_VERSION_MAJOR >= 13
+    MCContext Ctx(TheTriple, MAI.get(), MRI.get(), STI.get(), &SrcMgr, &Options);
+    std::unique_ptr<MCObjectFileInfo> MOFI(T->createMCObjectFileInfo(Ctx, /*PIC=*/false));
+    Ctx.setObjectFileInfo(MOFI.get());
+#else
+    MCObjectFileInfo MOFI;
+    MCContext Ctx(MAI.get(), MRI.get(), &MOFI, &SrcMgr);
+    MOFI.InitMCObjectFileInfo(TheTriple, /*PIC=*/false, Ctx);
+#endif
+
+    // The ELF writer seeks back to fill in headers, so it writes to memory rather than straight to a pipe
+    raw_svector_ostream OS(Object);
+    MCCodeEmitter *CE = T->createMCCodeEmitter(*MCII, *MRI, Ctx);
+    MCAsmBackend *MAB = T->createMCAsmBackend(*STI, *MRI, Options);
+    std::unique_ptr<MCStreamer> Streamer(T->createMCObjectStreamer(
+        TheTriple, Ctx, std::unique_ptr<MCAsmBackend>(MAB), MAB->createObjectWriter(OS),
+        std::unique_ptr<MCCodeEmitter>(CE), *STI, Options.MCRelaxAll, Options.MCIncrementalLinkerCompatible,
+        /*DWARFMustBeAtTheEnd=*/false));
+
+    std::unique_ptr<MCAsmParser> Parser(createMCAsmParser(SrcMgr, Ctx, *Streamer, *MAI));
+    std::unique_ptr<MCTargetAsmParser> TargetParser(T->createMCAsmParser(*STI, *Parser, *MCII, Options));
+    Parser->setTargetParser(*TargetParser);
+
+    // Run() reports errors through the SourceMgr, which prints them to stderr
+    return !Parser->Run(/*NoInitialTextSection=*/false);
+}
@@ -0,0 +1,14 @@
+//
+// In-process assembler for the code GeneratorPass emits
+//
+#ifndef BJC_ASSEMBLER_H
+#define BJC_ASSEMBLER_H
+
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringRef.h"
+
+// Assemble x86-64 AT&T @Assembly into an ELF relocatable object, appending it to @Object.
+// Errors are reported on stderr against @Name, and make it return false.
+bool assembleObject(llvm::StringRef Assembly, llvm::StringRef Name, llvm::SmallVectorImpl<char> &Object);
+
+#endif
@@ -0,0 +1,311 @@
+//
+// Content-addressed cache of optimized and generated functions
+//
+// The first constpass run hashes every function's IR as mem2reg left it,
+// together with the rest of the pipeline's configuration. rangepass adds
+// the ranges it found the function's arguments are passed, and the
+// constants its callees were found to return, which are all a function
+// takes from the rest of the module. An entry under that key holds the
+// function as the whole pipeline left it, and the assembly the generator
+// made of it, so a function that hasn't changed since the last build is
+// spliced back in instead of being optimized further and generated again.
+// Entries are files named by their key, in a directory shared by every
+// build.
+//
+#include "llvm/AsmParser/Parser.h"
+#include "llvm/Config/llvm-config.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/InstIterator.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/SourceMgr.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Support/xxhash.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Utils/ValueMapper.h"
+#include "Cache.h"
+#include <cctype>
+#include <set>
+
+using namespace llvm;
+
+static std::string toHex(uint64_t Hash)
+{
+    std::string Text;
+    raw_string_ostream OS(Text);
+    OS << format_hex_no_prefix(Hash, 16);
+    return OS.str();
+}
+
+// @Text without " #<n>" attribute group references or ", !<kind> !<n>" metadata attachments, which are numbered
+// across the whole module and so change when other functions do
+static std::string stripNumbering(StringRef Text)
+{
+    auto digitAt = [&](size_t i)
+    { return i < Text.size() && isdigit((unsigned char)Text[i]); };
+
+    std::string Out;
+    Out.reserve(Text.size());
+    for (size_t i = 0; i < Text.size();)
+    {
+        if (Text[i] == ' ' && i + 1 < Text.size() && Text[i + 1] == '#' && digitAt(i + 2))
+        {
+            for (i += 2; digitAt(i); i++)
+                ;
+            continue;
+        }
+        if (Text.substr(i).startswith(", !"))
+        {
+            size_t j = i + 3;
+            while (j < Text.size() && (isalnum((unsigned char)Text[j]) || Text[j] == '.' || Text[j] == '_'))
+                j++;
+            if (j + 1 < Text.size() && Text[j] == ' ' && Text[j + 1] == '!' && digitAt(j + 2))
+            {
+                for (i = j + 2; digitAt(i); i++)
+                    ;
+                continue;
+            }
+        }
+        Out += Text[i++];
+    }
+    return Out;
+}
+
+std::string hashFunction(Function &F, StringRef Config)
+{
+    Module &M = *F.getParent();
+    std::string Text;
+    raw_string_ostream OS(Text);
+    OS << CACHE_VERSION << "\n"
+       << Config << "\n"
+       << M.getTargetTriple() << "\n"
+       << M.getDataLayoutStr() << "\n"
+       << F.getAttributes().getAsString(AttributeList::FunctionIndex) << "\n";
+    F.print(OS);
+    return toHex(xxHash64(stripNumbering(OS.str())));
+}
+
+std::string cacheKey(StringRef Hash, std::vector<std::pair<std::string, std::string>> const &Callees)
+{
+    std::string Text = Hash.str();
+    for (auto &Callee : Callees)
+        Text += "\n" + Callee.first + "=" + Callee.second;
+    return toHex(xxHash64(Text));
+}
+
+bool readCacheEntry(StringRef Dir, StringRef Key, CacheEntry &E)
+{
+    auto Buffer = MemoryBuffer::getFile(Dir + "/" + Key);
+    if (!Buffer)
+        return false;
+
+    StringRef Data = (*Buffer)->getBuffer();
+    auto line = [&]()
+    {
+        StringRef Line;
+        std::tie(Line, Data) = Data.split('\n');
+        return Line;
+    };
+    // A "<name> <size>" line and then that many bytes
+    auto section = [&](StringRef Name, std::string &Out)
+    {
+        StringRef Line = line();
+        size_t Size;
+        if (!Line.consume_front(Name) || Line.getAsInteger(10, Size) || Size > Data.size())
+            return false;
+        Out = Data.substr(0, Size).str();
+        Data = Data.drop_front(Size);
+        return true;
+    };
+
+    if (line() != CACHE_VERSION)
+        return false;
+    StringRef Facts = line();
+    if (!Facts.consume_front("facts "))
+        return false;
+    E.Facts = Facts.str();
+
+    StringRef Stats = line();
+    SmallVector<StringRef, 5> Fields;
+    if (!Stats.consume_front("stats "))
+        return false;
+    Stats.split(Fields, ' ');
+    if (Fields.size() != 5)
+        return false;
+    for (unsigned i = 0; i < 5; i++)
+    {
+        if (Fields[i].getAsInteger(10, E.Stats[i]))
+            return false;
+    }
+
+    if (!section("ir ", E.IR))
+        return false;
+    E.HasAssembly = !Data.empty() && section("asm ", E.Assembly);
+    return true;
+}
+
+void writeCacheEntry(StringRef Dir, StringRef Key, CacheEntry const &E)
+{
+    if (std::error_code EC = sys::fs::create_directories(Dir))
+    {
+        errs() << "bjc cache: " << Dir << ": " << EC.message() << "\n";
+        return;
+    }
+
+    // Written to a file of its own and renamed into place, so nobody reads half an entry
+    int FD;
+    SmallString<128> Temp;
+    if (std::error_code EC = sys::fs::createUniqueFile(Dir + "/tmp-%%%%%%%%", FD, Temp))
+    {
+        errs() << "bjc cache: " << Dir << ": " << EC.message() << "\n";
+        return;
+    }
+    {
+        raw_fd_ostream OS(FD, true);
+        OS << CACHE_VERSION << "\n"
+           << "facts " << E.Facts << "\n"
+           << "stats " << E.Stats[0] << " " << E.Stats[1] << " " << E.Stats[2] << " " << E.Stats[3] << " " << E.Stats[4] << "\n"
+           << "ir " << E.IR.size() << "\n"
+           << E.IR;
+        if (E.HasAssembly)
+            OS << "asm " << E.Assembly.size() << "\n"
+               << E.Assembly;
+    }
+    if (std::error_code EC = sys::fs::rename(Temp, Dir + "/" + Key))
+    {
+        errs() << "bjc cache: " << Temp << ": " << EC.message() << "\n";
+        sys::fs::remove(Temp);
+    }
+}
+
+std::string functionModule(Function &F)
+{
+    Module &M = *F.getParent();
+    Module Copy("bjc-cache", F.getContext());
+    Copy.setDataLayout(M.getDataLayout());
+    Copy.setTargetTriple(M.getTargetTriple());
+
+    // Declare everything the body refers to, looking through constant expressions
+    ValueToValueMapTy VMap;
+    std::vector<Constant *> Work;
+    std::set<Constant *> Seen;
+    for (Instruction &I : instructions(F))
+    {
+        for (Value *V : I.operands())
+        {
+            if (Constant *C = dyn_cast<Constant>(V))
+                Work.push_back(C);
+        }
+    }
+    while (!Work.empty())
+    {
+        Constant *C = Work.back();
+        Work.pop_back();
+        if (C == &F || !Seen.insert(C).second)
+            continue;
+
+        if (Function *Callee = dyn_cast<Function>(C))
+            VMap[Callee] = Function::Create(Callee->getFunctionType(), GlobalValue::ExternalLinkage, Callee->getName(), &Copy);
+        else if (GlobalVariable *G = dyn_cast<GlobalVariable>(C))
+            VMap[G] = new GlobalVariable(Copy, G->getValueType(), G->isConstant(), GlobalValue::ExternalLinkage, nullptr, G->getName());
+        else if (isa<GlobalValue>(C) || isa<BlockAddress>(C))
+            return "";
+        else
+        {
+            for (Value *Op : C->operands())
+                Work.push_back(cast<Constant>(Op));
+        }
+    }
+
+    Function *NF = Function::Create(F.getFunctionType(), F.getLinkage(), F.getName(), &Copy);
+    VMap[&F] = NF;
+    auto NA = NF->arg_begin();
+    for (Argument &A : F.args())
+    {
+        NA->setName(A.getName());
+        VMap[&A] = &*NA++;
+    }
+    SmallVector<ReturnInst *, 4> Returns;
+#if LLVM_VERSION_MAJOR >= 13
+    CloneFunctionInto(NF, &F, VMap, CloneFunctionChangeType::DifferentModule, Returns);
+#else
+    CloneFunctionInto(NF, &F, VMap, true, Returns);
+#endif
+    // Cloning into another module lists the compile units it brought along, even when there are none
+    NamedMDNode *Units = Copy.getNamedMetadata("llvm.dbg.cu");
+    if (Units && Units->getNumOperands() == 0)
+        Copy.eraseNamedMetadata(Units);
+    NF->removeFnAttr(CACHE_KEY_ATTR);
+    NF->removeFnAttr(CACHE_HIT_ATTR);
+    NF->removeFnAttr(CACHE_FACTS_ATTR);
+
+    // Named structs would be read back as new types, different from the module's
+    if (!Copy.getIdentifiedStructTypes().empty())
+        return "";
+
+    std::string Text;
+    raw_string_ostream OS(Text);
+    Copy.print(OS, nullptr);
+    return OS.str();
+}
+
+bool spliceFunction(Function &F, StringRef IR)
+{
+    Module &M = *F.getParent();
+    SMDiagnostic Err;
+    std::unique_ptr<Module> Cached = parseAssemblyString(IR, Err, F.getContext());
+    if (!Cached || !Cached->getIdentifiedStructTypes().empty())
+        return false;
+    Function *CF = Cached->getFunction(F.getName());
+    if (!CF || CF->isDeclaration() || CF->getFunctionType() != F.getFunctionType())
+        return false;
+
+    // Everything else in it stands for the global of the same name here
+    std::vector<std::pair<GlobalValue *, GlobalValue *>> Globals;
+    for (GlobalValue &G : Cached->global_values())
+    {
+        GlobalValue *Mine = (&G == CF) ? &F : M.getNamedValue(G.getName());
+        if (!Mine || Mine->getType() != G.getType() || isa<Function>(Mine) != isa<Function>(&G))
+            return false;
+        Globals.push_back({&G, Mine});
+    }
+
+    F.dropAllReferences();
+    for (auto &P : Globals)
+        P.first->replaceAllUsesWith(P.second);
+    auto A = F.arg_begin();
+    for (Argument &CA : CF->args())
+        CA.replaceAllUsesWith(&*A++);
+    F.getBasicBlockList().splice(F.end(), CF->getBasicBlockList());
+    F.setAttributes(CF->getAttributes());
+    return true;
+}
+
+std::string printFact(Constant *C)
+{
+    if (!C)
+        return "-";
+    std::string Text;
+    raw_string_ostream OS(Text);
+    C->print(OS);
+    return OS.str();
+}
+
+Constant *parseFact(StringRef Fact, Module &M)
+{
+    if (Fact == "-" || Fact.empty())
+        return nullptr;
+    // The parser wants its input null-terminated, which a piece of the attribute isn't
+    std::string Text = Fact.str();
+    SMDiagnostic Err;
+    return parseConstantValue(Text, Err, M);
+}
+
+StringRef factOf(Function &F, unsigned Run)
+{
+    SmallVector<StringRef, 4> Facts;
+    F.getFnAttribute(CACHE_FACTS_ATTR).getValueAsString().split(Facts, ';');
+    return Run < Facts.size() ? Facts[Run] : "-";
+}
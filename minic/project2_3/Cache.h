@@ -0,0 +1,67 @@
+//
+// Content-addressed cache of optimized and generated functions, shared by
+// ConstPass (which hashes each function), RangePass (which splices cached
+// bodies in) and GeneratorPass (which fills it)
+//
+#ifndef BJC_CACHE_H
+#define BJC_CACHE_H
+
+#include "llvm/ADT/StringRef.h"
+#include "llvm/IR/Constant.h"
+#include "llvm/IR/Function.h"
+#include <string>
+#include <utility>
+#include <vector>
+
+// Part of every key: bump it whenever a pass changes what it makes of a function, so old entries stop matching
+#define CACHE_VERSION "bjc-cache-2"
+
+// On a function not spliced in from the cache: "<hash>;<callee>,<callee>...", the hash being of its IR until rangepass
+// adds the ranges of its arguments, for rangepass to look it up and the generator to store it under
+#define CACHE_KEY_ATTR "bjc-cache-key"
+// On a function spliced in from the cache: its key. The passes after rangepass leave it alone.
+#define CACHE_HIT_ATTR "bjc-cached"
+// What each constpass run found the function returns, a constant ("i32 5") or "-", separated by ';'
+#define CACHE_FACTS_ATTR "bjc-cache-facts"
+// Named metadata with an operand for each constpass run so far, so a run knows which one it is
+#define CACHE_RUNS_MD "bjc.cache.runs"
+// Named metadata holding the cache directory, set by the first constpass for rangepass to look functions up in
+#define CACHE_DIR_MD "bjc.cache.dir"
+
+// What the cache keeps for one function
+struct CacheEntry
+{
+    // As in CACHE_FACTS_ATTR
+    std::string Facts;
+    // The optimized function, with declarations of what it refers to, as a module
+    std::string IR;
+    // What the generator made of it, if it has been generated without instrumentation or a profile
+    bool HasAssembly = false;
+    std::string Assembly;
+    // The generator's statistics for it: instructions, push/pops, jumps, spills, stack slots
+    unsigned Stats[5] = {0, 0, 0, 0, 0};
+};
+
+// Hash of @F's IR and @Config, leaving out the module-wide numbers of attribute groups and metadata
+std::string hashFunction(llvm::Function &F, llvm::StringRef Config);
+// The key of a function with IR hash @Hash, whose calls may be folded with the facts of the (name, facts) @Callees
+std::string cacheKey(llvm::StringRef Hash, std::vector<std::pair<std::string, std::string>> const &Callees);
+
+// Read the entry for @Key in @Dir. Returns false if there is none.
+bool readCacheEntry(llvm::StringRef Dir, llvm::StringRef Key, CacheEntry &E);
+// Write @E as the entry for @Key in @Dir, replacing any there
+void writeCacheEntry(llvm::StringRef Dir, llvm::StringRef Key, CacheEntry const &E);
+
+// @F alone in a module, with declarations of the globals and functions it refers to. Empty if it can't be cached.
+// Creates IR in @F's context, so it must not run alongside anything else using it.
+std::string functionModule(llvm::Function &F);
+// Replace @F's body with the one in @IR (from functionModule). Returns false, with @F untouched, if it doesn't fit.
+bool spliceFunction(llvm::Function &F, llvm::StringRef IR);
+
+// A constant as it is written in CACHE_FACTS_ATTR, and back
+std::string printFact(llvm::Constant *C);
+llvm::Constant *parseFact(llvm::StringRef Fact, llvm::Module &M);
+// What constpass run @Run found @F returns, from its CACHE_FACTS_ATTR
+llvm::StringRef factOf(llvm::Function &F, unsigned Run);
+
+#endif
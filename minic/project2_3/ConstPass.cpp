@@ -23,12 +23,27 @@
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/Transforms/Utils/BasicBlockUtils.h"
 #include "llvm/Analysis/TargetLibraryInfo.h"
+#include "llvm/Support/CommandLine.h"
+#include "Cache.h"
+#include "Passes.h"
+#include <set>
 
 using namespace llvm;
 
 // Change the DEBUG_TYPE define to the friendly name of your pass
 #define DEBUG_TYPE "constpass"
 
+STATISTIC(NumFolded, "Number of instructions folded to constants");
+STATISTIC(NumCallsReplaced, "Number of calls replaced by their function's constant result");
+STATISTIC(NumConstantFunctions, "Number of functions found to return a constant");
+
+static cl::opt<std::string> ConstCache("constpass-cache",
+                                       cl::desc("Hash every function for rangepass to look up in the cache in <dir> (see Cache.cpp)"),
+                                       cl::value_desc("dir"));
+static cl::opt<std::string> ConstCacheConfig("constpass-cache-config",
+                                             cl::desc("The passes after this one and their options, as part of every cache key"),
+                                             cl::init("constpass,rangepass,deadpass,constpass,vectorpass,ifconvpass,generatorpass"));
+
 // Beginning of anonymous namespace. Keeping it anonymous prevents duplicate
 // namespaces from occurring, especially when merging code into the LLVM
 // pass directory (which we will not be doing.)
@@ -217,11 +232,13 @@ namespace
           if (Const != ConstantFunctions.end())
           {
             I->replaceAllUsesWith(Const->second);
+            NumCallsReplaced++;
           }
         }
         // If it's an instruction that we folded, add the instruction to a list of instructions to delete
         else if (ConstFuncPass::handleInstruction(I))
         {
+          NumFolded++;
           if (I->isSafeToRemove())
           {
             ToDelete.push_back(I);
@@ -265,15 +282,72 @@ namespace
       AU.addRequired<TargetLibraryInfoWrapperPass>();
     }
 
+    /// Mark @F with the hash of its IR and the callees it can be folded with, for rangepass to look it up by
+    ///
+    /// @Earlier holds the functions before @F, the only ones whose constants it can be folded with
+    static void markForCache(Function &F, std::set<Function *> const &Earlier)
+    {
+      std::string Hash = hashFunction(F, ConstCacheConfig);
+
+      // Every function the calls mention, as runOnFunction looks them up
+      std::string Names;
+      std::set<Function *> Seen;
+      for (Instruction &I : instructions(F))
+      {
+        if (!isa<CallInst>(&I))
+          continue;
+        for (Value *V : I.operands())
+        {
+          Function *Callee = dyn_cast<Function>(V);
+          if (Callee && Earlier.count(Callee) && Seen.insert(Callee).second)
+            Names += (Names.empty() ? "" : ",") + Callee->getName().str();
+        }
+      }
+      F.addFnAttr(CACHE_KEY_ATTR, Hash + ";" + Names);
+    }
+
     virtual bool runOnModule(Module &M) override
     {
+      // Which constpass run this is, counted once the cache is in use
+      NamedMDNode *Runs = M.getNamedMetadata(CACHE_RUNS_MD);
+      if (!Runs && !ConstCache.empty())
+        Runs = M.getOrInsertNamedMetadata(CACHE_RUNS_MD);
+      unsigned Run = Runs ? Runs->getNumOperands() : 0;
+      if (Runs)
+        Runs->addOperand(MDNode::get(M.getContext(), {}));
+      if (Run == 0 && !ConstCache.empty())
+        M.getOrInsertNamedMetadata(CACHE_DIR_MD)->addOperand(MDNode::get(M.getContext(), MDString::get(M.getContext(), ConstCache)));
+
       std::map<Function *, Constant *> ConstantFunctions;
+      std::set<Function *> Earlier;
       for (Function &F : M)
       {
-        if (Constant *C = ConstFuncPass::runOnFunction(ConstantFunctions, F))
+        if (Run == 0 && !ConstCache.empty() && !F.isDeclaration())
+          markForCache(F, Earlier);
+
+        Constant *C;
+        if (F.hasFnAttribute(CACHE_HIT_ATTR))
+        {
+          // Already optimized, and what this run found it returns is known
+          C = parseFact(factOf(F, Run), M);
+        }
+        else
         {
+          C = ConstFuncPass::runOnFunction(ConstantFunctions, F);
+          if (F.hasFnAttribute(CACHE_KEY_ATTR))
+          {
+            StringRef Facts = F.getFnAttribute(CACHE_FACTS_ATTR).getValueAsString();
+            F.addFnAttr(CACHE_FACTS_ATTR, (Facts.empty() ? "" : Facts.str() + ";") + printFact(C));
+          }
+        }
+
+        if (C)
+        {
+          NumConstantFunctions++;
           ConstantFunctions.insert(std::pair<Function *, Constant *>(&F, C));
         }
+        if (!F.isDeclaration())
+          Earlier.insert(&F);
       }
 
       return false;
@@ -298,3 +372,8 @@ static void registerConstPass(const PassManagerBuilder &,
 static RegisterStandardPasses
     RegisterMyPass(PassManagerBuilder::EP_EarlyAsPossible,
                    registerConstPass);
+
+ModulePass *createConstPass()
+{
+  return new ConstModPass();
+}
@@ -12,6 +12,7 @@
 //
 #include "llvm/ADT/Statistic.h"
 #include "llvm/Pass.h"
+#include "llvm/IR/CFG.h"
 #include "llvm/IR/InstIterator.h"
 #include "llvm/IR/NoFolder.h"
 #include "llvm/IR/Type.h"
@@ -23,12 +24,18 @@
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/Transforms/Utils/BasicBlockUtils.h"
 #include "llvm/Analysis/TargetLibraryInfo.h"
+#include "Cache.h"
+#include "Passes.h"
 
 using namespace llvm;
 
 // Change the DEBUG_TYPE define to the friendly name of your pass
 #define DEBUG_TYPE "deadpass"
 
+STATISTIC(NumBranchesSimplified, "Number of conditional branches on constants made unconditional");
+STATISTIC(NumPhisRemoved, "Number of PHI nodes removed along with a dead edge");
+STATISTIC(NumBlocksRemoved, "Number of basic blocks removed for having no predecessors");
+
 // Beginning of anonymous namespace. Keeping it anonymous prevents duplicate
 // namespaces from occurring, especially when merging code into the LLVM
 // pass directory (which we will not be doing.)
@@ -41,7 +48,6 @@ namespace
 
         void getAnalysisUsage(AnalysisUsage &AU) const override
         {
-            AU.setPreservesCFG();
             AU.addRequired<TargetLibraryInfoWrapperPass>();
         }
 
@@ -60,11 +66,16 @@ namespace
         // and finally into instructions. All output is to stderr.
         virtual bool runOnFunction(Function &F) override
         {
+            // Spliced in from the cache, already as the whole pipeline leaves it
+            if (F.hasFnAttribute(CACHE_HIT_ATTR))
+                return false;
+
             const llvm::DataLayout &DL = F.getParent()->getDataLayout();
             TargetLibraryInfo *TLI =
                 &getAnalysis<TargetLibraryInfoWrapperPass>().getTLI(F);
 
             std::vector<BasicBlock *> Blocks;
+            bool changed = false;
 
             for (BasicBlock &B : F)
             {
@@ -91,19 +102,27 @@ namespace
                             if (Constant *Cond = dyn_cast<Constant>(Branch->getCondition()))
                             {
                                 BranchInst *Updated = BranchInst::Create(Branch->getSuccessor(!getBool(Cond)));
+                                BasicBlock *Dead = Branch->getSuccessor(getBool(Cond));
 
-                                for (PHINode &Phi : Branch->getSuccessor(getBool(Cond))->phis())
+                                // Both ways may lead to the same block, which then keeps its edge
+                                for (PHINode &Phi : Dead->phis())
                                 {
-                                    if (Value *V = Phi.getIncomingValueForBlock(B))
+                                    if (Dead == Updated->getSuccessor(0))
+                                        continue;
+                                    Phi.removeIncomingValue(B, false);
+
+                                    // Only a PHI left with one way in is just that value; a block left with none is removed below
+                                    Value *Incoming = Phi.getNumIncomingValues() == 1 ? Phi.getIncomingValue(0) : nullptr;
+                                    if (Incoming && Incoming != &Phi)
                                     {
-                                        Phi.removeIncomingValue(B);
-                                        Value *Incoming = Phi.getIncomingValue(0);
                                         Phi.replaceAllUsesWith(Incoming);
                                         ToRemove.push_back(&Phi);
+                                        NumPhisRemoved++;
                                     }
                                 }
 
                                 Replacements.insert(std::make_pair(Branch, Updated));
+                                NumBranchesSimplified++;
                             }
                         }
                     }
@@ -112,6 +131,7 @@ namespace
                 for (auto P : Replacements)
                 {
                     ReplaceInstWithInst(P.first, P.second);
+                    changed = true;
                 }
                 for (auto I : ToRemove)
                 {
@@ -119,7 +139,26 @@ namespace
                 }
             }
 
-            return false; // returning false means the overall CFG has not changed
+            // A block nothing branches to any more is still generated, and still has a way into the PHIs of the
+            // blocks it goes to, which keeps constpass from folding them. Removing some can strand their
+            // successors, so go until nothing changes.
+            while (true)
+            {
+                std::vector<BasicBlock *> Dead;
+                for (BasicBlock &B : F)
+                {
+                    if (&B != &F.getEntryBlock() && pred_empty(&B))
+                        Dead.push_back(&B);
+                }
+                if (Dead.empty())
+                    break;
+
+                DeleteDeadBlocks(Dead);
+                NumBlocksRemoved += Dead.size();
+                changed = true;
+            }
+
+            return changed;
         };
     };
 };
@@ -141,3 +180,8 @@ static void registerDeadPass(const PassManagerBuilder &,
 static RegisterStandardPasses
     RegisterMyPass(PassManagerBuilder::EP_EarlyAsPossible,
                    registerDeadPass);
+
+FunctionPass *createDeadPass()
+{
+    return new DeadPass();
+}
@@ -3,42 +3,97 @@
 //
 // 27 May 2022  bjc   Project 3 COSC75
 //
+#include "llvm/ADT/BitVector.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/Statistic.h"
+#include "llvm/IR/CFG.h"
+#include "llvm/IR/GetElementPtrTypeIterator.h"
 #include "llvm/IR/InstIterator.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/LegacyPassManager.h"
 #include "llvm/IR/InstrTypes.h"
+#include "llvm/IR/Operator.h"
 #include "llvm/Transforms/IPO/PassManagerBuilder.h"
 #include "llvm/Transforms/Utils/BasicBlockUtils.h"
 #include "llvm/Analysis/TargetLibraryInfo.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Timer.h"
+#include "llvm/Support/xxhash.h"
+#include "Assembler.h"
+#include "Cache.h"
+#include "Passes.h"
 #include <iostream>
 #include <sstream>
 #include <algorithm>
 #include <regex>
+#include <atomic>
+#include <chrono>
+#include <set>
+#include <thread>
 
 using namespace llvm;
 
 // Change the DEBUG_TYPE define to the friendly name of your pass
 #define DEBUG_TYPE "generatorpass"
 
+enum class OutputType
+{
+    Assembly,
+    Object
+};
+static cl::opt<OutputType> GeneratorFileType("generatorpass-filetype", cl::desc("Type of file to write"),
+                                             cl::init(OutputType::Assembly),
+                                             cl::values(clEnumValN(OutputType::Assembly, "asm", "AT&T assembly (default)"),
+                                                        clEnumValN(OutputType::Object, "obj", "ELF relocatable object, assembled in-process")));
+static cl::opt<unsigned> GeneratorThreads("generatorpass-threads",
+                                          cl::desc("Number of threads to generate functions on (0 = one per core)"),
+                                          cl::init(0));
+static cl::opt<std::string> GeneratorStatsJSON("generatorpass-stats-json",
+                                               cl::desc("Write per-function code generation statistics to <file> as JSON"),
+                                               cl::value_desc("file"));
+static cl::opt<bool> GeneratorInstrument("generatorpass-instrument",
+                                         cl::desc("Count every CFG edge taken, and write the counts out when the program exits"));
+static cl::opt<std::string> GeneratorInstrumentFile("generatorpass-instrument-file",
+                                                    cl::desc("Where an instrumented program writes its edge counts"),
+                                                    cl::value_desc("file"), cl::init("bjc.prof"));
+static cl::opt<std::string> GeneratorProfile("generatorpass-profile",
+                                             cl::desc("Lay out blocks and branches using the edge counts in <file>"),
+                                             cl::value_desc("file"));
+static cl::opt<std::string> GeneratorCache("generatorpass-cache",
+                                           cl::desc("Take the assembly of functions rangepass spliced in from the cache in <dir>, "
+                                                    "and store the rest there (see Cache.cpp)"),
+                                           cl::value_desc("dir"));
+
+STATISTIC(NumInstructions, "Number of x86 instructions emitted");
+STATISTIC(NumPushPops, "Number of push/pop pairs emitted");
+STATISTIC(NumJumps, "Number of jumps emitted");
+STATISTIC(NumSpills, "Number of values spilled to the stack");
+STATISTIC(NumStackSlots, "Number of stack slots used (deepest point of each function)");
+STATISTIC(NumFallThroughs, "Number of jumps left out because their target is the next block");
+STATISTIC(NumCachedFunctions, "Number of functions whose assembly came from the cache");
+STATISTIC(NumCmovs, "Number of selects generated with cmov or setcc instead of jumps");
+
+// Symbols of the edge counter table and its header, for -generatorpass-instrument
+#define PROFILE_COUNTERS "__bjc_edge_counts"
+#define PROFILE_HEADER "__bjc_profile_header"
+#define PROFILE_PATH "__bjc_profile_path"
+// A profile is this magic, the module's CFG hash and the number of edges (8 bytes each), then one count per edge
+#define PROFILE_MAGIC "BJCPROF1"
+#define PROFILE_HEADER_SIZE 24
+
 #define REGISTER_SIZE 8
 
 #define STATIC_REGISTERS 5
-std::string function_static_registers[STATIC_REGISTERS] = {"%rbx", "%r12", "%r13", "%r14", "%r15"};
-
-std::string addBlockPrefix(std::string blockId)
-{
-    return "__" + blockId;
-}
-
-template <typename K>
-bool contains(std::set<K> const &set, K const &key)
-{
-    return set.find(key) != set.end();
-}
+const std::string function_static_registers[STATIC_REGISTERS] = {"%rbx", "%r12", "%r13", "%r14", "%r15"};
+// Spill slots start below the static registers, which are pushed right after %rbp
+#define FRAME_BASE (REGISTER_SIZE * STATIC_REGISTERS)
 
 #define MAX_REGISTERS 12
 // The Registers we will use
-std::string registers[MAX_REGISTERS] = {
+const std::string registers[MAX_REGISTERS] = {
     "%rax",
     "%rcx",
     "%rdx",
@@ -52,89 +107,160 @@ std::string registers[MAX_REGISTERS] = {
     "%r14",
     "%r15"};
 
+// Vector registers handed out to <4 x i32> and <8 x i32> values (%xmm0 up to this, %ymm for 8 lanes)
+#define VECTOR_REGISTERS 13
+// Vector registers the builder works in: the result of an operation going to a stack slot, and its operands
+#define VECTOR_RESULT "%xmm13"
+#define VECTOR_SCRATCH "%xmm14"
+#define VECTOR_SCRATCH2 "%xmm15"
+
 // Helpers, these are drawn from Ben's Code
 namespace helpers
 {
-    // Helper method to x86Program::dust_out_slots
-    // Returns whether @instruction uses @value
-    bool instruction_makes_use_of(llvm::Instruction const &instruction, llvm::Value const *value)
+    // Per-function backward liveness, computed once and then queried by the generator.
+    //
+    // Every argument and instruction gets a dense number, and each block keeps a live-in and
+    // live-out bitset indexed by those numbers. An operand of a PHI node is live out of the block it
+    // comes from, but not into the PHI's block: Generator::handlePHINode only reads it when control
+    // came along that edge, with nothing run in between. Allocas aren't numbered: like constants, they
+    // stand for an address that is known anywhere in the function.
+    struct Liveness
     {
-        // for (llvm::User const *user : value->users()) {
-        //     if (&instruction == user) {
-        //         return true;
-        //     }
-        // }
+        // Value -> dense number, and back
+        DenseMap<Value const *, unsigned> Numbers;
+        std::vector<Value const *> Values;
+        DenseMap<BasicBlock const *, BitVector> LiveIn;
+        DenseMap<BasicBlock const *, BitVector> LiveOut;
+
+        // Returns the dense number for @value, or -1 if it is not tracked (constants, globals...)
+        int numberOf(Value const *value) const
+        {
+            auto search = Numbers.find(value);
+            if (search == Numbers.end())
+                return -1;
+            return search->second;
+        }
 
-        for (llvm::Value const *operand : instruction.operands())
+        // Run the dataflow for @F, replacing anything computed before.
+        void compute(Function const &F)
         {
-            if (operand == value)
+            Numbers.clear();
+            Values.clear();
+            LiveIn.clear();
+            LiveOut.clear();
+
+            for (Argument const &A : F.args())
+                Values.push_back(&A);
+            for (BasicBlock const &B : F)
+                for (Instruction const &I : B)
+                    if (!isa<AllocaInst>(&I))
+                        Values.push_back(&I);
+            for (unsigned n = 0; n < Values.size(); n++)
+                Numbers.insert(std::make_pair(Values[n], n));
+
+            unsigned size = Values.size();
+
+            // Upward exposed uses and definitions of each block, and the values its successors' PHI nodes read from it
+            DenseMap<BasicBlock const *, BitVector> Gen;
+            DenseMap<BasicBlock const *, BitVector> Kill;
+            DenseMap<BasicBlock const *, BitVector> EdgeUses;
+            for (BasicBlock const &B : F)
             {
-                return true;
+                Gen[&B].resize(size);
+                Kill[&B].resize(size);
+                EdgeUses[&B].resize(size);
+                LiveIn[&B].resize(size);
+                LiveOut[&B].resize(size);
             }
-        }
 
-        return false;
-    }
+            for (BasicBlock const &B : F)
+            {
+                BitVector &G = Gen[&B];
+                BitVector &K = Kill[&B];
 
-    bool recursively_check_for_uses(llvm::BasicBlock const *block, llvm::Value const *value, std::set<llvm::BasicBlock const *> &seen)
-    {
-        if (value->isUsedInBasicBlock(block))
-        {
-            return true;
-        }
+                for (Instruction const &I : B)
+                {
+                    if (PHINode const *PHI = dyn_cast<PHINode>(&I))
+                    {
+                        for (unsigned i = 0; i < PHI->getNumIncomingValues(); i++)
+                        {
+                            int n = numberOf(PHI->getIncomingValue(i));
+                            if (n >= 0)
+                                EdgeUses[PHI->getIncomingBlock(i)].set(n);
+                        }
+                    }
+                    else
+                    {
+                        for (Value const *operand : I.operands())
+                        {
+                            int n = numberOf(operand);
+                            if (n >= 0 && !K.test(n))
+                                G.set(n);
+                        }
+                    }
+                    int def = numberOf(&I);
+                    if (def >= 0)
+                        K.set(def);
+                }
+            }
 
-        llvm::Instruction const &terminator = *block->getTerminator();
-        for (int i = 0; i < terminator.getNumSuccessors(); i++)
-        {
-            llvm::BasicBlock const *child_block = terminator.getSuccessor(i);
-            if (!contains(seen, child_block))
+            // Iterate to a fixed point, visiting blocks in reverse so most information flows in one sweep.
+            std::vector<BasicBlock const *> Order;
+            for (BasicBlock const &B : F)
+                Order.push_back(&B);
+            std::reverse(Order.begin(), Order.end());
+
+            bool changed = true;
+            while (changed)
             {
-                seen.insert(child_block);
-                if (recursively_check_for_uses(child_block, value, seen))
+                changed = false;
+                for (BasicBlock const *B : Order)
                 {
-                    return true;
+                    BitVector Out = EdgeUses[B];
+                    for (BasicBlock const *Succ : successors(B))
+                        Out |= LiveIn[Succ];
+
+                    BitVector In = Out;
+                    In.reset(Kill[B]);
+                    In |= Gen[B];
+
+                    if (In != LiveIn[B] || Out != LiveOut[B])
+                    {
+                        LiveIn[B] = std::move(In);
+                        LiveOut[B] = std::move(Out);
+                        changed = true;
+                    }
                 }
             }
         }
 
-        return false;
-    }
-
-    // Helper method to x86Program::dust_out_slots
-    // Returns whether @value has any uses reachable from just after @it (i.e. not including @it)
-    bool has_reachable_uses(llvm::BasicBlock::const_iterator it, llvm::Value const *value)
-    {
-        while (!it->isTerminator())
+        bool isLiveIn(BasicBlock const *block, Value const *value) const
         {
-            it++;
-            if (instruction_makes_use_of(*it, value))
-            {
-                return true;
-            }
+            int n = numberOf(value);
+            return n >= 0 && LiveIn.find(block)->second.test(n);
         }
 
-        // Note that `seen` starts out empty, so we may revisit the starting block if there's a loop.
-        // This is actually good because if we can revisit the starting block, then there's definitely a reachable use.
-        // (i.e. @it's instruction)
-        std::set<llvm::BasicBlock const *> seen;
+        bool isLiveOut(BasicBlock const *block, Value const *value) const
+        {
+            int n = numberOf(value);
+            return n >= 0 && LiveOut.find(block)->second.test(n);
+        }
 
-        // The terminator instruction of the block we started in
-        llvm::Instruction const &terminator = llvm::cast<llvm::Instruction>(*it);
-        for (int i = 0; i < terminator.getNumSuccessors(); i++)
+        // Returns whether @value has any uses reachable from just after @it (i.e. not including @it)
+        bool has_reachable_uses(BasicBlock::const_iterator it, Value const *value) const
         {
-            llvm::BasicBlock const *child_block = terminator.getSuccessor(i);
-            if (!contains(seen, child_block))
+            BasicBlock const *block = it->getParent();
+            for (++it; it != block->end(); ++it)
             {
-                seen.insert(child_block);
-                if (recursively_check_for_uses(child_block, value, seen))
+                if (is_contained(it->operands(), value))
                 {
                     return true;
                 }
             }
-        }
 
-        return false;
-    }
+            return isLiveOut(block, value);
+        }
+    };
 }
 
 namespace
@@ -144,6 +270,24 @@ namespace
     {
         std::vector<std::string> Instructions;
 
+        // Vector instructions the function may use (from its target-features): VEX-encoded AVX2, and SSE4.1's pmulld
+        bool AVX = false;
+        bool SSE41 = false;
+
+        // Tallies of what has been emitted, for -stats and -generatorpass-stats-json
+        unsigned NumEmitted = 0;
+        unsigned NumPushes = 0;
+        unsigned NumJumps = 0;
+
+        // Add a machine instruction (as opposed to a label or comment)
+        void emit(std::string instruction)
+        {
+            Instructions.push_back(instruction);
+            NumEmitted++;
+            if (instruction[0] == 'j')
+                NumJumps++;
+        }
+
         // Write a comment
         void debug(std::string str)
         {
@@ -157,106 +301,363 @@ namespace
         }
 
         // Close the module
-        void close()
+        //
+        // With @edges counters (-generatorpass-instrument), they are written to @path along with a header
+        // identifying the module by @hash before exiting.
+        void close(bool instrument = false, unsigned edges = 0, uint64_t hash = 0, std::string path = "")
         {
             label("_start");
             call("main");
             move("%rax", "%rbx");
+            if (instrument)
+                writeProfile(edges, hash, path);
             move("$1", "%rax");
-            Instructions.push_back("int $128");
+            emit("int $128");
         }
 
-        // Create a move instruction: `mov <from>, <to>`
-        void move(std::string from, std::string to)
+        // Write the edge counters out with open/write/close system calls, keeping main's result in %rbx.
+        // A program that can't open the file still exits normally, just without a profile.
+        void writeProfile(unsigned edges, uint64_t hash, std::string path)
         {
-            if (from != to)
+            // open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)
+            move("$2", "%rax");
+            emit("lea " PROFILE_PATH "(%rip), %rdi");
+            move("$577", "%rsi");
+            move("$420", "%rdx");
+            emit("syscall");
+            cmp("$0", "%rax");
+            jxx(CmpInst::ICMP_SLT, "__bjc_profile_done");
+            move("%rax", "%r12");
+
+            // write(fd, header, 24) and write(fd, counters, 8 * edges)
+            move("$1", "%rax");
+            move("%r12", "%rdi");
+            emit("lea " PROFILE_HEADER "(%rip), %rsi");
+            move("$" + std::to_string(PROFILE_HEADER_SIZE), "%rdx");
+            emit("syscall");
+            move("$1", "%rax");
+            move("%r12", "%rdi");
+            emit("lea " PROFILE_COUNTERS "(%rip), %rsi");
+            move("$" + std::to_string(REGISTER_SIZE * edges), "%rdx");
+            emit("syscall");
+
+            // close(fd)
+            move("$3", "%rax");
+            move("%r12", "%rdi");
+            emit("syscall");
+            label("__bjc_profile_done");
+
+            std::string escaped;
+            for (char c : path)
             {
-                std::string trueFrom = from;
-                std::string trueTo = to;
+                if (c == '"' || c == '\\')
+                    escaped += '\\';
+                escaped += c;
+            }
 
-                if (from[0] == '-')
-                {
-                    push("%r8");
-                    trueFrom = "(%r8)";
-                    move("%rbp", "%r8");
-                    calc("sub", "$" + std::to_string(-stoi(from)), "%r8", "%r8");
-                }
-                if (to[0] == '-')
-                {
-                    push("%r9");
-                    trueTo = "%r9";
-                }
+            Instructions.push_back(".section .rodata");
+            label(PROFILE_HEADER);
+            Instructions.push_back(".ascii \"" PROFILE_MAGIC "\"");
+            Instructions.push_back(".quad " + std::to_string(hash));
+            Instructions.push_back(".quad " + std::to_string(edges));
+            label(PROFILE_PATH);
+            Instructions.push_back(".asciz \"" + escaped + "\"");
+            Instructions.push_back(".bss");
+            Instructions.push_back(".align 8");
+            label(PROFILE_COUNTERS);
+            if (edges)
+                Instructions.push_back(".zero " + std::to_string(REGISTER_SIZE * edges));
+            Instructions.push_back(".text");
+        }
+
+        // Count one taken edge in the -generatorpass-instrument counter table
+        void countEdge(unsigned edge)
+        {
+            emit("incq " PROFILE_COUNTERS "+" + std::to_string(REGISTER_SIZE * edge) + "(%rip)");
+        }
+
+        // Whether @loc is a stack slot (an offset from %rbp, without the base)
+        static bool isSlot(std::string const &loc)
+        {
+            return loc[0] == '-' && loc.back() != ')';
+        }
 
-                Instructions.push_back("mov " + trueFrom + ", " + trueTo);
+        // Whether @loc is a stack slot or a full memory operand, rather than a register or constant
+        static bool inMemory(std::string const &loc)
+        {
+            return isSlot(loc) || loc.back() == ')';
+        }
+
+        // The AT&T operand for @loc
+        static std::string operand(std::string const &loc)
+        {
+            return isSlot(loc) ? loc + "(%rbp)" : loc;
+        }
+
+        // Whether @loc is a vector register
+        static bool isVector(std::string const &loc)
+        {
+            return loc.compare(0, 4, "%xmm") == 0;
+        }
+
+        // The vector instruction @op, VEX-encoded if the function uses AVX so the two encodings are never mixed
+        std::string vex(std::string op)
+        {
+            return AVX ? "v" + op : op;
+        }
+
+        // The name of the low @width bytes of the 64-bit register @reg (%eax for %rax at 4, %r8b for %r8 at 1).
+        // Anything that isn't a register comes back as it is.
+        static std::string sized(std::string const &reg, unsigned width)
+        {
+            if (isVector(reg))
+                return (width == 32) ? "%ymm" + reg.substr(4) : reg;
+            if (reg[0] != '%' || width == REGISTER_SIZE)
+                return reg;
+
+            std::string name = reg.substr(2);
+            if (isdigit(name[0]))
+                return reg + (width == 4 ? "d" : width == 2 ? "w" : "b");
+            if (width == 4)
+                return "%e" + name;
+            if (width == 2)
+                return "%" + name;
+            // %rax -> %al, but %rsi -> %sil
+            return "%" + (name[1] == 'x' ? name.substr(0, 1) : name) + "l";
+        }
+
+        // Emit `<op> <operands>` on @width byte values. Narrower operations always say how wide they are;
+        // 64-bit ones only when a stack slot is involved, since a constant or nothing at all might be all there
+        // is to tell the assembler how wide the operation is.
+        void emitOp(std::string op, std::string a, std::string b = "", unsigned width = REGISTER_SIZE)
+        {
+            bool memory = inMemory(a) || inMemory(b);
+            std::string suffix = (width == 4) ? "l" : (width == 2) ? "w" : (width == 1) ? "b" : memory ? "q" : "";
+            std::string instruction = op + suffix + " " + operand(sized(a, width));
+            if (!b.empty())
+                instruction += ", " + operand(sized(b, width));
+            emit(instruction);
+        }
+
+        // A register to work in that is neither @a nor @b
+        static std::string scratchFor(std::string const &a, std::string const &b)
+        {
+            for (std::string reg : {"%rax", "%rcx", "%rdx"})
+            {
+                if (reg != a && reg != b)
+                    return reg;
+            }
+            return "%rsi";
+        }
+
+        // Create a move instruction of a @width byte value: `mov <from>, <to>`
+        void move(std::string from, std::string to, unsigned width = REGISTER_SIZE)
+        {
+            if (from == to)
+                return;
+
+            if (width > REGISTER_SIZE)
+            {
+                moveVector(from, to, width);
+                return;
+            }
+
+            // x86 can't move from memory to memory, so go through a register
+            if (inMemory(from) && inMemory(to))
+            {
+                push("%rax");
+                emitOp("mov", from, "%rax", width);
+                emitOp("mov", "%rax", to, width);
+                pop("%rax");
+                return;
+            }
+
+            emitOp("mov", from, to, width);
+        }
+
+        // Move a @width byte vector, going through a scratch register from memory to memory
+        void moveVector(std::string from, std::string to, unsigned width)
+        {
+            if (from == to)
+                return;
 
-                if (to[0] == '-')
+            if (inMemory(from) && inMemory(to))
+            {
+                moveVector(from, VECTOR_SCRATCH2, width);
+                moveVector(VECTOR_SCRATCH2, to, width);
+                return;
+            }
+
+            // Stack slots and arrays aren't necessarily aligned to the vector size
+            std::string op = (isVector(from) && isVector(to)) ? "movdqa" : "movdqu";
+            emit(vex(op) + " " + operand(sized(from, width)) + ", " + operand(sized(to, width)));
+        }
+
+        // Create a packed operation {paddd, psubd, pmulld, pand, por, pxor} on @width byte vectors: `dest = a op b`
+        void vectorCalc(std::string op, std::string a, std::string b, std::string dest, unsigned width)
+        {
+            std::string result = isVector(dest) ? dest : VECTOR_RESULT;
+            if (AVX)
+            {
+                // The first source of a VEX instruction has to be a register
+                if (!isVector(a))
                 {
-                    move("%rbp", "%r8");
-                    calc("sub", "$" + std::to_string(-stoi(to)), "%r8", "%r8");
-                    move("%r9", "(%r8)");
-                    pop("%r9");
+                    moveVector(a, VECTOR_SCRATCH, width);
+                    a = VECTOR_SCRATCH;
                 }
-                if (from[0] == '-')
+                emit("v" + op + " " + operand(sized(b, width)) + ", " + sized(a, width) + ", " + sized(result, width));
+            }
+            else
+            {
+                // Legacy SSE memory operands have to be aligned, so anything in memory is loaded first
+                if (!isVector(b))
                 {
-                    pop("%r8");
+                    moveVector(b, VECTOR_SCRATCH2, width);
+                    b = VECTOR_SCRATCH2;
                 }
+                moveVector(a, result, width);
+                emit(op + " " + b + ", " + result);
+            }
+            moveVector(result, dest, width);
+        }
+
+        // Multiply the 4 lanes of @a and @b into @dest with SSE2, which only has pmuludq: a 32x32->64 multiply of
+        // the even lanes. The odd lanes are shifted down to do them the same way, and the low halves interleaved.
+        void vectorMultiply(std::string a, std::string b, std::string dest)
+        {
+            std::string result = isVector(dest) ? dest : VECTOR_RESULT;
+            moveVector(a, result, 16);
+            emit("movdqa " + result + ", " VECTOR_SCRATCH);
+            emit("psrlq $32, " VECTOR_SCRATCH);
+            if (!isVector(b))
+            {
+                moveVector(b, VECTOR_SCRATCH2, 16);
+                b = VECTOR_SCRATCH2;
+            }
+            emit("pmuludq " + b + ", " + result);
+            moveVector(b, VECTOR_SCRATCH2, 16);
+            emit("psrlq $32, " VECTOR_SCRATCH2);
+            emit("pmuludq " VECTOR_SCRATCH2 ", " VECTOR_SCRATCH);
+            emit("pshufd $8, " + result + ", " + result);
+            emit("pshufd $8, " VECTOR_SCRATCH ", " VECTOR_SCRATCH);
+            emit("punpckldq " VECTOR_SCRATCH ", " + result);
+            moveVector(result, dest, 16);
+        }
+
+        // Widen the @from_width byte value at @from into the @width byte location @to,
+        // sign-extending it when @sign is set and zero-extending it otherwise
+        void extend(std::string from, std::string to, unsigned from_width, unsigned width, bool sign)
+        {
+            // Writing a 32-bit register already clears the upper half
+            if (!sign && from_width == 4)
+            {
+                move(from, to, 4);
+                return;
+            }
+
+            std::string op = std::string(sign ? "movs" : "movz") + (from_width == 1 ? "b" : from_width == 2 ? "w" : "l") +
+                             (width == 4 ? "l" : "q");
+            std::string reg = inMemory(to) ? scratchFor(from, to) : to;
+            if (inMemory(to))
+                push(reg);
+            emit(op + " " + operand(sized(from, from_width)) + ", " + sized(reg, width));
+            if (inMemory(to))
+            {
+                move(reg, to, width);
+                pop(reg);
             }
         }
 
-        // Create a compare instruction: `cmp <a>, <b>`
-        void cmp(std::string a, std::string b)
+        // Create a compare instruction on @width byte values: `cmp <a>, <b>`
+        void cmp(std::string a, std::string b, unsigned width = REGISTER_SIZE)
         {
-            Instructions.push_back("cmp " + a + ", " + b);
+            if (inMemory(a) && inMemory(b))
+            {
+                push("%rax");
+                emitOp("mov", b, "%rax", width);
+                emitOp("cmp", a, "%rax", width);
+                pop("%rax");
+                return;
+            }
+            emitOp("cmp", a, b, width);
         }
         // Create a push instruction: `push <reg>`
         void push(std::string reg)
         {
-            Instructions.push_back("push " + reg);
+            NumPushes++;
+            emit("push " + reg);
         }
         // Create a pop instruction: `pop <reg>`
         void pop(std::string reg)
         {
-            Instructions.push_back("pop " + reg);
+            emit("pop " + reg);
         }
         // Create a return instruction: `ret`
         void ret()
         {
-            Instructions.push_back("ret\n");
+            // Leaving the upper halves of the ymm registers dirty slows down SSE code in the caller
+            if (AVX)
+                emit("vzeroupper");
+            emit("ret\n");
         }
         // Create a jmp instruction: `jmp <dest>`
         void jmp(std::string dest)
         {
-            Instructions.push_back("jmp " + dest);
+            emit("jmp " + dest);
         }
-        // Create a predicated jump instrction `j<pred> dest`
-        void jxx(CmpInst::Predicate pred, std::string dest)
+        // The condition code suffix (of jcc and setcc) for an integer compare predicate
+        static std::string conditionCode(CmpInst::Predicate pred)
         {
-            if (pred == CmpInst::ICMP_EQ)
-            {
-                Instructions.push_back("je " + dest);
-            }
-            else if (pred == CmpInst::ICMP_SLT)
+            switch (pred)
             {
-                Instructions.push_back("jl " + dest);
+            case CmpInst::ICMP_EQ:
+                return "e";
+            case CmpInst::ICMP_NE:
+                return "ne";
+            case CmpInst::ICMP_SLT:
+                return "l";
+            case CmpInst::ICMP_SLE:
+                return "le";
+            case CmpInst::ICMP_SGT:
+                return "g";
+            case CmpInst::ICMP_SGE:
+                return "ge";
+            case CmpInst::ICMP_ULT:
+                return "b";
+            case CmpInst::ICMP_ULE:
+                return "be";
+            case CmpInst::ICMP_UGT:
+                return "a";
+            case CmpInst::ICMP_UGE:
+                return "ae";
+            default:
+                errs() << "UNSUPPORTED PREDICATE " << pred << "\n";
+                exit(EXIT_FAILURE);
             }
-            else if (pred == CmpInst::ICMP_SLE)
-            {
-                Instructions.push_back("jl " + dest);
-                Instructions.push_back("je " + dest);
-            }
-            else if (pred == CmpInst::ICMP_SGT)
-            {
-                Instructions.push_back("jg " + dest);
-            }
-            else if (pred == CmpInst::ICMP_SGE)
+        }
+        // Create a predicated jump instrction `j<pred> dest`
+        void jxx(CmpInst::Predicate pred, std::string dest)
+        {
+            emit("j" + conditionCode(pred) + " " + dest);
+        }
+        // Set @loc to 1 if the last compare satisfied @pred and 0 otherwise: `set<pred>` + widen to 32 bits
+        void setxx(CmpInst::Predicate pred, std::string loc)
+        {
+            // setcc only writes a byte; zeroing a stack slot first with mov leaves the flags alone
+            if (inMemory(loc))
             {
-                Instructions.push_back("jg " + dest);
-                Instructions.push_back("je " + dest);
+                emitOp("mov", "$0", loc, 4);
+                emit("set" + conditionCode(pred) + " " + operand(loc));
+                return;
             }
-            else if (pred == CmpInst::ICMP_NE)
-            {
-                Instructions.push_back("jne " + dest);
-            };
+            emit("set" + conditionCode(pred) + " " + sized(loc, 1));
+            emit("movzbl " + sized(loc, 1) + ", " + sized(loc, 4));
+        }
+        // Move @from (a register or memory) into the register @to if the last compare satisfied @pred:
+        // `cmov<pred> <from>, <to>`. The registers say how wide it is; a suffix would read as part of the condition.
+        void cmovxx(CmpInst::Predicate pred, std::string from, std::string to, unsigned width)
+        {
+            emit("cmov" + conditionCode(pred) + " " + operand(sized(from, width)) + ", " + sized(to, width));
         }
         // Create a call instruction: `call <F.name>`
         void call(Function *F)
@@ -267,7 +668,9 @@ namespace
         // Create a call instruction: `call <dest>`
         void call(std::string dest)
         {
-            Instructions.push_back("call " + dest);
+            if (AVX)
+                emit("vzeroupper");
+            emit("call " + dest);
         }
         // Create a label: `<label>:`
         void label(std::string label)
@@ -275,82 +678,113 @@ namespace
             Instructions.push_back(label + ":");
         }
 
-        // Create a calculation {add, sub} instruction: `op from to` + `mov to dest`
-        void calc(std::string op, std::string from, std::string to, std::string dest)
+        // Create a calculation {add, sub, imul} instruction on @width byte values: `op from to` + `mov to dest`
+        //
+        // A stack slot @to is left as it is, and the calculation done in a scratch register instead.
+        void calc(std::string op, std::string from, std::string to, std::string dest, unsigned width = REGISTER_SIZE)
         {
-            std::string trueFrom = from;
-            std::string trueTo = to;
-            std::string trueDest = dest;
-
-            if (from[0] == '-')
+            if (!inMemory(to))
             {
-                trueFrom = (trueTo == "%r9") ? "%r8" : "%r9";
-                push(trueFrom);
-
-                move("%rbp", trueFrom);
-                calc("sub", "$" + std::to_string(-stoi(from)), trueFrom, trueFrom);
-                move("(" + trueFrom + ")", trueFrom);
+                emitOp(op, from, to, width);
+                move(to, dest, width);
+                return;
             }
-            if (to[0] == '-')
-            {
-                trueTo = (trueFrom == "%r9") ? "%r8" : "%r9";
-                push(trueTo);
 
-                move("%rbp", trueTo);
-                calc("sub", "$" + std::to_string(-stoi(to)), trueTo, trueTo);
-                move("(" + trueTo + ")", trueTo);
-            }
+            std::string scratch = scratchFor(from, dest);
+            push(scratch);
+            emitOp("mov", to, scratch, width);
+            emitOp(op, from, scratch, width);
+            emitOp("mov", scratch, dest, width);
+            pop(scratch);
+        }
+
+        // Create a calculation instruciton {idiv}: `op <to>` [result stored in %rax, remainder in %rdx]
+        void calc(std::string op, std::string to, unsigned width)
+        {
+            emitOp(op, to, "", width);
+        }
+
+        // Create a load effective address instruction: `lea <address>, <reg>`
+        void lea(std::string address, std::string reg)
+        {
+            emit("lea " + address + ", " + reg);
+        }
 
-            Instructions.push_back(op + " " + trueFrom + ", " + trueTo);
+        // Define the global variable @G, in .bss if it starts out all zeros and in .data otherwise
+        void global(GlobalVariable const &G, DataLayout const &DL)
+        {
+            Constant const *Init = G.getInitializer();
+            unsigned align = G.getAlignment() ? G.getAlignment() : DL.getABITypeAlignment(Init->getType());
+
+            Instructions.push_back(Init->isNullValue() ? ".bss" : ".data");
+            Instructions.push_back(".align " + std::to_string(align));
+            label(G.getName().str());
+            constant(Init, DL);
+            Instructions.push_back(".text");
+        }
+
+        // Define the constant @C read by the function's vector instructions, aligned for a ymm load
+        void readOnly(std::string name, Constant const *C, DataLayout const &DL)
+        {
+            Instructions.push_back(".section .rodata");
+            Instructions.push_back(".align 32");
+            label(name);
+            constant(C, DL);
+            Instructions.push_back(".text");
+        }
 
-            bool moved = false;
-            if (dest[0] == '-')
+        // Lay out the bytes of the constant @C
+        void constant(Constant const *C, DataLayout const &DL)
+        {
+            uint64_t size = DL.getTypeAllocSize(C->getType());
+            if (C->isNullValue() || isa<UndefValue>(C))
             {
-                push("%r8");
-                push("%r9");
-                trueDest = "%r8";
-                move(trueTo, "%r9");
-                move("%rbp", trueDest);
-                calc("sub", "$" + std::to_string(-stoi(dest)), trueDest, trueDest);
-                move("%r9", "(" + trueDest + ")");
-                moved = true;
-                pop("%r9");
-                pop("%r8");
+                Instructions.push_back(".zero " + std::to_string(size));
             }
-            if (to[0] == '-')
+            else if (ConstantInt const *Int = dyn_cast<ConstantInt>(C))
             {
-                if (!moved)
-                    move(trueTo, dest);
-                pop("%r9");
-                moved = true;
+                std::string directive = (size == 1) ? ".byte" : (size == 2) ? ".short" : (size == 4) ? ".long" : ".quad";
+                Instructions.push_back(directive + " " + std::to_string(Int->getSExtValue()));
             }
-            if (from[0] == '-')
+            else if (ConstantDataSequential const *Sequence = dyn_cast<ConstantDataSequential>(C))
             {
-                if (!moved)
-                    move(trueTo, dest);
-                pop("%r8");
-                moved = true;
+                for (unsigned i = 0; i < Sequence->getNumElements(); i++)
+                    constant(Sequence->getElementAsConstant(i), DL);
             }
-            if (!moved)
+            else if (ConstantStruct const *Struct = dyn_cast<ConstantStruct>(C))
             {
-                move(trueTo, dest);
+                // Fields go at their offsets in the layout, with padding between them
+                StructLayout const *Layout = DL.getStructLayout(Struct->getType());
+                uint64_t offset = 0;
+                for (unsigned i = 0; i < Struct->getNumOperands(); i++)
+                {
+                    uint64_t field = Layout->getElementOffset(i);
+                    if (field > offset)
+                        Instructions.push_back(".zero " + std::to_string(field - offset));
+                    constant(Struct->getOperand(i), DL);
+                    offset = field + DL.getTypeAllocSize(Struct->getOperand(i)->getType());
+                }
+                if (size > offset)
+                    Instructions.push_back(".zero " + std::to_string(size - offset));
             }
-        }
-
-        // Create a calculation instruciton {mul, div}: `op <to>` [result stored in %rax]
-        void calc(std::string op, std::string to)
-        {
-            std::string trueTo = to;
-            push("%r8");
-            if (to[0] == '-')
+            else if (isa<ConstantArray>(C) || isa<ConstantVector>(C))
+            {
+                for (Value const *Element : C->operands())
+                    constant(cast<Constant>(Element), DL);
+            }
+            else if (C->getType()->isPointerTy() && isa<GlobalValue>(C->stripPointerCasts()->stripInBoundsConstantOffsets()))
+            {
+                // A global's address, maybe with a constant GEP on top
+                APInt offset(DL.getPointerSizeInBits(), 0);
+                Value const *Global = C->stripAndAccumulateConstantOffsets(DL, offset, true);
+                int64_t bytes = offset.getSExtValue();
+                Instructions.push_back(".quad " + Global->getName().str() + (bytes ? (bytes > 0 ? "+" : "") + std::to_string(bytes) : ""));
+            }
+            else
             {
-                trueTo = "%r8";
-                move("%rbp", trueTo);
-                calc("sub", "$" + std::to_string(-stoi(to)), trueTo, trueTo);
-                move("(%r8)", trueTo);
+                errs() << "UNSUPPORTED INITIALIZER " << *C << "\n";
+                exit(EXIT_FAILURE);
             }
-            Instructions.push_back(op + " " + trueTo);
-            pop("%r8");
         }
 
         // Historical name assign was to assign registers to temporary values, not necessary anymore due to smart stack use.
@@ -366,6 +800,16 @@ namespace
         }
     };
 
+    // Bytes a value takes up. Pointers and i64 need a whole register; everything MiniC makes (i32, i1) fits in 4.
+    // Vectors take their whole size, in a vector register.
+    unsigned widthOf(Value const *V)
+    {
+        Type *T = V->getType();
+        if (T->isVectorTy())
+            return T->getPrimitiveSizeInBits() / 8;
+        return (T->isPointerTy() || T->getPrimitiveSizeInBits() > 32) ? REGISTER_SIZE : 4;
+    }
+
     // Structure holds memory data, including where values are stored.
     struct Memory
     {
@@ -379,10 +823,22 @@ namespace
         // Current stack offset
         int stack_offset = 0;
 
+        // Values that had to go on the stack, and the most stack slots in use at once
+        unsigned NumSpills = 0;
+        unsigned MaxStackSlots = 0;
+        // Bytes of frame needed for spilled values and the arrays below the static registers
+        unsigned FrameSize = 0;
+        // Where spill slots start, below the arrays
+        unsigned SpillBase = FRAME_BASE;
+        // Vector constants the function uses, which live in .rodata under these labels
+        std::vector<std::pair<Constant *, std::string>> Pool;
+        std::string PoolPrefix;
+
         // Incrase Stack offset
         void push()
         {
             stack_offset -= REGISTER_SIZE;
+            MaxStackSlots = std::max<unsigned>(MaxStackSlots, -stack_offset / REGISTER_SIZE);
         }
         // Decrease stack offset
         void pop()
@@ -403,41 +859,62 @@ namespace
             temporary = 0;
         }
 
-        // Get a new location, prefer register space, otherwise pick current offset
-        std::string getNewLocation(std::string disallowed)
+        // Whether some value is kept at @loc
+        bool inUse(std::string const &loc)
         {
-            // Default to temporary, which should be low
-            int next = registers[temporary] == disallowed ? temporary + 1 : temporary;
-            for (int i = 0; i < temporary; i++)
+            for (auto P : DS)
             {
-                // If for some reason we've freed a spot smaller than temporary, lets go with that one!
-                bool found = false;
-                for (auto P : DS)
-                {
-                    if ((P.second[0] != '%' && stoi(P.second) == i) || P.second == disallowed)
-                    {
-                        found = true;
-                        break;
-                    }
-                }
-                if (!found)
-                {
-                    next = i;
-                    break;
-                }
+                if (P.second == loc)
+                    return true;
+            }
+            return false;
+        }
+
+        // Whether the @width bytes at -@depth(%rbp) overlap the stack slot of some value
+        bool overlapsSlot(int depth, unsigned width)
+        {
+            for (auto P : DS)
+            {
+                if (P.second[0] != '-')
+                    continue;
+                int other = -stoi(P.second);
+                if (std::max<int>(depth - width, other - widthOf(P.first)) < std::min(depth, other))
+                    return true;
+            }
+            return false;
+        }
+
+        // Get a new location for a @width byte value, prefer the lowest free register, otherwise the lowest free
+        // stack slot (aligned to its width)
+        std::string getNewLocation(std::string disallowed, unsigned width)
+        {
+            for (int i = 0; width > REGISTER_SIZE && i < VECTOR_REGISTERS; i++)
+            {
+                std::string reg = "%xmm" + std::to_string(i);
+                if (!inUse(reg))
+                    return reg;
             }
-            if (next == temporary)
-                temporary++;
 
-            // If we are trying to use a register that we don't have access to, then we need to default to using the stack.
-            if (next >= MAX_REGISTERS)
+            for (int i = 0; width <= REGISTER_SIZE && i < MAX_REGISTERS; i++)
             {
-                // There are no more registers, so we need to allocate space for this value on the stack...
-                push();
-                return std::to_string(stack_offset - REGISTER_SIZE);
+                if (registers[i] == disallowed || inUse(std::to_string(i)))
+                    continue;
+
+                // Calls save every register below temporary
+                temporary = std::max(temporary, i + 1);
+                return std::to_string(i);
             }
 
-            return std::to_string(next);
+            // There are no more registers, so this value gets a slot in the function's frame
+            NumSpills++;
+            for (int depth = SpillBase + width;; depth += width)
+            {
+                if (overlapsSlot(depth, width))
+                    continue;
+
+                FrameSize = std::max<unsigned>(FrameSize, depth - FRAME_BASE);
+                return std::to_string(-depth);
+            }
         }
 
         // Get the location for a value
@@ -450,8 +927,21 @@ namespace
             {
                 if (ConstantInt *Const = dyn_cast<ConstantInt>(V))
                 {
+                    // An i1 is kept as 0 or 1, so true is 1 rather than its sign extended -1
+                    if (Const->getType()->isIntegerTy(1))
+                        return "$" + std::to_string(Const->getZExtValue());
                     return "$" + std::to_string(Const->getSExtValue());
                 }
+                // A vector constant is read from its copy in .rodata
+                if (isa<Constant>(V) && V->getType()->isVectorTy())
+                {
+                    Constant *C = cast<Constant>(V);
+                    auto search = find_if(Pool, [&](std::pair<Constant *, std::string> const &P)
+                                          { return P.first == C; });
+                    if (search == Pool.end())
+                        search = Pool.insert(Pool.end(), std::make_pair(C, PoolPrefix + std::to_string(Pool.size())));
+                    return search->second + "(%rip)";
+                }
             }
 
             for (auto P : DS)
@@ -470,9 +960,9 @@ namespace
                 }
             }
             // Get a new location, that is not disallowed
-            std::string loc = getNewLocation(disallowed);
+            std::string loc = getNewLocation(disallowed, widthOf(V));
 
-            if (loc[0] == '-')
+            if (loc[0] == '-' || loc[0] == '%')
             {
                 DS.insert(std::make_pair(V, loc));
                 return loc;
@@ -506,6 +996,12 @@ namespace
             DS.insert(P);
         }
 
+        // Forget where a value lives, so its register can be handed out again
+        void release(Value *V)
+        {
+            DS.erase(V);
+        }
+
         // Removes a location from the data store
         void remove(std::string loc)
         {
@@ -520,20 +1016,93 @@ namespace
         }
     };
 
+    // An x86 memory operand: `Symbol+Disp(%rip)`, or `Disp(Base,Index,Scale)`
+    struct AddressMode
+    {
+        std::string Symbol;
+        std::string Base;
+        std::string Index;
+        int64_t Scale = 1;
+        int64_t Disp = 0;
+
+        std::string str() const
+        {
+            std::string disp = Disp ? std::to_string(Disp) : "";
+            if (!Symbol.empty())
+                return Symbol + (Disp > 0 ? "+" : "") + disp + "(%rip)";
+
+            std::string address = disp + "(" + Base;
+            if (!Index.empty())
+                address += "," + Index + "," + std::to_string(Scale);
+            return address + ")";
+        }
+    };
+
+    // Registers used while working out an address. Free ones can be used as they are; any other register is pushed
+    // first (Saved), and those in Avoid, which the address or the instruction need, are never picked.
+    struct AddressScratch
+    {
+        std::vector<std::string> Free;
+        std::vector<std::string> Saved;
+        std::set<std::string> Avoid;
+    };
+
     // Generator/Memory Structure.
+    //
+    // One of these is made per function, and owns everything that function's code needs, labels included,
+    // so functions can be generated on different threads.
     struct Generator
     {
         X86Builder Builder;
         Memory Mem;
         std::map<BasicBlock *, int> Blocks;
         int nextBlock = 0;
-        std::map<Value *, Use *> NoMoreUses;
+        // Name of the function being generated, used to keep its labels apart from other functions'
+        std::string FunctionName;
+        // Time spent on liveness for this function
+        std::chrono::duration<double> LivenessTime{0};
+        // Liveness of the function being generated
+        helpers::Liveness Live;
+        // Index of the last block (in layout order) each numbered value is live in
+        std::vector<unsigned> LastBlock;
+        // Layout position of each block of the function being generated
+        std::map<BasicBlock *, unsigned> BlockOrder;
+        // Blocks in the order they are generated, and the block after the one being generated (null for the last)
+        std::vector<BasicBlock *> Layout;
+        BasicBlock *FallThrough = nullptr;
+        // Where the frame for spilled values is made and dropped, filled in once the function is done
+        size_t FrameSetup = 0;
+        std::vector<size_t> FrameTeardowns;
+        // Stack depth at the start of every block, once the prologue has run
+        int BodyStackOffset = 0;
+
+        // Number of this function's first CFG edge in the module's edge table, and of each block's first outgoing edge
+        unsigned FirstEdge = 0;
+        std::map<BasicBlock *, unsigned> EdgeIndex;
+        // Whether to count edges as they are taken (-generatorpass-instrument)
+        bool Instrument = false;
+        // Measured count of every edge in the module (-generatorpass-profile), null without a profile
+        std::vector<uint64_t> const *Profile = nullptr;
+
+        // Data layout of the module being generated
+        DataLayout const *DL = nullptr;
+        // Depth below %rbp of the memory of each alloca
+        std::map<AllocaInst *, unsigned> ArrayDepth;
+        // GEPs that are never worked out on their own, only folded into the address of the loads and stores using them,
+        // and compares only worked out by the select they are the condition of
+        std::set<Value *> Folded;
 
     public:
         Generator()
         {
         }
 
+        // Turn a block/label number into a label that is unique within the module
+        std::string addBlockPrefix(std::string blockId)
+        {
+            return "__" + FunctionName + "_" + blockId;
+        }
+
         // Helper function that uses the Blocks DS to get the blockID used in labeling basic blocks
         //
         // @param with_prefix (bool, default = true) : if you set this to false, you won't get the __ prefix before a block label.
@@ -557,36 +1126,106 @@ namespace
             }
         }
 
+        // Pop a register saved with push, unless it now holds @result, in which case just drop the saved copy
+        void restore(std::string reg, std::string result)
+        {
+            if (reg == result)
+            {
+                Builder.calc("add", "$" + std::to_string(REGISTER_SIZE), "%rsp", "%rsp");
+            }
+            else
+            {
+                Builder.pop(reg);
+            }
+        }
+
+        // Measured count of the @succ'th edge out of @B, 0 without a profile
+        uint64_t edgeCount(BasicBlock *B, unsigned succ)
+        {
+            if (!Profile)
+                return 0;
+            return (*Profile)[EdgeIndex[B] + succ];
+        }
+
+        // Count the @succ'th edge out of @B being taken, when instrumenting
+        void countEdge(BasicBlock *B, unsigned succ)
+        {
+            if (Instrument)
+                Builder.countEdge(EdgeIndex[B] + succ);
+        }
+
+        // Jump to @B, unless it is laid out right after the current block
+        void jumpTo(BasicBlock *B)
+        {
+            if (B == FallThrough)
+            {
+                NumFallThroughs++;
+                return;
+            }
+            Builder.jmp(getBlockId(B));
+        }
+
         // Handle a LLVM Branch Instruction
         void handleBranchInstruction(BranchInst *Branch)
         {
-            BasicBlock *jmpTrue = Branch->getSuccessor(0);
-            std::string blockId = getBlockId(dyn_cast<BasicBlock>(Branch->getParent()), false);
+            BasicBlock *B = Branch->getParent();
+            std::string blockId = getBlockId(B, false);
             // For conditional branches, we need to check the value of the conditional, which we should have already seen and should have been set to a value.
-            if (Branch->isConditional())
+            // A condition the last constpass folded, after deadpass already ran, always goes the same way
+            ConstantInt *Known = Branch->isConditional() ? dyn_cast<ConstantInt>(Branch->getCondition()) : nullptr;
+            if (Known)
+            {
+                unsigned succ = Known->isOne() ? 0 : 1;
+                countEdge(B, succ);
+                Builder.move("$" + blockId, "%rbx", 4);
+                jumpTo(Branch->getSuccessor(succ));
+            }
+            else if (Branch->isConditional())
             {
                 Value *V = Branch->getCondition();
 
-                jmpTrue = Branch->getSuccessor(0);
-                BasicBlock *jmpFalse = Branch->getSuccessor(1);
-
                 std::string condCheck = Mem.getLocationFor(V, true);
 
-                Builder.cmp("$1", condCheck);
+                Builder.cmp("$1", condCheck, widthOf(V));
                 // Always indicate which block we are coming from before we exit a block
-                Builder.move("$" + blockId, "%rbx");
+                Builder.move("$" + blockId, "%rbx", 4);
 
                 Mem.remove(condCheck);
 
-                Builder.jxx(CmpInst::ICMP_EQ, getBlockId(jmpTrue));
-                Builder.jmp(getBlockId(jmpFalse));
-            }
-            // If it is not a conditional, we just branch.
+                // Pick the successor to reach with the conditional jump; the other one gets a jmp, or nothing if it
+                // comes next. With a profile and neither coming next, the hot one gets the conditional jump so the
+                // hot path takes one jump instead of two.
+                unsigned taken = 0;
+                if (Branch->getSuccessor(0) == FallThrough)
+                    taken = 1;
+                else if (Branch->getSuccessor(1) != FallThrough && edgeCount(B, 1) > edgeCount(B, 0))
+                    taken = 1;
+                CmpInst::Predicate pred = (taken == 0) ? CmpInst::ICMP_EQ : CmpInst::ICMP_NE;
+
+                if (Instrument)
+                {
+                    // Go through a stub that counts the taken edge
+                    std::string stub = addBlockPrefix(std::to_string(nextBlock++));
+                    Builder.jxx(pred, stub);
+                    countEdge(B, 1 - taken);
+                    Builder.jmp(getBlockId(Branch->getSuccessor(1 - taken)));
+                    Builder.label(stub);
+                    countEdge(B, taken);
+                    jumpTo(Branch->getSuccessor(taken));
+                }
+                else
+                {
+                    Builder.jxx(pred, getBlockId(Branch->getSuccessor(taken)));
+                    jumpTo(Branch->getSuccessor(1 - taken));
+                }
+            }
+            // If it is not a conditional, we just branch.
             else
             {
+                countEdge(B, 0);
                 // Always indicate which block we are coming from before we exit a block
-                Builder.move("$" + blockId, "%rbx");
-                Builder.jmp(getBlockId(jmpTrue));
+                Builder.move("$" + blockId, "%rbx", 4);
+                jumpTo(Branch->getSuccessor(0));
             }
         }
 
@@ -610,20 +1249,20 @@ namespace
             if (AIter != Call->arg_end())
             {
                 std::string loc = Mem.getLocationFor(*AIter, true);
-                Builder.move(loc, "%rdi");
+                Builder.move(loc, "%rdi", widthOf(*AIter));
             }
 
             std::string resLoc = Mem.getLocationFor(Call);
 
             Builder.call(Call->getCalledFunction());
             // Move our result into the location we know.
-            Builder.move("%rax", resLoc);
+            Builder.move("%rax", resLoc, widthOf(Call));
 
-            // Pop back all of our registers
+            // Pop back all of our registers, except the one now holding the result
             for (int i = prior_temp - 1; i >= 0; i--)
             {
                 Mem.pop();
-                Builder.pop(registers[i]);
+                restore(registers[i], resLoc);
             }
 
             Mem.pop();
@@ -634,12 +1273,16 @@ namespace
         void handleReturnInstruction(ReturnInst *Ret)
         {
             // Load value into register
-            if (Value *Res = Ret->getOperand(0))
+            if (Value *Res = Ret->getReturnValue())
             {
                 std::string loc = Mem.getLocationFor(Res, true);
-                Builder.move(loc, "%rax");
+                Builder.move(loc, "%rax", widthOf(Res));
             }
 
+            // Drop the spill slots, if the function ends up needing any
+            FrameTeardowns.push_back(Builder.Instructions.size());
+            Builder.debug("spill frame");
+
             // Pop all of the static registers that should be fixed (these were pushed at the beginning)
             //
             // Make sure we get them in reverse order here
@@ -659,43 +1302,451 @@ namespace
         {
             Value *Op0 = Cmp->getOperand(0);
             Value *Op1 = Cmp->getOperand(1);
+            unsigned width = widthOf(Op0);
+            if (Folded.count(Cmp))
+                return;
 
             std::string _loc0 = Mem.getLocationFor(Op0, true);
             std::string loc0 = Mem.getLocationFor(Op0);
             // We move in the literal into an actual location, so that we can compare it
-            Builder.move(_loc0, loc0);
+            Builder.move(_loc0, loc0, width);
 
             std::string loc1 = Mem.getLocationFor(Op1, true);
 
-            // Setup block labels for each block
-            std::string trueBlock = addBlockPrefix(std::to_string(nextBlock));
-            std::string falseBlock = addBlockPrefix(std::to_string(nextBlock + 1));
-            std::string postBlock = addBlockPrefix(std::to_string(nextBlock + 2));
+            // This location will store the value $0 if false, $1 if true
+            std::string loc = Mem.getLocationFor(Cmp);
 
-            nextBlock += 3;
+            // Make our comparison, and set the result straight from the flags
+            Builder.cmp(loc1, loc0, width);
+            Builder.setxx(Cmp->getPredicate(), loc);
+        }
 
-            CmpInst::Predicate op = Cmp->getPredicate();
+        // Handle an LLVM Select, as the IfConvPass makes of small if/else diamonds: a compare and then a cmov, or setcc
+        // arithmetic if both values are constants, so nothing jumps
+        void handleSelectInstruction(SelectInst *Select)
+        {
+            Value *Cond = Select->getCondition();
+            Value *True = Select->getTrueValue();
+            Value *False = Select->getFalseValue();
+            unsigned width = widthOf(Select);
+            std::string dest = Mem.getLocationFor(Select);
 
-            // This location will store the value $0 if false, $1 if true
-            std::string loc = Mem.getLocationFor(Cmp);
+            if (ConstantInt *Known = dyn_cast<ConstantInt>(Cond))
+            {
+                Builder.move(Mem.getLocationFor(Known->isOne() ? True : False, true), dest, width);
+                return;
+            }
+            NumCmovs++;
+
+            // Set the flags so that @pred holds just when the condition does
+            CmpInst::Predicate pred = CmpInst::ICMP_EQ;
+            ICmpInst *Cmp = dyn_cast<ICmpInst>(Cond);
+            if (Cmp && Folded.count(Cmp))
+            {
+                Value *Op0 = Cmp->getOperand(0);
+                Value *Op1 = Cmp->getOperand(1);
+                pred = Cmp->getPredicate();
+                // Only the operand compared against can be a constant
+                if (isa<ConstantInt>(Op0))
+                {
+                    std::swap(Op0, Op1);
+                    pred = CmpInst::getSwappedPredicate(pred);
+                }
+                Builder.cmp(Mem.getLocationFor(Op1, true), Mem.getLocationFor(Op0), widthOf(Op0));
+            }
+            else
+            {
+                Builder.cmp("$1", Mem.getLocationFor(Cond), widthOf(Cond));
+            }
+
+            // Two constants: the 0 or 1 setcc gives, scaled by their difference and offset by the false one
+            ConstantInt *T = dyn_cast<ConstantInt>(True);
+            ConstantInt *F = dyn_cast<ConstantInt>(False);
+            if (T && F)
+            {
+                // An i1 true is 1, as getLocationFor has it
+                int64_t t = T->getType()->isIntegerTy(1) ? T->getZExtValue() : T->getSExtValue();
+                int64_t f = F->getType()->isIntegerTy(1) ? F->getZExtValue() : F->getSExtValue();
+                int64_t diff = (int64_t)((uint64_t)t - (uint64_t)f);
+                if (width == 4)
+                {
+                    diff = (int32_t)diff;
+                    f = (int32_t)f;
+                }
+                if (isInt<32>(diff) && isInt<32>(f))
+                {
+                    std::string reg = X86Builder::inMemory(dest) ? X86Builder::scratchFor(dest, dest) : dest;
+                    if (reg != dest)
+                        Builder.push(reg);
+                    Builder.setxx(pred, reg);
+                    if (diff == -1)
+                        Builder.emitOp("neg", reg, "", width);
+                    else if (diff != 1)
+                        Builder.emit("imul $" + std::to_string(diff) + ", " + X86Builder::sized(reg, width) + ", " +
+                                     X86Builder::sized(reg, width));
+                    if (f != 0)
+                        Builder.emitOp("add", "$" + std::to_string(f), reg, width);
+                    if (reg != dest)
+                    {
+                        Builder.move(reg, dest, width);
+                        Builder.pop(reg);
+                    }
+                    return;
+                }
+            }
+
+            // Otherwise one value goes in first and the cmov brings in the other, which it can't take as a constant.
+            // So a constant goes in first, and the condition is turned around if that's the true one.
+            Value *Base = False;
+            Value *Other = True;
+            if (T && !F)
+            {
+                std::swap(Base, Other);
+                pred = CmpInst::getInversePredicate(pred);
+            }
+            std::string base = Mem.getLocationFor(Base, true);
+            std::string from = Mem.getLocationFor(Other, true);
+
+            // Moves and push/pop leave the flags alone
+            std::string reg = (X86Builder::inMemory(dest) || dest == from) ? X86Builder::scratchFor(from, dest) : dest;
+            if (reg != dest)
+                Builder.push(reg);
+            std::string extra;
+            if (from[0] == '$')
+            {
+                // Constants too wide for the arithmetic above
+                extra = X86Builder::scratchFor(reg, dest);
+                Builder.push(extra);
+                Builder.move(from, extra, width);
+                from = extra;
+            }
+            Builder.move(base, reg, width);
+            Builder.cmovxx(pred, from, reg, width);
+            if (!extra.empty())
+                Builder.pop(extra);
+            if (reg != dest)
+            {
+                Builder.move(reg, dest, width);
+                Builder.pop(reg);
+            }
+        }
+
+        // Handle LLVM cast instructions (zext, sext, trunc)
+        //
+        // Values narrower than 32 bits live in 32-bit locations with whatever is left in their upper bits, except
+        // i1, which is always 0 or 1.
+        void handleCastInstruction(CastInst *Cast)
+        {
+            Value *Op = Cast->getOperand(0);
+            unsigned width = widthOf(Cast);
+            unsigned bits = Op->getType()->getPrimitiveSizeInBits();
+            if (Folded.count(Cast))
+                return;
+
+            std::string from = Mem.getLocationFor(Op, true);
+            std::string to = Mem.getLocationFor(Cast);
+            if (Cast->getOpcode() == Instruction::BitCast)
+            {
+                // A pointer keeps its address whatever it points to
+                Builder.move(from, to, width);
+                return;
+            }
+            if (ConstantInt *Const = dyn_cast<ConstantInt>(Op))
+            {
+                int64_t value = (Cast->getOpcode() == Instruction::ZExt) ? Const->getZExtValue() : Const->getSExtValue();
+                Builder.move("$" + std::to_string(value), to, width);
+                return;
+            }
+
+            if (Cast->getOpcode() == Instruction::SExt && bits == 1)
+            {
+                // 0 or 1 becomes 0 or -1
+                Builder.move(from, to, width);
+                Builder.emitOp("neg", to, "", width);
+            }
+            else if (Cast->getOpcode() == Instruction::SExt || Cast->getOpcode() == Instruction::ZExt)
+            {
+                unsigned from_width = (bits == 1) ? 4 : std::max(1u, bits / 8);
+                if (from_width == width)
+                    Builder.move(from, to, width);
+                else
+                    Builder.extend(from, to, from_width, width, Cast->getOpcode() == Instruction::SExt);
+            }
+            else
+            {
+                // A truncated value is the low bytes of the old one
+                Builder.move(from, to, width);
+                if (Cast->getType()->isIntegerTy(1))
+                    Builder.emitOp("and", "$1", to, width);
+            }
+        }
+
+        // Add the values @V stands for when it is used as an address to @Out: the operands of a GEP that is folded
+        // (or @expand is set) or a constant expression, and @V itself otherwise
+        void addressLeaves(Value *V, SmallVectorImpl<Value *> &Out, bool expand = false)
+        {
+            if (expand || Folded.count(V) || isa<ConstantExpr>(V))
+            {
+                for (Value *Operand : cast<User>(V)->operands())
+                    addressLeaves(Operand, Out);
+                return;
+            }
+            Out.push_back(V);
+        }
+
+        // A register to work out an address in, see AddressScratch
+        std::string takeScratch(AddressScratch &S)
+        {
+            std::string reg;
+            if (!S.Free.empty())
+            {
+                reg = S.Free.back();
+                S.Free.pop_back();
+            }
+            else
+            {
+                for (std::string candidate : registers)
+                {
+                    if (!S.Avoid.count(candidate))
+                    {
+                        reg = candidate;
+                        break;
+                    }
+                }
+                Mem.push();
+                Builder.push(reg);
+                S.Saved.push_back(reg);
+            }
+            S.Avoid.insert(reg);
+            return reg;
+        }
+
+        // Give back the registers pushed by takeScratch
+        void restoreScratch(AddressScratch &S)
+        {
+            for (auto It = S.Saved.rbegin(); It != S.Saved.rend(); ++It)
+            {
+                Mem.pop();
+                Builder.pop(*It);
+            }
+        }
+
+        // Add @Idx * @size to @AM
+        void addIndex(AddressMode &AM, Value *Idx, int64_t size, AddressScratch &S)
+        {
+            // %rip can't be used with an index, so the symbol's address goes in a register
+            if (!AM.Symbol.empty())
+            {
+                std::string reg = takeScratch(S);
+                Builder.lea(AM.str(), reg);
+                AM = AddressMode();
+                AM.Base = reg;
+            }
+            // There's only room for one index, so an address that already has one is worked out first
+            if (!AM.Index.empty())
+            {
+                std::string reg = takeScratch(S);
+                Builder.lea(AM.str(), reg);
+                AM = AddressMode();
+                AM.Base = reg;
+            }
+
+            std::string loc = Mem.getLocationFor(Idx);
+            bool scalable = (size == 1 || size == 2 || size == 4 || size == 8);
+            if (scalable && widthOf(Idx) == REGISTER_SIZE && !X86Builder::isSlot(loc))
+            {
+                AM.Index = loc;
+                AM.Scale = size;
+                return;
+            }
+
+            // Otherwise the index is sign extended to 64 bits (and scaled) in a scratch register
+            std::string reg = takeScratch(S);
+            if (widthOf(Idx) == REGISTER_SIZE)
+                Builder.move(loc, reg);
+            else
+                Builder.extend(loc, reg, 4, REGISTER_SIZE, true);
+            if (!scalable)
+            {
+                Builder.emitOp("imul", "$" + std::to_string(size), reg);
+                size = 1;
+            }
+            AM.Index = reg;
+            AM.Scale = size;
+        }
+
+        // Fold the address @Ptr into @AM. Allocas and globals become the base, folded and constant GEPs (or @Ptr
+        // itself, if @expand is set) add their indices, and only what doesn't fit is worked out in scratch registers.
+        void decompose(Value *Ptr, AddressMode &AM, AddressScratch &S, bool expand = false)
+        {
+            GEPOperator *GEP = dyn_cast<GEPOperator>(Ptr);
+            if (GEP && (expand || Folded.count(Ptr) || isa<ConstantExpr>(Ptr)))
+            {
+                decompose(GEP->getPointerOperand(), AM, S);
+                for (gep_type_iterator GTI = gep_type_begin(GEP), E = gep_type_end(GEP); GTI != E; ++GTI)
+                {
+                    Value *Idx = GTI.getOperand();
+                    if (StructType *Struct = GTI.getStructTypeOrNull())
+                    {
+                        AM.Disp += DL->getStructLayout(Struct)->getElementOffset(cast<ConstantInt>(Idx)->getZExtValue());
+                        continue;
+                    }
 
-            // Make our comparison
-            Builder.cmp(loc1, loc0);
+                    int64_t size = DL->getTypeAllocSize(GTI.getIndexedType());
+                    if (ConstantInt *Const = dyn_cast<ConstantInt>(Idx))
+                        AM.Disp += Const->getSExtValue() * size;
+                    else
+                        addIndex(AM, Idx, size, S);
+                }
+                return;
+            }
 
-            // Jump based on predicate to the true Block
-            Builder.jxx(op, trueBlock);
+            ConstantExpr *Cast = dyn_cast<ConstantExpr>(Ptr);
+            if ((Cast && Cast->isCast()) || (isa<BitCastInst>(Ptr) && Folded.count(Ptr)))
+            {
+                decompose(cast<User>(Ptr)->getOperand(0), AM, S);
+            }
+            else if (AllocaInst *Array = dyn_cast<AllocaInst>(Ptr))
+            {
+                AM.Base = "%rbp";
+                AM.Disp -= ArrayDepth[Array];
+            }
+            else if (GlobalVariable *G = dyn_cast<GlobalVariable>(Ptr))
+            {
+                AM.Symbol = G->getName().str();
+            }
+            else
+            {
+                // Any other pointer was computed into a register or stack slot
+                std::string loc = Mem.getLocationFor(Ptr);
+                if (X86Builder::isSlot(loc))
+                {
+                    std::string reg = takeScratch(S);
+                    Builder.move(loc, reg);
+                    loc = reg;
+                }
+                AM.Base = loc;
+            }
+        }
 
-            // Otherwise we continue into the false block (I guess this doesn't actually need a label...)
-            Builder.label(falseBlock);
-            Builder.move("$0", loc);
-            Builder.jmp(postBlock);
+        // The memory operand for what @Ptr points to, working out whatever doesn't fold into it in @S's registers
+        std::string addressOf(Value *Ptr, AddressScratch &S, bool expand = false)
+        {
+            SmallVector<Value *, 4> Leaves;
+            addressLeaves(Ptr, Leaves, expand);
+            for (Value *V : Leaves)
+            {
+                if (!isa<Constant>(V) && !isa<AllocaInst>(V))
+                    S.Avoid.insert(Mem.getLocationFor(V));
+            }
 
-            // True Block
-            Builder.label(trueBlock);
-            Builder.move("$1", loc);
+            AddressMode AM;
+            decompose(Ptr, AM, S, expand);
+            return AM.str();
+        }
 
-            // Once done, continue to Post Block
-            Builder.label(postBlock);
+        // Put the address @Ptr points to (or, for a GEP, computes) in @loc
+        void loadAddress(Value *Ptr, std::string loc)
+        {
+            AddressScratch S;
+            bool slot = X86Builder::isSlot(loc);
+            if (!slot)
+                S.Free.push_back(loc);
+
+            std::string address = addressOf(Ptr, S, isa<GetElementPtrInst>(Ptr));
+            std::string reg = slot ? takeScratch(S) : loc;
+            Builder.lea(address, reg);
+            if (slot)
+                Builder.move(reg, loc);
+            restoreScratch(S);
+        }
+
+        // Give the allocas and globals @I uses as values (rather than as the address of a load or store) a location
+        // holding their address, as well as constant addresses and the integers made from them. Like constants, they
+        // are released once @I is done.
+        void materializeAddresses(Instruction *I)
+        {
+            if (isa<LoadInst>(I) || isa<GetElementPtrInst>(I) || Folded.count(I))
+                return;
+
+            StoreInst *Store = dyn_cast<StoreInst>(I);
+            for (Value *V : I->operands())
+            {
+                if (Store && V == Store->getPointerOperand())
+                    continue;
+                ConstantExpr *Expr = dyn_cast<ConstantExpr>(V);
+                bool address = Expr && (Expr->getType()->isPointerTy() || Expr->getOpcode() == Instruction::PtrToInt);
+                if (isa<AllocaInst>(V) || isa<GlobalVariable>(V) || address)
+                    loadAddress(V, Mem.getLocationFor(V));
+            }
+        }
+
+        // Handle an LLVM Load, reading straight from its (folded) address
+        void handleLoadInstruction(LoadInst *Load)
+        {
+            std::string loc = Mem.getLocationFor(Load);
+            unsigned bytes = DL->getTypeStoreSize(Load->getType());
+            unsigned width = widthOf(Load);
+
+            // The result's register can be used to work out the address, since it is only written at the end
+            AddressScratch S;
+            bool slot = X86Builder::isSlot(loc);
+            if (!slot && width <= REGISTER_SIZE)
+                S.Free.push_back(loc);
+
+            std::string address = addressOf(Load->getPointerOperand(), S);
+            if (width > REGISTER_SIZE)
+            {
+                // Vectors go through a vector register of the builder's on their way to a stack slot
+                Builder.move(address, loc, width);
+                restoreScratch(S);
+                return;
+            }
+
+            std::string reg = slot ? takeScratch(S) : loc;
+            if (bytes < 4)
+                Builder.extend(address, reg, bytes, 4, false);
+            else
+                Builder.move(address, reg, width);
+            if (slot)
+                Builder.move(reg, loc, width);
+            restoreScratch(S);
+        }
+
+        // Handle an LLVM Store, writing straight to its (folded) address
+        void handleStoreInstruction(StoreInst *Store)
+        {
+            Value *V = Store->getValueOperand();
+            unsigned bytes = DL->getTypeStoreSize(V->getType());
+            std::string value = Mem.getLocationFor(V, true);
+
+            AddressScratch S;
+            S.Avoid.insert(value);
+            std::string address = addressOf(Store->getPointerOperand(), S);
+            if (widthOf(V) > REGISTER_SIZE)
+            {
+                Builder.move(value, address, widthOf(V));
+                restoreScratch(S);
+                return;
+            }
+            // Memory can't be moved to memory, and only a 32-bit constant can be stored directly
+            ConstantInt *Const = dyn_cast<ConstantInt>(V);
+            if (X86Builder::isSlot(value) || (Const && !isInt<32>(Const->getSExtValue())))
+            {
+                std::string reg = takeScratch(S);
+                Builder.move(value, reg, widthOf(V));
+                value = reg;
+            }
+            Builder.emitOp("mov", value, address, bytes);
+            restoreScratch(S);
+        }
+
+        // Handle an LLVM GEP that isn't folded into the loads and stores using it
+        void handleGetElementPtrInstruction(GetElementPtrInst *GEP)
+        {
+            if (Folded.count(GEP))
+                return;
+            loadAddress(GEP, Mem.getLocationFor(GEP));
         }
 
         // Handle LLVM PHI Node
@@ -722,7 +1773,7 @@ namespace
             for (auto P : blockMappings)
             {
                 BasicBlock *B = PHI->getIncomingBlock(P.first);
-                Builder.cmp("$" + getBlockId(B, false), "%rbx");
+                Builder.cmp("$" + getBlockId(B, false), "%rbx", 4);
                 Builder.jxx(CmpInst::ICMP_EQ, P.second);
             }
 
@@ -735,7 +1786,7 @@ namespace
 
                 // The placement is the value given to the PHI node if we come from this block
                 // So let's set it to the PHI nodes value location
-                Builder.move(placement, loc);
+                Builder.move(placement, loc, widthOf(PHI));
 
                 // And finaly jump to the end.
                 Builder.jmp(postPhi);
@@ -745,6 +1796,139 @@ namespace
             Builder.label(postPhi);
         }
 
+        // Handle arithmetic on <4 x i32> and <8 x i32> vectors, as made by the VectorPass
+        void handleVectorInstruction(Instruction *I)
+        {
+            std::string a = Mem.getLocationFor(I->getOperand(0), true);
+            std::string b = Mem.getLocationFor(I->getOperand(1), true);
+            std::string dest = Mem.getLocationFor(I);
+            unsigned width = widthOf(I);
+
+            switch (I->getOpcode())
+            {
+            case Instruction::Add:
+                Builder.vectorCalc("paddd", a, b, dest, width);
+                break;
+            case Instruction::Sub:
+                Builder.vectorCalc("psubd", a, b, dest, width);
+                break;
+            case Instruction::Mul:
+                if (Builder.SSE41)
+                    Builder.vectorCalc("pmulld", a, b, dest, width);
+                else
+                    Builder.vectorMultiply(a, b, dest);
+                break;
+            case Instruction::And:
+                Builder.vectorCalc("pand", a, b, dest, width);
+                break;
+            case Instruction::Or:
+                Builder.vectorCalc("por", a, b, dest, width);
+                break;
+            case Instruction::Xor:
+                Builder.vectorCalc("pxor", a, b, dest, width);
+                break;
+            default:
+                errs() << "UNSUPPORTED VECTOR INSTRUCTION " << I->getOpcodeName() << "\n";
+                exit(EXIT_FAILURE);
+            }
+        }
+
+        // Handle an LLVM insertelement, which the VectorPass only uses to put a value in lane 0 before a splat
+        void handleInsertElementInstruction(InsertElementInst *Insert)
+        {
+            ConstantInt *Lane = dyn_cast<ConstantInt>(Insert->getOperand(2));
+            if (!Lane || !Lane->isZero() || !isa<UndefValue>(Insert->getOperand(0)))
+            {
+                errs() << "UNSUPPORTED INSERTELEMENT\n";
+                exit(EXIT_FAILURE);
+            }
+
+            // movd can't take an immediate
+            Value *Op = Insert->getOperand(1);
+            std::string _from = Mem.getLocationFor(Op, true);
+            std::string from = Mem.getLocationFor(Op);
+            Builder.move(_from, from, 4);
+
+            std::string to = Mem.getLocationFor(Insert);
+            std::string reg = X86Builder::isVector(to) ? to : VECTOR_RESULT;
+            Builder.emit(Builder.vex("movd") + " " + X86Builder::operand(X86Builder::sized(from, 4)) + ", " + reg);
+            Builder.move(reg, to, widthOf(Insert));
+        }
+
+        // Handle an LLVM shufflevector, which the VectorPass only uses to splat lane 0 across a vector
+        void handleShuffleVectorInstruction(ShuffleVectorInst *Shuffle)
+        {
+            SmallVector<int, 8> Mask;
+            Shuffle->getShuffleMask(Mask);
+            if (any_of(Mask, [](int lane)
+                       { return lane != 0; }))
+            {
+                errs() << "UNSUPPORTED SHUFFLEVECTOR\n";
+                exit(EXIT_FAILURE);
+            }
+
+            unsigned width = widthOf(Shuffle);
+            std::string from = Mem.getLocationFor(Shuffle->getOperand(0), true);
+            std::string to = Mem.getLocationFor(Shuffle);
+            std::string reg = X86Builder::isVector(to) ? to : VECTOR_RESULT;
+            if (Builder.AVX)
+            {
+                // vpbroadcastd reads a single lane, so memory needs no alignment
+                Builder.emit("vpbroadcastd " + X86Builder::operand(from) + ", " + X86Builder::sized(reg, width));
+            }
+            else
+            {
+                if (!X86Builder::isVector(from))
+                {
+                    Builder.move(from, VECTOR_SCRATCH2, width);
+                    from = VECTOR_SCRATCH2;
+                }
+                Builder.emit("pshufd $0, " + from + ", " + reg);
+            }
+            Builder.move(reg, to, width);
+        }
+
+        // Handle an LLVM extractelement of a constant lane, as the VectorPass uses to fold its vector reductions
+        void handleExtractElementInstruction(ExtractElementInst *Extract)
+        {
+            ConstantInt *Lane = dyn_cast<ConstantInt>(Extract->getIndexOperand());
+            if (!Lane)
+            {
+                errs() << "UNSUPPORTED EXTRACTELEMENT\n";
+                exit(EXIT_FAILURE);
+            }
+
+            Value *Vec = Extract->getVectorOperand();
+            int lane = Lane->getZExtValue();
+            std::string from = Mem.getLocationFor(Vec, true);
+            std::string to = Mem.getLocationFor(Extract);
+
+            // A lane of a vector in a stack slot is read straight from its place in the slot
+            if (X86Builder::isSlot(from))
+            {
+                Builder.move(std::to_string(stoi(from) + 4 * lane), to, 4);
+                return;
+            }
+
+            if (!X86Builder::isVector(from))
+            {
+                Builder.move(from, VECTOR_SCRATCH2, widthOf(Vec));
+                from = VECTOR_SCRATCH2;
+            }
+            if (lane >= 4)
+            {
+                Builder.emit("vextracti128 $1, " + X86Builder::sized(from, 32) + ", " VECTOR_SCRATCH2);
+                from = VECTOR_SCRATCH2;
+                lane -= 4;
+            }
+            if (lane)
+            {
+                Builder.emit(Builder.vex("pshufd") + " $" + std::to_string(lane) + ", " + from + ", " VECTOR_SCRATCH2);
+                from = VECTOR_SCRATCH2;
+            }
+            Builder.emit(Builder.vex("movd") + " " + from + ", " + X86Builder::operand(X86Builder::sized(to, 4)));
+        }
+
         // Handle LLVM Arithmetic Instructions
         void
         handleRemainingInstruction(Instruction *I)
@@ -764,61 +1948,62 @@ namespace
                 Builder.push(loc0);
             }
 
-            Builder.move(_loc0, loc0);
+            Builder.move(_loc0, loc0, widthOf(Op0));
 
             std::string loc1 = Mem.getLocationFor(Op1, true);
 
             std::string resLoc = Mem.getLocationFor(I);
+            unsigned width = widthOf(I);
 
             if (op == Instruction::Add)
             {
-                Builder.calc("add", loc1, loc0, resLoc);
+                Builder.calc("add", loc1, loc0, resLoc, width);
             }
             else if (op == Instruction::Sub)
             {
-                Builder.calc("sub", loc1, loc0, resLoc);
+                Builder.calc("sub", loc1, loc0, resLoc, width);
+            }
+            else if (op == Instruction::Mul)
+            {
+                // Two-operand imul keeps only the low half, which is all an LLVM mul produces
+                Builder.calc("imul", loc1, loc0, resLoc, width);
+            }
+            else if (op == Instruction::And || op == Instruction::Or || op == Instruction::Xor)
+            {
+                Builder.calc(I->getOpcodeName(), loc1, loc0, resLoc, width);
             }
-            else if (op == Instruction::SDiv)
+            else if (op == Instruction::SDiv || op == Instruction::SRem)
             {
-                // Save our old value of %rax
+                // idiv writes %rax and %rdx, so save whatever they were holding.
                 Mem.push();
                 Builder.push("%rax");
-                // save our old value of %rdx
                 Mem.push();
                 Builder.push("%rdx");
-                // For division we need 0 to be in rdx
-                Builder.move("$0", "%rdx");
-                // %rax must be the numerator, so let's set it as such
-                Builder.move(loc0, "%rax");
-
-                std::string _loc1 = Mem.getLocationFor(Op1, true);
-                std::string loc1 = Mem.getLocationFor(Op1, false, "%rdx");
-                // Move in our denominator
-                Builder.move(_loc1, loc1);
-
-                // Perform division
-                Builder.calc("div", loc1);
-                // Return old %rdx, we don't care about the remainder
+
+                // Keep the divisor in a register that neither the instruction nor the numerator touches
+                std::string scratch = (loc0 == "%rcx") ? "%rsi" : "%rcx";
+                Mem.push();
+                Builder.push(scratch);
+                Builder.move(Mem.getLocationFor(Op1, true), scratch, width);
+
+                // %rax must be the numerator, sign extended into %rdx
+                Builder.move(loc0, "%rax", width);
+                Builder.emit(width == 4 ? "cltd" : "cqto");
+                Builder.calc("idiv", scratch, width);
+
                 Mem.pop();
-                Builder.pop("%rdx");
-                // Move our result into the proper location
-                Builder.move("%rax", resLoc);
-                // Return old %rax
+                Builder.pop(scratch);
+                // The quotient is in %rax and the remainder in %rdx
+                Builder.move(op == Instruction::SDiv ? "%rax" : "%rdx", resLoc, width);
                 Mem.pop();
-                Builder.pop("%rax");
+                restore("%rdx", resLoc);
+                Mem.pop();
+                restore("%rax", resLoc);
             }
-            else if (op == Instruction::Mul)
+            else
             {
-                std::string _loc1 = Mem.getLocationFor(Op1, true);
-                std::string loc1 = Mem.getLocationFor(Op1);
-                Builder.move(_loc1, loc1);
-                Builder.debug("----------------");
-                // Multiply by %rax, so move one value in there
-                Builder.move(loc0, "%rax");
-                Builder.calc("mul", loc1);
-                // move result into proper location
-                Builder.move("%rax", resLoc);
-                Builder.debug("----------------");
+                errs() << "UNSUPPORTED INSTRUCTION " << I->getOpcodeName() << "\n";
+                exit(EXIT_FAILURE);
             }
 
             // Return old value back to proper location
@@ -829,16 +2014,81 @@ namespace
             }
         }
 
+        // Give back the locations of values that have no uses left once @I has been generated.
+        //
+        // Walks the block backwards from its live-out set, so each value is found dead at its last use.
+        // A value is only released in the last block (in layout order) it is live in, since blocks
+        // are generated in that order and share one register assignment.
+        std::map<Instruction *, std::vector<Value *>> findDeadValues(BasicBlock &B)
+        {
+            std::map<Instruction *, std::vector<Value *>> Dead;
+            unsigned index = BlockOrder[&B];
+
+            BitVector LiveNow = Live.LiveOut[&B];
+            for (auto It = B.rbegin(), End = B.rend(); It != End; ++It)
+            {
+                Instruction *I = &*It;
+
+                int def = Live.numberOf(I);
+                if (def >= 0)
+                {
+                    if (!LiveNow.test(def))
+                        Dead[I].push_back(I);
+                    LiveNow.reset(def);
+                }
+
+                // Folded GEPs are worked out by the loads and stores using them, so that's where their operands are used
+                SmallVector<Value *, 4> Operands;
+                for (Value *V : I->operands())
+                    addressLeaves(V, Operands);
+
+                for (Value *V : Operands)
+                {
+                    int n = Live.numberOf(V);
+                    if (n < 0 || LiveNow.test(n))
+                        continue;
+
+                    LiveNow.set(n);
+                    if (LastBlock[n] == index)
+                        Dead[I].push_back(V);
+                }
+            }
+
+            return Dead;
+        }
+
+        // Release everything @I was the last user of, including the constants and addresses it materialized.
+        void releaseDeadValues(Instruction *I, std::vector<Value *> const &Dead)
+        {
+            for (Value *V : Dead)
+            {
+                Mem.release(V);
+            }
+            for (Value *V : I->operands())
+            {
+                if (isa<Constant>(V) || isa<AllocaInst>(V))
+                    Mem.release(V);
+            }
+        }
+
         // Process an LLVM block
         void processBlock(BasicBlock &B)
         {
 
             // Start new block
             Mem.startNewBlock(&B);
+            Mem.stack_offset = BodyStackOffset;
+
+            std::map<Instruction *, std::vector<Value *>> Dead = findDeadValues(B);
 
             // Label it
             Builder.label(getBlockId(&B));
 
+            // Give anything live into this block a location now. A value can be live here even though it is
+            // defined in a block laid out later, and its location has to be kept from then on.
+            for (unsigned n : Live.LiveIn[&B].set_bits())
+                Mem.getLocationFor(const_cast<Value *>(Live.Values[n]));
+
             // Iterate over all instructions in block
             BasicBlock::iterator Iter = B.begin();
             while (Iter != B.end())
@@ -846,9 +2096,11 @@ namespace
                 Instruction *I = &*Iter;
 
                 // Label each instruction just for easier development
-                Builder.label("INSTRUCTION_" + std::to_string(nextBlock));
+                Builder.label("INSTRUCTION_" + FunctionName + "_" + std::to_string(nextBlock));
                 nextBlock++;
 
+                materializeAddresses(I);
+
                 if (ReturnInst *Ret = dyn_cast<ReturnInst>(I))
                 {
                     handleReturnInstruction(Ret);
@@ -869,13 +2121,256 @@ namespace
                 {
                     handleCompareInstruction(Cmp);
                 }
+                else if (CastInst *Cast = dyn_cast<CastInst>(I))
+                {
+                    handleCastInstruction(Cast);
+                }
+                else if (SelectInst *Select = dyn_cast<SelectInst>(I))
+                {
+                    handleSelectInstruction(Select);
+                }
+                else if (LoadInst *Load = dyn_cast<LoadInst>(I))
+                {
+                    handleLoadInstruction(Load);
+                }
+                else if (StoreInst *Store = dyn_cast<StoreInst>(I))
+                {
+                    handleStoreInstruction(Store);
+                }
+                else if (GetElementPtrInst *GEP = dyn_cast<GetElementPtrInst>(I))
+                {
+                    handleGetElementPtrInstruction(GEP);
+                }
+                else if (isa<AllocaInst>(I))
+                {
+                    // Its memory was set aside along with the frame
+                }
+                else if (InsertElementInst *Insert = dyn_cast<InsertElementInst>(I))
+                {
+                    handleInsertElementInstruction(Insert);
+                }
+                else if (ShuffleVectorInst *Shuffle = dyn_cast<ShuffleVectorInst>(I))
+                {
+                    handleShuffleVectorInstruction(Shuffle);
+                }
+                else if (ExtractElementInst *Extract = dyn_cast<ExtractElementInst>(I))
+                {
+                    handleExtractElementInstruction(Extract);
+                }
+                else if (I->getType()->isVectorTy())
+                {
+                    handleVectorInstruction(I);
+                }
                 else
                 {
                     handleRemainingInstruction(I);
                 }
 
+                releaseDeadValues(I, Dead[I]);
+
                 ++Iter;
             }
+
+            // Values that flow around a loop back edge are finished once their last block is done
+            unsigned index = BlockOrder[&B];
+            for (unsigned n : Live.LiveOut[&B].set_bits())
+            {
+                if (LastBlock[n] == index)
+                    Mem.release(const_cast<Value *>(Live.Values[n]));
+            }
+        }
+
+        // Number the CFG edges of @F, starting from FirstEdge, in block order and then successor order
+        void numberEdges(Function &F)
+        {
+            unsigned edge = FirstEdge;
+            for (BasicBlock &B : F)
+            {
+                EdgeIndex[&B] = edge;
+                edge += succ_size(&B);
+            }
+        }
+
+        // Decide the order blocks are generated in.
+        //
+        // Without a profile that's the order of the IR. With one, starting from the entry block, each block is
+        // followed by its hottest successor that isn't placed yet, so the hot path falls through from block to
+        // block. When there is none, the hottest block left starts the next chain. Blocks that never ran end up
+        // last, in IR order, which also leaves them whatever registers the hot blocks didn't need, since registers
+        // are handed out in layout order.
+        void layoutBlocks(Function &F)
+        {
+            Layout.clear();
+            if (!Profile)
+            {
+                for (BasicBlock &B : F)
+                    Layout.push_back(&B);
+                return;
+            }
+
+            // How often each block ran, from the edges into it
+            std::map<BasicBlock *, uint64_t> Frequency;
+            for (BasicBlock &B : F)
+            {
+                unsigned succ = 0;
+                for (BasicBlock *S : successors(&B))
+                    Frequency[S] += edgeCount(&B, succ++);
+            }
+
+            std::set<BasicBlock *> Placed;
+            BasicBlock *B = &F.getEntryBlock();
+            while (B)
+            {
+                Layout.push_back(B);
+                Placed.insert(B);
+
+                BasicBlock *Next = nullptr;
+                uint64_t best = 0;
+                unsigned succ = 0;
+                for (BasicBlock *S : successors(B))
+                {
+                    uint64_t count = edgeCount(B, succ++);
+                    if (!Placed.count(S) && count > best)
+                    {
+                        Next = S;
+                        best = count;
+                    }
+                }
+
+                if (!Next)
+                {
+                    for (BasicBlock &Other : F)
+                    {
+                        if (Placed.count(&Other))
+                            continue;
+                        if (!Next || Frequency[&Other] > Frequency[Next])
+                            Next = &Other;
+                    }
+                }
+                B = Next;
+            }
+        }
+
+        // Whether @I is a GEP or pointer bitcast that only gives the address of loads and stores in its own block,
+        // directly or through other such instructions
+        bool onlyAddresses(Instruction *I)
+        {
+            bool address = isa<GetElementPtrInst>(I) || (isa<BitCastInst>(I) && I->getType()->isPointerTy());
+            if (!address || I->user_empty())
+                return false;
+
+            return all_of(I->users(), [&](User *U)
+                          {
+                              Instruction *User = dyn_cast<Instruction>(U);
+                              if (!User || User->getParent() != I->getParent())
+                                  return false;
+                              if (StoreInst *Store = dyn_cast<StoreInst>(User))
+                                  return Store->getValueOperand() != I;
+                              return isa<LoadInst>(User) || onlyAddresses(User);
+                          });
+        }
+
+        // Find the GEPs (and the casts of them the VectorPass makes) that only give the address of loads and stores.
+        // Those are folded into the loads' and stores' memory operands instead of being worked out on their own.
+        void findFoldedAddresses(Function &F)
+        {
+            Folded.clear();
+            for (Instruction &I : instructions(F))
+            {
+                if (onlyAddresses(&I))
+                    Folded.insert(&I);
+            }
+        }
+
+        // Find the integer compares whose only use is as the condition of a select in their own block. The select
+        // compares the operands itself, right before its cmov, instead of testing a 0 or 1 the compare left.
+        void findFoldedCompares(Function &F)
+        {
+            // cmp takes one constant at most, and an address would have to be worked out first
+            auto plain = [](Value *V)
+            { return isa<ConstantInt>(V) || isa<Argument>(V) || (isa<Instruction>(V) && !isa<AllocaInst>(V)); };
+
+            for (Instruction &I : instructions(F))
+            {
+                ICmpInst *Cmp = dyn_cast<ICmpInst>(&I);
+                if (!Cmp || !Cmp->hasOneUse() || !Cmp->getOperand(0)->getType()->isIntegerTy())
+                    continue;
+                SelectInst *Select = dyn_cast<SelectInst>(Cmp->user_back());
+                if (!Select || Select->getCondition() != Cmp || Select->getParent() != Cmp->getParent())
+                    continue;
+
+                Value *Op0 = Cmp->getOperand(0);
+                Value *Op1 = Cmp->getOperand(1);
+                if (plain(Op0) && plain(Op1) && !(isa<ConstantInt>(Op0) && isa<ConstantInt>(Op1)))
+                    Folded.insert(Cmp);
+            }
+        }
+
+        // Give every alloca its memory in the frame, right below the static registers. Spill slots go below them.
+        void allocateArrays(Function &F)
+        {
+            unsigned depth = FRAME_BASE;
+            for (Instruction &I : instructions(F))
+            {
+                AllocaInst *Array = dyn_cast<AllocaInst>(&I);
+                if (!Array)
+                    continue;
+
+                ConstantInt *Count = dyn_cast<ConstantInt>(Array->getArraySize());
+                if (!Count)
+                {
+                    errs() << "UNSUPPORTED VARIABLE SIZED ALLOCA\n";
+                    exit(EXIT_FAILURE);
+                }
+                uint64_t size = DL->getTypeAllocSize(Array->getAllocatedType()) * Count->getZExtValue();
+                depth = alignTo(depth + size, std::max<uint64_t>(1, Array->getAlignment()));
+                ArrayDepth[Array] = depth;
+            }
+
+            Mem.SpillBase = alignTo(depth, REGISTER_SIZE);
+            Mem.FrameSize = Mem.SpillBase - FRAME_BASE;
+        }
+
+        // Compute the layout and liveness for @F, and the last block each value is live in
+        void analyzeFunction(Function &F)
+        {
+            auto start = std::chrono::steady_clock::now();
+            numberEdges(F);
+            layoutBlocks(F);
+            Live.compute(F);
+            findFoldedAddresses(F);
+            findFoldedCompares(F);
+
+            BlockOrder.clear();
+            LastBlock.assign(Live.Numbers.size(), 0);
+
+            unsigned index = 0;
+            for (BasicBlock *BB : Layout)
+            {
+                BasicBlock &B = *BB;
+                BlockOrder[&B] = index;
+
+                BitVector Touched = Live.LiveIn[&B];
+                Touched |= Live.LiveOut[&B];
+                for (Instruction &I : B)
+                {
+                    if (Live.numberOf(&I) >= 0)
+                        Touched.set(Live.numberOf(&I));
+                    for (Value *V : I.operands())
+                    {
+                        int n = Live.numberOf(V);
+                        if (n >= 0)
+                            Touched.set(n);
+                    }
+                }
+
+                for (unsigned n : Touched.set_bits())
+                    LastBlock[n] = index;
+
+                index++;
+            }
+
+            LivenessTime = std::chrono::steady_clock::now() - start;
         }
 
         // Process LLVM Function
@@ -889,6 +2384,7 @@ namespace
             }
 
             // Label it
+            FunctionName = name;
             Builder.label(name);
 
             // Classic Function Setup
@@ -902,6 +2398,11 @@ namespace
                 Builder.push(reg);
             }
 
+            // Room for spilled values
+            FrameSetup = Builder.Instructions.size();
+            Builder.debug("spill frame");
+            BodyStackOffset = Mem.stack_offset;
+
             auto AIter = F.arg_begin();
 
             // Set argument to be in %rdi
@@ -912,18 +2413,249 @@ namespace
 
             // Start it
             Mem.startNewFunction();
+            Mem.PoolPrefix = "__" + name + "_vec";
+            DL = &F.getParent()->getDataLayout();
+            Builder.AVX = hasFeature(F, "+avx2");
+            Builder.SSE41 = Builder.AVX || hasFeature(F, "+sse4.1");
+            allocateArrays(F);
+            analyzeFunction(F);
 
             // Process each block
-            for (auto &B : F)
+            for (unsigned i = 0; i < Layout.size(); i++)
             {
-                processBlock(B);
+                FallThrough = (i + 1 < Layout.size()) ? Layout[i + 1] : nullptr;
+                processBlock(*Layout[i]);
             }
 
-            // Close it off properly
-            while (Mem.stack_offset < 0)
+            // Every block ends in a branch or return, so all that's left is sizing the frame
+            finishFrame();
+
+            for (auto P : Mem.Pool)
+                Builder.readOnly(P.second, P.first, *DL);
+        }
+
+        // Whether @F may use the instructions of the target feature @feature, like "+avx2"
+        static bool hasFeature(Function &F, StringRef feature)
+        {
+            if (!F.hasFnAttribute("target-features"))
+                return false;
+            SmallVector<StringRef, 8> Features;
+            F.getFnAttribute("target-features").getValueAsString().split(Features, ',');
+            return is_contained(Features, feature);
+        }
+
+        // Turn the frame placeholders into real instructions if anything was spilled. They stay comments otherwise.
+        void finishFrame()
+        {
+            if (Mem.FrameSize == 0)
+                return;
+
+            unsigned size = alignTo(Mem.FrameSize, REGISTER_SIZE);
+            Builder.Instructions[FrameSetup] = "sub $" + std::to_string(size) + ", %rsp";
+            for (size_t index : FrameTeardowns)
+                Builder.Instructions[index] = "lea -" + std::to_string(FRAME_BASE) + "(%rbp), %rsp";
+            Builder.NumEmitted += 1 + FrameTeardowns.size();
+        }
+
+    };
+
+    // What was emitted for a single function
+    struct FunctionStats
+    {
+        std::string Name;
+        unsigned Instructions = 0;
+        unsigned PushPops = 0;
+        unsigned Jumps = 0;
+        unsigned Spills = 0;
+        unsigned StackSlots = 0;
+        double LivenessSeconds = 0;
+        double TotalSeconds = 0;
+
+        // Fill in from a finished Generator, and add to the -stats counters
+        void record(Generator const &G, std::chrono::duration<double> total)
+        {
+            Name = G.FunctionName;
+            Instructions = G.Builder.NumEmitted;
+            PushPops = G.Builder.NumPushes;
+            Jumps = G.Builder.NumJumps;
+            Spills = G.Mem.NumSpills;
+            StackSlots = G.Mem.MaxStackSlots;
+            LivenessSeconds = G.LivenessTime.count();
+            TotalSeconds = total.count();
+
+            count();
+        }
+
+        // Fill in from the @Counts kept in a function's cache entry instead
+        void restore(std::string const &Function, unsigned const Counts[5])
+        {
+            Name = Function;
+            Instructions = Counts[0];
+            PushPops = Counts[1];
+            Jumps = Counts[2];
+            Spills = Counts[3];
+            StackSlots = Counts[4];
+            count();
+        }
+
+        // The counts for a cache entry, in the order restore takes them
+        void save(unsigned Counts[5]) const
+        {
+            Counts[0] = Instructions;
+            Counts[1] = PushPops;
+            Counts[2] = Jumps;
+            Counts[3] = Spills;
+            Counts[4] = StackSlots;
+        }
+
+        // Add to the -stats counters
+        void count()
+        {
+            NumInstructions += Instructions;
+            NumPushPops += PushPops;
+            NumJumps += Jumps;
+            NumSpills += Spills;
+            NumStackSlots += StackSlots;
+        }
+    };
+
+    // Drives a Generator per function across a pool of threads, then stitches their code together in module order.
+    struct ModuleGenerator
+    {
+        // What comes before and after all of the functions
+        X86Builder Header;
+        X86Builder Footer;
+        // Generated code of each function, in module order
+        std::vector<std::string> Buffers;
+        std::vector<FunctionStats> Stats;
+        // Whether each function's code came from the cache
+        std::vector<char> FromCache;
+
+        // Number of the first CFG edge of each function, and how many edges the module has in all
+        std::vector<unsigned> FirstEdges;
+        unsigned NumEdges = 0;
+        // Hash of the module's CFG, so a profile of a different program isn't applied to this one
+        uint64_t CFGHash = 0;
+        // Edge counts read from -generatorpass-profile, empty if there are none
+        std::vector<uint64_t> Profile;
+
+        // Number every CFG edge of the module, and hash the shape of its CFG
+        void numberEdges(std::vector<Function *> const &Functions)
+        {
+            std::string Shape;
+            raw_string_ostream OS(Shape);
+            for (Function *F : Functions)
             {
-                Mem.pop();
-                Builder.pop("%r8");
+                FirstEdges.push_back(NumEdges);
+                OS << F->getName() << ":";
+                for (BasicBlock &B : *F)
+                {
+                    NumEdges += succ_size(&B);
+                    OS << succ_size(&B) << ",";
+                }
+                OS << ";";
+            }
+            CFGHash = xxHash64(OS.str());
+        }
+
+        // Read the edge counts in -generatorpass-profile, if they match this module
+        void loadProfile()
+        {
+            auto Buffer = MemoryBuffer::getFile(GeneratorProfile);
+            if (!Buffer)
+            {
+                errs() << "generatorpass: " << GeneratorProfile << ": " << Buffer.getError().message() << "\n";
+                return;
+            }
+
+            StringRef Data = (*Buffer)->getBuffer();
+            auto quad = [&](unsigned offset)
+            {
+                uint64_t value;
+                memcpy(&value, Data.data() + offset, sizeof(value));
+                return value;
+            };
+
+            if (Data.size() < PROFILE_HEADER_SIZE || !Data.startswith(PROFILE_MAGIC) || quad(8) != CFGHash ||
+                quad(16) != NumEdges || Data.size() != PROFILE_HEADER_SIZE + REGISTER_SIZE * NumEdges)
+            {
+                errs() << "generatorpass: " << GeneratorProfile << " is not a profile of this program, ignoring it\n";
+                return;
+            }
+
+            Profile.resize(NumEdges);
+            for (unsigned i = 0; i < NumEdges; i++)
+                Profile[i] = quad(PROFILE_HEADER_SIZE + REGISTER_SIZE * i);
+        }
+
+        // Whether the generated code can be cached: it doesn't depend on the rest of the module
+        bool cacheable()
+        {
+            return !GeneratorCache.empty() && !GeneratorInstrument && Profile.empty();
+        }
+
+        // Take @F's code from the cache entry rangepass spliced it in from, if that has it, as the @i'th buffer
+        bool lookUp(Function &F, unsigned i)
+        {
+            CacheEntry E;
+            if (!cacheable() || !F.hasFnAttribute(CACHE_HIT_ATTR) ||
+                !readCacheEntry(GeneratorCache, F.getFnAttribute(CACHE_HIT_ATTR).getValueAsString(), E) || !E.HasAssembly)
+                return false;
+
+            Buffers[i] = E.Assembly;
+            Stats[i].restore(F.getName().str(), E.Stats);
+            FromCache[i] = true;
+            NumCachedFunctions++;
+            return true;
+        }
+
+        // Store each function rangepass found missing from the cache (or spliced in without its code), now that
+        // what its callees return is known. Builds IR in the module's context, so the workers must be done.
+        void fillCache(std::vector<Function *> const &Functions)
+        {
+            for (unsigned i = 0; i < Functions.size(); i++)
+            {
+                Function &F = *Functions[i];
+                std::string Key;
+                if (FromCache[i])
+                    continue;
+                if (F.hasFnAttribute(CACHE_HIT_ATTR))
+                {
+                    Key = F.getFnAttribute(CACHE_HIT_ATTR).getValueAsString().str();
+                }
+                else if (F.hasFnAttribute(CACHE_KEY_ATTR))
+                {
+                    StringRef Hash, Names;
+                    std::tie(Hash, Names) = F.getFnAttribute(CACHE_KEY_ATTR).getValueAsString().split(';');
+                    SmallVector<StringRef, 4> Callees;
+                    Names.split(Callees, ',', -1, false);
+
+                    std::vector<std::pair<std::string, std::string>> Facts;
+                    for (StringRef Name : Callees)
+                    {
+                        Function *Callee = F.getParent()->getFunction(Name);
+                        if (!Callee || !Callee->hasFnAttribute(CACHE_FACTS_ATTR))
+                            break;
+                        Facts.push_back({Name.str(), Callee->getFnAttribute(CACHE_FACTS_ATTR).getValueAsString().str()});
+                    }
+                    if (Facts.size() != Callees.size())
+                        continue;
+                    Key = cacheKey(Hash, Facts);
+                }
+                else
+                {
+                    continue;
+                }
+
+                CacheEntry E;
+                E.Facts = F.getFnAttribute(CACHE_FACTS_ATTR).getValueAsString().str();
+                E.IR = functionModule(F);
+                if (E.IR.empty())
+                    continue;
+                E.HasAssembly = true;
+                E.Assembly = Buffers[i];
+                Stats[i].save(E.Stats);
+                writeCacheEntry(GeneratorCache, Key, E);
             }
         }
 
@@ -931,29 +2663,147 @@ namespace
         void processModule(Module &M)
         {
             // Start out module
-            Builder.start();
+            Header.start();
 
-            // Process each function
+            std::vector<Function *> Functions;
             for (auto &F : M)
             {
-                processFunction(F);
+                Functions.push_back(&F);
+            }
+            Buffers.assign(Functions.size(), "");
+            Stats.assign(Functions.size(), FunctionStats());
+            FromCache.assign(Functions.size(), false);
+
+            numberEdges(Functions);
+            if (!GeneratorProfile.empty())
+                loadProfile();
+
+            // Workers take the next function off a shared counter until there are none left.
+            // Only the IR is shared between them, and they only ever read it.
+            std::atomic<unsigned> next(0);
+            auto work = [&]()
+            {
+                for (unsigned i = next++; i < Functions.size(); i = next++)
+                {
+                    if (lookUp(*Functions[i], i))
+                        continue;
+                    auto start = std::chrono::steady_clock::now();
+                    Generator generator;
+                    generator.FirstEdge = FirstEdges[i];
+                    generator.Instrument = GeneratorInstrument;
+                    generator.Profile = Profile.empty() ? nullptr : &Profile;
+                    generator.processFunction(*Functions[i]);
+                    Buffers[i] = generator.Builder.assign();
+                    Stats[i].record(generator, std::chrono::steady_clock::now() - start);
+                }
+            };
+
+            unsigned threads = GeneratorThreads;
+            if (threads == 0)
+                threads = std::max(1u, std::thread::hardware_concurrency());
+            threads = std::min<unsigned>(threads, Functions.size());
+
+            if (threads <= 1)
+            {
+                work();
             }
+            else
+            {
+                std::vector<std::thread> Pool;
+                for (unsigned t = 0; t < threads; t++)
+                    Pool.emplace_back(work);
+                for (std::thread &T : Pool)
+                    T.join();
+            }
+            if (cacheable())
+                fillCache(Functions);
 
             // Close off module
-            Builder.close();
+            Footer.close(GeneratorInstrument, NumEdges, CFGHash, GeneratorInstrumentFile);
+            for (GlobalVariable &G : M.globals())
+            {
+                if (G.hasInitializer())
+                    Footer.global(G, M.getDataLayout());
+            }
+        }
+
+        // Perform the actual generation to @OS
+        void generate(raw_ostream &OS)
+        {
+            OS << Header.assign();
+            for (auto &Buffer : Buffers)
+            {
+                OS << Buffer;
+            }
+            OS << Footer.assign();
+            OS.flush();
+        }
+
+        // Assemble the generated code in-process and write the object file to @OS. Returns false if it didn't assemble.
+        bool generateObject(raw_ostream &OS)
+        {
+            std::string Assembly;
+            raw_string_ostream AsmOS(Assembly);
+            generate(AsmOS);
+
+            SmallVector<char, 0> Object;
+            if (!assembleObject(AsmOS.str(), "<generated assembly>", Object))
+                return false;
+
+            OS.write(Object.data(), Object.size());
+            OS.flush();
+            return true;
         }
 
-        // Perform the actual generation to stdout
-        void generate()
+        // Write the statistics of every generated function to @OS as JSON
+        void writeStats(raw_ostream &OS)
         {
-            std::cout << Builder.assign();
+            json::OStream J(OS, 2);
+            J.objectBegin();
+
+            // Every -stats counter registered in this process, including other passes loaded alongside this one.
+            // Counters only register under -stats, but unlike -stats' own report this works with a release LLVM.
+            J.attributeBegin("statistics");
+            J.objectBegin();
+            for (auto &Stat : GetStatistics())
+                J.attribute(Stat.first, Stat.second);
+            J.objectEnd();
+            J.attributeEnd();
+
+            J.attributeBegin("functions");
+            J.arrayBegin();
+            for (auto &S : Stats)
+            {
+                // Skipped functions (llvm intrinsics) have nothing to report
+                if (S.Name.empty())
+                    continue;
+
+                J.objectBegin();
+                J.attribute("name", S.Name);
+                J.attribute("instructions", S.Instructions);
+                J.attribute("push_pops", S.PushPops);
+                J.attribute("jumps", S.Jumps);
+                J.attribute("spills", S.Spills);
+                J.attribute("stack_slots", S.StackSlots);
+                J.attribute("liveness_seconds", S.LivenessSeconds);
+                J.attribute("total_seconds", S.TotalSeconds);
+                J.objectEnd();
+            }
+            J.arrayEnd();
+            J.attributeEnd();
+            J.objectEnd();
+            OS << "\n";
         }
     };
 
     struct GeneratorPass : public ModulePass
     {
         static char ID;
-        GeneratorPass() : ModulePass(ID) {}
+        // Where the assembly goes, stdout when not set
+        raw_ostream *Out;
+        // Whether to write an object regardless of -generatorpass-filetype
+        bool Object;
+        GeneratorPass(raw_ostream *Out = nullptr, bool Object = false) : ModulePass(ID), Out(Out), Object(Object) {}
 
         void getAnalysisUsage(AnalysisUsage &AU) const override
         {
@@ -963,11 +2813,45 @@ namespace
 
         bool runOnModule(Module &M) override
         {
-            Generator generator;
+            ModuleGenerator generator;
+
+            {
+                NamedRegionTimer T("codegen", "Liveness and instruction selection", DEBUG_TYPE,
+                                   "Assembly Generator Pass", TimePassesIsEnabled);
+                generator.processModule(M);
+            }
 
-            generator.processModule(M);
+            {
+                NamedRegionTimer T("output", "Writing assembly or object code", DEBUG_TYPE,
+                                   "Assembly Generator Pass", TimePassesIsEnabled);
+                raw_ostream &OS = Out ? *Out : outs();
+                if (Object || GeneratorFileType == OutputType::Object)
+                {
+                    if (!generator.generateObject(OS))
+                    {
+                        errs() << "generatorpass: could not assemble the generated code\n";
+                        exit(EXIT_FAILURE);
+                    }
+                }
+                else
+                {
+                    generator.generate(OS);
+                }
+            }
 
-            generator.generate();
+            if (!GeneratorStatsJSON.empty())
+            {
+                std::error_code EC;
+                raw_fd_ostream JSON(GeneratorStatsJSON, EC, sys::fs::OF_Text);
+                if (EC)
+                {
+                    errs() << "generatorpass: " << GeneratorStatsJSON << ": " << EC.message() << "\n";
+                }
+                else
+                {
+                    generator.writeStats(JSON);
+                }
+            }
 
             return false;
         }
@@ -991,3 +2875,8 @@ static void registerGeneratorPass(const PassManagerBuilder &,
 static RegisterStandardPasses
     RegisterMyPass(PassManagerBuilder::EP_EarlyAsPossible,
                    registerGeneratorPass);
+
+ModulePass *createGeneratorPass(raw_ostream &OS, bool Object)
+{
+    return new GeneratorPass(&OS, Object);
+}
@@ -0,0 +1,234 @@
+//
+// LLVM If-Conversion Pass
+//
+// Turns small if/else diamonds, and ifs without an else, that only decide
+// which value a PHI gets into selects on the branch's condition. The
+// instructions on either side are run whichever way the branch would have
+// gone, so only ones that can't trap or touch memory are moved, and only
+// as many as -ifconvpass-threshold allows. The generator makes each select a
+// cmov, so a branch that goes one way or the other depending on the data no
+// longer costs a misprediction.
+//
+#include "llvm/ADT/Statistic.h"
+#include "llvm/Pass.h"
+#include "llvm/IR/CFG.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
+#include "Cache.h"
+#include "Passes.h"
+
+using namespace llvm;
+
+#define DEBUG_TYPE "ifconvpass"
+
+STATISTIC(NumDiamonds, "Number of if/else diamonds turned into selects");
+STATISTIC(NumTriangles, "Number of ifs without an else turned into selects");
+STATISTIC(NumSelects, "Number of selects made in place of PHIs");
+STATISTIC(NumSpeculated, "Number of instructions moved out of a branch to run either way");
+
+static cl::opt<unsigned> IfConvThreshold("ifconvpass-threshold",
+                                         cl::desc("Most instructions moved out of the branches plus selects made "
+                                                  "for one diamond"),
+                                         cl::init(4));
+
+// Beginning of anonymous namespace. Keeping it anonymous prevents duplicate
+// namespaces from occurring, especially when merging code into the LLVM
+// pass directory (which we will not be doing.)
+namespace
+{
+    struct IfConvPass : public FunctionPass
+    {
+        static char ID;
+        IfConvPass() : FunctionPass(ID) {}
+
+        // Whether @I can be run when the branch it is on wouldn't have: integer arithmetic that can't trap, and that
+        // the generator knows, or a select from an earlier conversion
+        static bool speculatable(Instruction &I)
+        {
+            if (!I.getType()->isIntegerTy())
+                return false;
+            switch (I.getOpcode())
+            {
+            case Instruction::Add:
+            case Instruction::Sub:
+            case Instruction::Mul:
+            case Instruction::And:
+            case Instruction::Or:
+            case Instruction::Xor:
+            case Instruction::Select:
+                return true;
+            case Instruction::ZExt:
+            case Instruction::SExt:
+            case Instruction::Trunc:
+            case Instruction::ICmp:
+                return I.getOperand(0)->getType()->isIntegerTy();
+            default:
+                return false;
+            }
+        }
+
+        // Whether @B is a side of a branch out of @Head that can be run either way: only reached from @Head, going
+        // straight on to @Join, with nothing in it that can't be speculated. Its size goes into @Cost.
+        static bool isSide(BasicBlock *B, BasicBlock *Head, BasicBlock *Join, unsigned &Cost)
+        {
+            if (B == Head || B->getSinglePredecessor() != Head || B->getSingleSuccessor() != Join)
+                return false;
+            for (Instruction &I : *B)
+            {
+                if (&I == B->getTerminator())
+                    break;
+                if (!speculatable(I))
+                    return false;
+                Cost++;
+            }
+            return true;
+        }
+
+        // Turn the branch at the end of @Head into selects, if it is a diamond or triangle that can be.
+        // Returns whether it was.
+        bool convert(BasicBlock *Head)
+        {
+            BranchInst *Branch = dyn_cast<BranchInst>(Head->getTerminator());
+            if (!Branch || !Branch->isConditional() || isa<Constant>(Branch->getCondition()))
+                return false;
+            BasicBlock *Succ[2] = {Branch->getSuccessor(0), Branch->getSuccessor(1)};
+            if (Succ[0] == Succ[1])
+                return false;
+
+            // The block both ways meet in: one successor, if the other goes straight on to it, or else where both go
+            BasicBlock *Join = nullptr;
+            if (Succ[0]->getSingleSuccessor() == Succ[1])
+                Join = Succ[1];
+            else if (Succ[1]->getSingleSuccessor() == Succ[0])
+                Join = Succ[0];
+            else if (Succ[0]->getSingleSuccessor() == Succ[1]->getSingleSuccessor())
+                Join = Succ[0]->getSingleSuccessor();
+            if (!Join || Join == Head)
+                return false;
+
+            // The block each way comes into the join from: its side, or the head itself
+            BasicBlock *From[2];
+            unsigned Cost = 0;
+            for (unsigned s = 0; s < 2; s++)
+            {
+                if (Succ[s] == Join)
+                    From[s] = Head;
+                else if (isSide(Succ[s], Head, Join, Cost))
+                    From[s] = Succ[s];
+                else
+                    return false;
+            }
+
+            std::vector<PHINode *> Phis;
+            for (PHINode &Phi : Join->phis())
+            {
+                if (!Phi.getType()->isIntegerTy())
+                    return false;
+                Phis.push_back(&Phi);
+                if (Phi.getIncomingValueForBlock(From[0]) != Phi.getIncomingValueForBlock(From[1]))
+                    Cost++;
+            }
+            if (Cost > IfConvThreshold)
+                return false;
+
+            // Run both sides in the head, then pick each PHI's value with a select
+            for (unsigned s = 0; s < 2; s++)
+            {
+                if (From[s] == Head)
+                    continue;
+                while (&From[s]->front() != From[s]->getTerminator())
+                {
+                    From[s]->front().moveBefore(Branch);
+                    NumSpeculated++;
+                }
+            }
+            Value *Cond = Branch->getCondition();
+            for (PHINode *Phi : Phis)
+            {
+                Value *True = Phi->getIncomingValueForBlock(From[0]);
+                Value *False = Phi->getIncomingValueForBlock(From[1]);
+                Value *Picked = True;
+                if (True != False)
+                {
+                    Picked = SelectInst::Create(Cond, True, False, Phi->getName() + ".sel", Branch);
+                    NumSelects++;
+                }
+
+                for (unsigned s = 0; s < 2; s++)
+                {
+                    if (From[s] != Head)
+                        Phi->removeIncomingValue(From[s], false);
+                }
+                if (From[0] != Head && From[1] != Head)
+                    Phi->addIncoming(Picked, Head);
+                else
+                    Phi->setIncomingValue(Phi->getBasicBlockIndex(Head), Picked);
+            }
+
+            // The sides are only a jump to the join now, and nothing comes to them
+            BranchInst::Create(Join, Branch);
+            Branch->eraseFromParent();
+            for (unsigned s = 0; s < 2; s++)
+            {
+                if (From[s] != Head)
+                    From[s]->eraseFromParent();
+            }
+            if (From[0] != Head && From[1] != Head)
+                NumDiamonds++;
+            else
+                NumTriangles++;
+
+            // A PHI left with only the head coming in is just its select, and the join can be part of the head
+            for (PHINode *Phi : Phis)
+            {
+                if (Phi->getNumIncomingValues() == 1)
+                {
+                    Phi->replaceAllUsesWith(Phi->getIncomingValue(0));
+                    Phi->eraseFromParent();
+                }
+            }
+            MergeBlockIntoPredecessor(Join);
+            return true;
+        }
+
+        virtual bool runOnFunction(Function &F) override
+        {
+            // Spliced in from the cache, already converted
+            if (F.hasFnAttribute(CACHE_HIT_ATTR))
+                return false;
+
+            // Converting an inner diamond can make an outer one straight-line, so go until nothing changes
+            bool changed = false;
+            bool again = true;
+            while (again)
+            {
+                again = false;
+                for (BasicBlock &B : F)
+                {
+                    if (convert(&B))
+                    {
+                        again = changed = true;
+                        break;
+                    }
+                }
+            }
+            return changed;
+        };
+    };
+};
+
+// You can change the friendly and long names in RegisterPass to your own pass
+// name.
+char IfConvPass::ID = 0;
+static RegisterPass<IfConvPass> X("ifconvpass", "If-Conversion Pass",
+                                  false,  /* looks at CFG, true changed CFG */
+                                  false); /* analysis pass, true means analysis needs to run again */
+
+FunctionPass *createIfConvPass()
+{
+    return new IfConvPass();
+}
@@ -0,0 +1,30 @@
+//
+// Entry points for linking the passes into a tool directly, instead of
+// loading them into opt with -load.
+//
+#ifndef BJC_PASSES_H
+#define BJC_PASSES_H
+
+#include "llvm/Pass.h"
+#include "llvm/Support/raw_ostream.h"
+
+// Constant Propagation/Folding Pass (--constpass)
+llvm::ModulePass *createConstPass();
+
+// Value Range Propagation Pass (--rangepass)
+llvm::ModulePass *createRangePass();
+
+// Dead Code Removal Pass (--deadpass)
+llvm::FunctionPass *createDeadPass();
+
+// Loop Vectorization Pass (--vectorpass)
+llvm::FunctionPass *createVectorPass();
+
+// If-Conversion Pass (--ifconvpass)
+llvm::FunctionPass *createIfConvPass();
+
+// Assembly Generator Pass (--generatorpass), writing its assembly to @OS instead of stdout,
+// or an ELF object when @Object is set (or -generatorpass-filetype=obj is given)
+llvm::ModulePass *createGeneratorPass(llvm::raw_ostream &OS, bool Object = false);
+
+#endif
@@ -0,0 +1,487 @@
+//
+// LLVM Value Range Propagation Pass
+//
+// Works out the range every integer value can take, from the constants it is
+// computed from, the PHIs it flows through and the branches on the way to
+// it, and folds each compare the ranges decide to true or false. DeadPass
+// then removes the branches on those.
+//
+// A minic program is linked on its own, and only main is called from
+// outside it (by _start), so the arguments of any other function that is
+// only ever called directly take the ranges of what its calls pass it.
+//
+#include "llvm/ADT/PostOrderIterator.h"
+#include "llvm/ADT/Statistic.h"
+#include "llvm/Pass.h"
+#include "llvm/IR/CFG.h"
+#include "llvm/IR/ConstantRange.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/Dominators.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IR/Metadata.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/raw_ostream.h"
+#include "Cache.h"
+#include "Passes.h"
+#include <map>
+#include <memory>
+#include <set>
+
+using namespace llvm;
+
+#define DEBUG_TYPE "rangepass"
+
+STATISTIC(NumComparesFolded, "Number of compares folded to constants by their operands' ranges");
+STATISTIC(NumFunctionsNarrowed, "Number of functions whose arguments take their ranges from the calls to them");
+STATISTIC(NumCacheHits, "Number of functions spliced in from the cache");
+STATISTIC(NumCacheMisses, "Number of functions not in the cache");
+
+static cl::opt<bool> RangeWholeProgram("rangepass-whole-program",
+                                       cl::desc("Take main as the only function called from outside the module, "
+                                                "and narrow the arguments of the rest to what they are passed"),
+                                       cl::init(true));
+
+// How often a value's range may grow before it is pushed out to the end of its type
+#define WIDEN_AFTER 3
+// Passes over the module after it settles, to take back what widening gave away
+#define NARROW_PASSES 2
+
+// Beginning of anonymous namespace. Keeping it anonymous prevents duplicate
+// namespaces from occurring, especially when merging code into the LLVM
+// pass directory (which we will not be doing.)
+namespace
+{
+    // A compare that a conditional branch found true (or false, as Holds says) on its way to From. It holds
+    // everywhere From dominates, From having no other way in.
+    struct Condition
+    {
+        ICmpInst *Cmp;
+        bool Holds;
+        BasicBlock *From;
+    };
+
+    // @New, which contains @Old, with whichever of its signed bounds moved past @Old's taken to the end of the type
+    static ConstantRange widen(ConstantRange const &Old, ConstantRange const &New)
+    {
+        unsigned Width = New.getBitWidth();
+        if (Old.isEmptySet())
+            return New;
+
+        APInt Lower = New.getSignedMin(), Upper = New.getSignedMax();
+        if (Lower.slt(Old.getSignedMin()))
+            Lower = APInt::getSignedMinValue(Width);
+        if (Upper.sgt(Old.getSignedMax()))
+            Upper = APInt::getSignedMaxValue(Width);
+        if (Lower.isMinSignedValue() && Upper.isMaxSignedValue())
+            return ConstantRange::getFull(Width);
+        return ConstantRange(Lower, Upper + 1);
+    }
+
+    struct RangePass : public ModulePass
+    {
+        static char ID;
+        RangePass() : ModulePass(ID) {}
+
+        // Range of every integer value reached so far. One missing from it hasn't been, and has none yet.
+        std::map<Value *, ConstantRange> Ranges;
+        // How often each value's range has grown
+        std::map<Value *, unsigned> Updates;
+        // The branch conditions each value is compared in
+        std::map<Value *, std::vector<Condition>> Conditions;
+        // Functions whose arguments take the ranges of what they are passed
+        std::set<Function *> Narrowed;
+        std::map<Function *, std::unique_ptr<DominatorTree>> Trees;
+        // While narrowing, what the calls seen so far pass each argument
+        std::map<Value *, ConstantRange> Passed;
+        bool Narrowing = false;
+
+        // Whether every call of @F is known, so its arguments can be narrowed
+        static bool callersKnown(Function &F)
+        {
+            if (!RangeWholeProgram || F.isDeclaration() || F.isVarArg() || F.getName() == "main")
+                return false;
+            for (Use &U : F.uses())
+            {
+                CallInst *Call = dyn_cast<CallInst>(U.getUser());
+                if (!Call || !Call->isCallee(&U) || Call->getFunctionType() != F.getFunctionType())
+                    return false;
+            }
+            return true;
+        }
+
+        // The range of @V wherever it is used
+        ConstantRange rangeOf(Value *V)
+        {
+            unsigned Width = V->getType()->getIntegerBitWidth();
+            if (ConstantInt *C = dyn_cast<ConstantInt>(V))
+                return ConstantRange(C->getValue());
+            Argument *A = dyn_cast<Argument>(V);
+            if (!isa<Instruction>(V) && !(A && Narrowed.count(A->getParent())))
+                return ConstantRange::getFull(Width);
+
+            auto It = Ranges.find(V);
+            return It != Ranges.end() ? It->second : ConstantRange::getEmpty(Width);
+        }
+
+        // @R, the range of @V, cut down to what @Cmp being @Holds leaves it
+        ConstantRange refine(Value *V, ConstantRange R, ICmpInst *Cmp, bool Holds)
+        {
+            CmpInst::Predicate Pred = Holds ? Cmp->getPredicate() : Cmp->getInversePredicate();
+            Value *Other = Cmp->getOperand(1);
+            if (Cmp->getOperand(0) != V)
+            {
+                Pred = CmpInst::getSwappedPredicate(Pred);
+                Other = Cmp->getOperand(0);
+            }
+            if (Other == V)
+                return R;
+            return R.intersectWith(ConstantRange::makeAllowedICmpRegion(Pred, rangeOf(Other)));
+        }
+
+        // The range of @V in block @B, after the branches that had to be taken to get there
+        ConstantRange rangeAt(Value *V, BasicBlock *B)
+        {
+            ConstantRange R = rangeOf(V);
+            auto It = Conditions.find(V);
+            if (It == Conditions.end())
+                return R;
+
+            DominatorTree &DT = *Trees[B->getParent()];
+            for (Condition &C : It->second)
+            {
+                if (DT.dominates(C.From, B))
+                    R = refine(V, R, C.Cmp, C.Holds);
+            }
+            return R;
+        }
+
+        // The compare the branch out of @Pred decides on, if it is a conditional branch on one that can go to @B one way
+        // only, with @Holds set to whether the compare holds when it does
+        static ICmpInst *edgeCondition(BasicBlock *Pred, BasicBlock *B, bool &Holds)
+        {
+            BranchInst *Branch = dyn_cast<BranchInst>(Pred->getTerminator());
+            if (!Branch || !Branch->isConditional() || Branch->getSuccessor(0) == Branch->getSuccessor(1))
+                return nullptr;
+            ICmpInst *Cmp = dyn_cast<ICmpInst>(Branch->getCondition());
+            if (!Cmp || !Cmp->getOperand(0)->getType()->isIntegerTy())
+                return nullptr;
+            Holds = Branch->getSuccessor(0) == B;
+            return Cmp;
+        }
+
+        // What @I computes, from the ranges of its operands
+        ConstantRange transfer(Instruction &I)
+        {
+            BasicBlock *B = I.getParent();
+            unsigned Width = I.getType()->getIntegerBitWidth();
+
+            if (BinaryOperator *Op = dyn_cast<BinaryOperator>(&I))
+                return rangeAt(Op->getOperand(0), B).binaryOp(Op->getOpcode(), rangeAt(Op->getOperand(1), B));
+
+            if (CastInst *Cast = dyn_cast<CastInst>(&I))
+            {
+                if (!Cast->getSrcTy()->isIntegerTy())
+                    return ConstantRange::getFull(Width);
+                return rangeAt(Cast->getOperand(0), B).castOp(Cast->getOpcode(), Width);
+            }
+
+            if (SelectInst *Select = dyn_cast<SelectInst>(&I))
+                return rangeAt(Select->getTrueValue(), B).unionWith(rangeAt(Select->getFalseValue(), B));
+
+            if (PHINode *Phi = dyn_cast<PHINode>(&I))
+            {
+                ConstantRange R = ConstantRange::getEmpty(Width);
+                for (unsigned i = 0; i < Phi->getNumIncomingValues(); i++)
+                {
+                    Value *V = Phi->getIncomingValue(i);
+                    BasicBlock *Pred = Phi->getIncomingBlock(i);
+                    bool Holds;
+                    ICmpInst *Cmp = edgeCondition(Pred, B, Holds);
+
+                    ConstantRange In = rangeAt(V, Pred);
+                    if (Cmp)
+                    {
+                        // Nothing comes in from a branch that never goes this way
+                        ConstantRange Decided = rangeOf(Cmp);
+                        if (Decided.isSingleElement() && Decided.getSingleElement()->getBoolValue() != Holds)
+                            continue;
+                        if (Cmp->getOperand(0) == V || Cmp->getOperand(1) == V)
+                            In = refine(V, In, Cmp, Holds);
+                    }
+                    R = R.unionWith(In);
+                }
+                return R;
+            }
+
+            if (ICmpInst *Cmp = dyn_cast<ICmpInst>(&I))
+            {
+                if (!Cmp->getOperand(0)->getType()->isIntegerTy())
+                    return ConstantRange::getFull(Width);
+                ConstantRange L = rangeAt(Cmp->getOperand(0), B), R = rangeAt(Cmp->getOperand(1), B);
+                if (L.isEmptySet() || R.isEmptySet())
+                    return ConstantRange::getEmpty(Width);
+                if (ConstantRange::makeSatisfyingICmpRegion(Cmp->getPredicate(), R).contains(L))
+                    return ConstantRange(APInt(1, 1));
+                if (ConstantRange::makeSatisfyingICmpRegion(Cmp->getInversePredicate(), R).contains(L))
+                    return ConstantRange(APInt(1, 0));
+                return ConstantRange::getFull(Width);
+            }
+
+            // Loads, calls and the rest could be anything
+            return ConstantRange::getFull(Width);
+        }
+
+        // Give @V the range @R: added to what it had while the ranges grow, in place of it while narrowing.
+        // Returns whether that changed anything.
+        bool update(Value *V, ConstantRange R)
+        {
+            auto It = Ranges.find(V);
+            if (It == Ranges.end())
+            {
+                Ranges.insert(std::make_pair(V, R));
+                return true;
+            }
+            if (Narrowing)
+            {
+                bool Changed = It->second != R;
+                It->second = R;
+                return Changed;
+            }
+
+            ConstantRange New = It->second.unionWith(R);
+            if (New == It->second)
+                return false;
+            if (++Updates[V] > WIDEN_AFTER)
+                New = widen(It->second, New);
+            It->second = New;
+            return true;
+        }
+
+        // Pass what @Call passes on to the arguments of the function it calls
+        bool pass(CallInst &Call)
+        {
+            Function *Callee = Call.getCalledFunction();
+            if (!Callee || !Narrowed.count(Callee))
+                return false;
+
+            bool Changed = false;
+            for (Argument &A : Callee->args())
+            {
+                if (!A.getType()->isIntegerTy())
+                    continue;
+                ConstantRange R = rangeAt(Call.getArgOperand(A.getArgNo()), Call.getParent());
+                if (Narrowing)
+                {
+                    auto It = Passed.find(&A);
+                    if (It == Passed.end())
+                        Passed.insert(std::make_pair(&A, R));
+                    else
+                        It->second = It->second.unionWith(R);
+                }
+                else
+                {
+                    Changed |= update(&A, R);
+                }
+            }
+            return Changed;
+        }
+
+        // One pass over every reachable block, in an order that sees definitions before their uses where it can.
+        // Returns whether any range changed.
+        bool propagate(Module &M)
+        {
+            bool Changed = false;
+            for (Function &F : M)
+            {
+                if (F.isDeclaration())
+                    continue;
+                ReversePostOrderTraversal<Function *> RPOT(&F);
+                for (BasicBlock *B : RPOT)
+                {
+                    for (Instruction &I : *B)
+                    {
+                        if (CallInst *Call = dyn_cast<CallInst>(&I))
+                            Changed |= pass(*Call);
+                        if (I.getType()->isIntegerTy())
+                            Changed |= update(&I, transfer(I));
+                    }
+                }
+            }
+            return Changed;
+        }
+
+        // Note the compares each block is only reached through, for rangeAt
+        void findConditions(Function &F)
+        {
+            for (BasicBlock &B : F)
+            {
+                BasicBlock *Pred = B.getSinglePredecessor();
+                bool Holds;
+                ICmpInst *Cmp = Pred ? edgeCondition(Pred, &B, Holds) : nullptr;
+                if (!Cmp)
+                    continue;
+                for (Value *V : Cmp->operands())
+                {
+                    if ((isa<Instruction>(V) || isa<Argument>(V)) && V->getType()->isIntegerTy())
+                        Conditions[V].push_back({Cmp, Holds, &B});
+                }
+            }
+        }
+
+        // Add the ranges of @F's arguments to the key constpass gave it, and splice its optimized body in from the
+        // cache in @Dir if it's there
+        void lookUp(Function &F, StringRef Dir)
+        {
+            std::pair<StringRef, StringRef> Marked = F.getFnAttribute(CACHE_KEY_ATTR).getValueAsString().split(';');
+            std::string Hash = Marked.first.str(), Names = Marked.second.str();
+
+            // What it is passed is folded into it as much as its own IR is
+            std::string Arguments;
+            raw_string_ostream OS(Arguments);
+            for (Argument &A : F.args())
+            {
+                if (A.getType()->isIntegerTy())
+                    OS << rangeOf(&A);
+                OS << " ";
+            }
+            Hash = cacheKey(Hash, {{"arguments", OS.str()}});
+            F.addFnAttr(CACHE_KEY_ATTR, Hash + ";" + Names);
+
+            // What a callee returns is only known before the rest of the pipeline has run if it came from the cache too
+            SmallVector<StringRef, 4> Callees;
+            StringRef(Names).split(Callees, ',', -1, false);
+            std::vector<std::pair<std::string, std::string>> Facts;
+            for (StringRef Name : Callees)
+            {
+                Function *Callee = F.getParent()->getFunction(Name);
+                if (!Callee || !Callee->hasFnAttribute(CACHE_HIT_ATTR))
+                {
+                    NumCacheMisses++;
+                    return;
+                }
+                Facts.push_back({Name.str(), Callee->getFnAttribute(CACHE_FACTS_ATTR).getValueAsString().str()});
+            }
+
+            CacheEntry E;
+            std::string Key = cacheKey(Hash, Facts);
+            if (!readCacheEntry(Dir, Key, E) || !spliceFunction(F, E.IR))
+            {
+                NumCacheMisses++;
+                return;
+            }
+            Trees.erase(&F);
+            F.addFnAttr(CACHE_HIT_ATTR, Key);
+            F.addFnAttr(CACHE_FACTS_ATTR, E.Facts);
+            NumCacheHits++;
+        }
+
+        virtual bool runOnModule(Module &M) override
+        {
+            Ranges.clear();
+            Updates.clear();
+            Conditions.clear();
+            Narrowed.clear();
+            Trees.clear();
+            Narrowing = false;
+
+            for (Function &F : M)
+            {
+                if (F.isDeclaration())
+                    continue;
+                Trees[&F].reset(new DominatorTree(F));
+                findConditions(F);
+                if (callersKnown(F))
+                {
+                    Narrowed.insert(&F);
+                    NumFunctionsNarrowed++;
+                }
+            }
+
+            while (propagate(M))
+                ;
+
+            // Every range now holds everything its value can be, so working each one out again from the others
+            // keeps them that way, and brings back the bounds of loop counters that widening gave up
+            Narrowing = true;
+            for (unsigned i = 0; i < NARROW_PASSES; i++)
+            {
+                Passed.clear();
+                propagate(M);
+                for (Function *F : Narrowed)
+                {
+                    for (Argument &A : F->args())
+                    {
+                        if (!A.getType()->isIntegerTy())
+                            continue;
+                        auto It = Passed.find(&A);
+                        update(&A, It != Passed.end() ? It->second : ConstantRange::getEmpty(A.getType()->getIntegerBitWidth()));
+                    }
+                }
+            }
+
+            // The ranges are the same as in a build without the cache, since nothing has been spliced in yet, so they
+            // can be part of each function's key
+            bool Changed = false;
+            if (NamedMDNode *Dir = M.getNamedMetadata(CACHE_DIR_MD))
+            {
+                StringRef Path = cast<MDString>(Dir->getOperand(0)->getOperand(0))->getString();
+                for (Function &F : M)
+                {
+                    if (!F.isDeclaration() && F.hasFnAttribute(CACHE_KEY_ATTR))
+                    {
+                        lookUp(F, Path);
+                        Changed |= F.hasFnAttribute(CACHE_HIT_ATTR);
+                    }
+                }
+            }
+
+            for (Function &F : M)
+            {
+                // Spliced in from the cache, already as the whole pipeline leaves it
+                if (F.isDeclaration() || F.hasFnAttribute(CACHE_HIT_ATTR))
+                    continue;
+
+                std::vector<ICmpInst *> Decided;
+                for (BasicBlock &B : F)
+                {
+                    for (Instruction &I : B)
+                    {
+                        ICmpInst *Cmp = dyn_cast<ICmpInst>(&I);
+                        auto It = Ranges.find(&I);
+                        if (Cmp && It != Ranges.end() && It->second.isSingleElement())
+                            Decided.push_back(Cmp);
+                    }
+                }
+                for (ICmpInst *Cmp : Decided)
+                {
+                    Cmp->replaceAllUsesWith(ConstantInt::get(Cmp->getType(), *Ranges.find(Cmp)->second.getSingleElement()));
+                    Ranges.erase(Cmp);
+                    Cmp->eraseFromParent();
+                    NumComparesFolded++;
+                    Changed = true;
+                }
+            }
+
+            Ranges.clear();
+            Updates.clear();
+            Conditions.clear();
+            Trees.clear();
+            return Changed;
+        }
+    };
+};
+
+// You can change the friendly and long names in RegisterPass to your own pass
+// name.
+char RangePass::ID = 0;
+static RegisterPass<RangePass> X("rangepass", "Value Range Propagation Pass",
+                                 false,  /* looks at CFG, true changed CFG */
+                                 false); /* analysis pass, true means analysis needs to run again */
+
+ModulePass *createRangePass()
+{
+    return new RangePass();
+}
@@ -0,0 +1,507 @@
+//
+// LLVM Loop Vectorization Pass
+//
+// Rewrites countable loops over i32 arrays to work on 4 (SSE2) or 8 (AVX2)
+// elements at a time. The original loop is kept to run the iterations left
+// over, and to run the whole loop when the arrays might overlap.
+//
+#include "llvm/ADT/Statistic.h"
+#include "llvm/Pass.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/IR/CFG.h"
+#include "llvm/IR/Dominators.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/raw_ostream.h"
+#include "Cache.h"
+#include "Passes.h"
+#include <map>
+#include <set>
+
+using namespace llvm;
+
+#define DEBUG_TYPE "vectorpass"
+
+STATISTIC(NumLoopsVectorized, "Number of loops vectorized");
+STATISTIC(NumReductions, "Number of reductions vectorized");
+STATISTIC(NumAliasChecks, "Number of runtime checks for overlapping arrays");
+
+static cl::opt<std::string> VectorFeatures("vectorpass-mattr",
+                                           cl::desc("Target features to vectorize for, on top of the function's own "
+                                                    "(e.g. +avx2 for 8 lanes, +sse4.1 for pmulld)"),
+                                           cl::value_desc("features"));
+
+// Beginning of anonymous namespace. Keeping it anonymous prevents duplicate
+// namespaces from occurring, especially when merging code into the LLVM
+// pass directory (which we will not be doing.)
+namespace
+{
+    // A load or store of element `i` of an array, i being the loop's induction variable
+    struct Access
+    {
+        Instruction *I;
+        GetElementPtrInst *GEP;
+        Value *Base;
+    };
+
+    // A header PHI that accumulates a value over the loop with a commutative operation
+    struct Reduction
+    {
+        PHINode *Phi;
+        BinaryOperator *Update;
+        Value *Init;
+    };
+
+    // A loop that can be vectorized, and everything needed to do it
+    struct Candidate
+    {
+        BasicBlock *Preheader;
+        BasicBlock *Header;
+        // Induction variable, running from Start while it is below (or not equal to) End, and its increment
+        PHINode *IV;
+        Value *Start;
+        Value *End;
+        Instruction *Step;
+        // The loop body, in the order it runs, not counting the increment
+        std::vector<Instruction *> Body;
+        std::vector<Access> Accesses;
+        std::vector<Reduction> Reductions;
+        // Pairs of Accesses whose arrays must not overlap for the vector loop to be correct
+        std::vector<std::pair<unsigned, unsigned>> Checks;
+    };
+
+    struct VectorPass : public FunctionPass
+    {
+        static char ID;
+        VectorPass() : FunctionPass(ID) {}
+
+        // Whether @op can be used to accumulate a reduction
+        static bool isReduction(Instruction::BinaryOps op)
+        {
+            return op == Instruction::Add || op == Instruction::Mul || op == Instruction::And ||
+                   op == Instruction::Or || op == Instruction::Xor;
+        }
+
+        // Whether @op can be done on all the lanes of a vector at once
+        static bool isVectorizable(Instruction::BinaryOps op)
+        {
+            return isReduction(op) || op == Instruction::Sub;
+        }
+
+        // Whether @V is the induction variable, or it sign extended to use as an index
+        static bool isIndex(Value *V, Candidate &C)
+        {
+            if (SExtInst *Ext = dyn_cast<SExtInst>(V))
+                V = Ext->getOperand(0);
+            return V == C.IV;
+        }
+
+        // The array whose element `i` @GEP points to, or null if it points anywhere else.
+        // That's `gep i32, i32* %a, i` or `gep [N x i32], [N x i32]* %a, 0, i`.
+        static Value *arrayOf(GetElementPtrInst *GEP, Candidate &C, Loop *L)
+        {
+            if (!GEP->getResultElementType()->isIntegerTy(32) || !L->isLoopInvariant(GEP->getPointerOperand()))
+                return nullptr;
+
+            Value *Index = GEP->getOperand(GEP->getNumOperands() - 1);
+            if (!isIndex(Index, C))
+                return nullptr;
+            if (GEP->getNumIndices() == 2 && !match0(GEP->getOperand(1)))
+                return nullptr;
+            if (GEP->getNumIndices() > 2)
+                return nullptr;
+            return GEP->getPointerOperand();
+        }
+
+        static bool match0(Value *V)
+        {
+            ConstantInt *Const = dyn_cast<ConstantInt>(V);
+            return Const && Const->isZero();
+        }
+
+        // Whether @A and @B can be told apart at compile time: two different allocas or globals
+        static bool distinct(Value *A, Value *B)
+        {
+            bool identified = (isa<AllocaInst>(A) || isa<GlobalVariable>(A)) && (isa<AllocaInst>(B) || isa<GlobalVariable>(B));
+            return identified && A != B;
+        }
+
+        // Work out whether @L can be vectorized, filling in @C if so.
+        //
+        // The loop has to be a straight line of blocks that only leaves from its header, which holds nothing but
+        // PHIs and the exit test `i < end` (or `i != end`). Besides the increment `i + 1`, the body can only load and
+        // store element `i` of arrays, do arithmetic on i32s, and update reductions.
+        bool analyze(Loop *L, Candidate &C)
+        {
+            if (!L->getSubLoops().empty())
+                return false;
+
+            C.Preheader = L->getLoopPreheader();
+            C.Header = L->getHeader();
+            BasicBlock *Latch = L->getLoopLatch();
+            if (!C.Preheader || !Latch || Latch == C.Header || !L->getExitBlock() || L->getExitingBlock() != C.Header)
+                return false;
+
+            // The exit test, as the condition for staying in the loop with the induction variable on the left
+            BranchInst *Branch = dyn_cast<BranchInst>(C.Header->getTerminator());
+            if (!Branch || !Branch->isConditional())
+                return false;
+            ICmpInst *Cmp = dyn_cast<ICmpInst>(Branch->getCondition());
+            if (!Cmp || !Cmp->hasOneUse())
+                return false;
+
+            ICmpInst::Predicate pred = Cmp->getPredicate();
+            if (!L->contains(Branch->getSuccessor(0)))
+                pred = CmpInst::getInversePredicate(pred);
+            Value *Lhs = Cmp->getOperand(0);
+            Value *Rhs = Cmp->getOperand(1);
+            if (L->isLoopInvariant(Lhs))
+            {
+                std::swap(Lhs, Rhs);
+                pred = CmpInst::getSwappedPredicate(pred);
+            }
+            if (pred != ICmpInst::ICMP_SLT && pred != ICmpInst::ICMP_NE)
+                return false;
+
+            C.IV = dyn_cast<PHINode>(Lhs);
+            if (!C.IV || C.IV->getParent() != C.Header || !C.IV->getType()->isIntegerTy(32) || !L->isLoopInvariant(Rhs))
+                return false;
+            C.Start = C.IV->getIncomingValueForBlock(C.Preheader);
+            C.End = Rhs;
+
+            BinaryOperator *Step = dyn_cast<BinaryOperator>(C.IV->getIncomingValueForBlock(Latch));
+            if (!Step || Step->getOpcode() != Instruction::Add || !Step->hasOneUse())
+                return false;
+            ConstantInt *One = dyn_cast<ConstantInt>(Step->getOperand(Step->getOperand(0) == C.IV ? 1 : 0));
+            if (!One || !One->isOne() || !is_contained(Step->operands(), C.IV))
+                return false;
+            C.Step = Step;
+
+            for (Instruction &I : *C.Header)
+            {
+                if (!isa<PHINode>(&I) && &I != Cmp && &I != Branch)
+                    return false;
+            }
+
+            // Every other PHI has to be a reduction, only updated once per iteration and not read otherwise
+            for (PHINode &Phi : C.Header->phis())
+            {
+                if (&Phi == C.IV)
+                    continue;
+
+                BinaryOperator *Update = dyn_cast<BinaryOperator>(Phi.getIncomingValueForBlock(Latch));
+                if (!Phi.getType()->isIntegerTy(32) || !Update || !L->contains(Update) || !isReduction(Update->getOpcode()))
+                    return false;
+                if (Update->getOperand(0) == Update->getOperand(1) || !is_contained(Update->operands(), &Phi))
+                    return false;
+                for (User *U : Phi.users())
+                {
+                    if (U != Update && L->contains(cast<Instruction>(U)))
+                        return false;
+                }
+                if (!Update->hasOneUse())
+                    return false;
+
+                C.Reductions.push_back({&Phi, Update, Phi.getIncomingValueForBlock(C.Preheader)});
+            }
+
+            // Follow the body from the header to the latch
+            std::vector<BasicBlock *> Blocks;
+            BasicBlock *B = Branch->getSuccessor(L->contains(Branch->getSuccessor(0)) ? 0 : 1);
+            while (Blocks.size() < L->getNumBlocks())
+            {
+                Blocks.push_back(B);
+                BranchInst *Next = dyn_cast<BranchInst>(B->getTerminator());
+                if (!Next || Next->isConditional())
+                    return false;
+                if (B == Latch)
+                    break;
+                B = Next->getSuccessor(0);
+            }
+            if (Blocks.size() + 1 != L->getNumBlocks() || Blocks.back() != Latch)
+                return false;
+
+            for (BasicBlock *Block : Blocks)
+            {
+                for (Instruction &I : *Block)
+                {
+                    if (&I == Step || I.isTerminator())
+                        continue;
+
+                    if (isa<SExtInst>(&I) && isIndex(&I, C))
+                    {
+                        C.Body.push_back(&I);
+                    }
+                    else if (GetElementPtrInst *GEP = dyn_cast<GetElementPtrInst>(&I))
+                    {
+                        if (!arrayOf(GEP, C, L))
+                            return false;
+                        for (User *U : GEP->users())
+                        {
+                            StoreInst *Store = dyn_cast<StoreInst>(U);
+                            if (!isa<LoadInst>(U) && !(Store && Store->getPointerOperand() == GEP))
+                                return false;
+                        }
+                    }
+                    else if (LoadInst *Load = dyn_cast<LoadInst>(&I))
+                    {
+                        GetElementPtrInst *GEP = dyn_cast<GetElementPtrInst>(Load->getPointerOperand());
+                        if (!GEP || !Load->isSimple() || !L->contains(GEP))
+                            return false;
+                        C.Accesses.push_back({Load, GEP, arrayOf(GEP, C, L)});
+                        C.Body.push_back(Load);
+                    }
+                    else if (StoreInst *Store = dyn_cast<StoreInst>(&I))
+                    {
+                        GetElementPtrInst *GEP = dyn_cast<GetElementPtrInst>(Store->getPointerOperand());
+                        if (!GEP || !Store->isSimple() || !L->contains(GEP) || !Store->getValueOperand()->getType()->isIntegerTy(32))
+                            return false;
+                        C.Accesses.push_back({Store, GEP, arrayOf(GEP, C, L)});
+                        C.Body.push_back(Store);
+                    }
+                    else if (BinaryOperator *Op = dyn_cast<BinaryOperator>(&I))
+                    {
+                        if (!Op->getType()->isIntegerTy(32) || !isVectorizable(Op->getOpcode()))
+                            return false;
+                        C.Body.push_back(Op);
+                    }
+                    else
+                    {
+                        return false;
+                    }
+                }
+            }
+
+            // A load or store of element i only ever meets element i of another array, so two arrays can only
+            // get in each other's way if one of them is stored to and they overlap.
+            std::set<std::pair<Value *, Value *>> Seen;
+            for (unsigned store = 0; store < C.Accesses.size(); store++)
+            {
+                Value *Base = C.Accesses[store].Base;
+                if (!isa<StoreInst>(C.Accesses[store].I))
+                    continue;
+                for (unsigned other = 0; other < C.Accesses.size(); other++)
+                {
+                    Value *Other = C.Accesses[other].Base;
+                    if (Other == Base || distinct(Base, Other))
+                        continue;
+                    if (!Seen.insert(std::make_pair(std::min(Base, Other), std::max(Base, Other))).second)
+                        continue;
+                    C.Checks.push_back(std::make_pair(store, other));
+                }
+            }
+
+            return !C.Accesses.empty() || !C.Reductions.empty();
+        }
+
+        // Pointer to element @Index of the array @A accesses, built like @A's own GEP
+        static Value *elementPtr(IRBuilder<> &B, Access &A, Value *Index)
+        {
+            std::vector<Value *> Indices;
+            if (A.GEP->getNumIndices() == 2)
+                Indices.push_back(A.GEP->getOperand(1));
+            Indices.push_back(Index);
+            return B.CreateGEP(A.GEP->getSourceElementType(), A.GEP->getPointerOperand(), Indices);
+        }
+
+        // Value of @op that leaves the other operand alone
+        static Constant *identity(Instruction::BinaryOps op, Type *T)
+        {
+            if (op == Instruction::Mul)
+                return ConstantInt::get(T, 1);
+            if (op == Instruction::And)
+                return ConstantInt::getAllOnesValue(T);
+            return ConstantInt::get(T, 0);
+        }
+
+        // Put a vector loop of @VF lanes in front of the loop in @C.
+        //
+        //   preheader -> vector.check -> vector.body (loops) -> vector.middle -> header
+        //                     \-------------------------------------------------^
+        //
+        // vector.check works out how many iterations the vector loop can do and checks that the arrays don't
+        // overlap, vector.middle folds the reductions down to one value each, and the original loop then runs
+        // whatever is left starting from there.
+        void vectorize(Function &F, Candidate &C, unsigned VF)
+        {
+            LLVMContext &Ctx = F.getContext();
+            Type *I32 = Type::getInt32Ty(Ctx);
+            Type *I64 = Type::getInt64Ty(Ctx);
+            Type *VectorTy = VectorType::get(I32, VF, false);
+
+            BasicBlock *Check = BasicBlock::Create(Ctx, "vector.check", &F, C.Header);
+            BasicBlock *Body = BasicBlock::Create(Ctx, "vector.body", &F, C.Header);
+            BasicBlock *Middle = BasicBlock::Create(Ctx, "vector.middle", &F, C.Header);
+            C.Preheader->getTerminator()->replaceUsesOfWith(C.Header, Check);
+
+            // Trip count, rounded down to a multiple of VF
+            IRBuilder<> B(Check);
+            Value *Start = B.CreateSExt(C.Start, I64);
+            Value *End = B.CreateSExt(C.End, I64);
+            Value *Count = B.CreateSub(End, Start, "trip.count");
+            Value *Go = B.CreateICmpSGE(Count, ConstantInt::get(I64, VF));
+            Value *VectorCount = B.CreateAnd(Count, ConstantInt::get(I64, -(int64_t)VF));
+            Value *VectorEnd = B.CreateAdd(C.Start, B.CreateTrunc(VectorCount, I32), "vector.end");
+
+            // [a + start, a + end) and [b + start, b + end) must not overlap
+            for (auto &P : C.Checks)
+            {
+                Access &First = C.Accesses[P.first];
+                Access &Second = C.Accesses[P.second];
+                Value *FirstBegin = B.CreatePtrToInt(elementPtr(B, First, Start), I64);
+                Value *FirstEnd = B.CreatePtrToInt(elementPtr(B, First, End), I64);
+                Value *SecondBegin = B.CreatePtrToInt(elementPtr(B, Second, Start), I64);
+                Value *SecondEnd = B.CreatePtrToInt(elementPtr(B, Second, End), I64);
+                Value *Apart = B.CreateOr(B.CreateICmpULE(FirstEnd, SecondBegin), B.CreateICmpULE(SecondEnd, FirstBegin));
+                Go = B.CreateAnd(Go, Apart);
+                NumAliasChecks++;
+            }
+
+            IRBuilder<> VB(Body);
+            PHINode *Index = VB.CreatePHI(I32, 2, "vector.index");
+            Index->addIncoming(C.Start, Check);
+
+            // The vector standing in for every scalar in the body. Values from outside the loop are splatted
+            // before it starts, and the induction variable becomes <i, i + 1, ...>.
+            std::map<Value *, Value *> Vectors;
+            PHINode *Lanes = nullptr;
+            auto vectorOf = [&](Value *V) -> Value *
+            {
+                auto search = Vectors.find(V);
+                if (search != Vectors.end())
+                    return search->second;
+
+                if (V == C.IV)
+                {
+                    std::vector<Constant *> Steps;
+                    for (unsigned lane = 0; lane < VF; lane++)
+                        Steps.push_back(ConstantInt::get(I32, lane));
+                    // PHIs have to come first, and the body is already underway
+                    IRBuilder<> PB(Body, Body->begin());
+                    Lanes = PB.CreatePHI(VectorTy, 2, "vector.iv");
+                    Lanes->addIncoming(B.CreateAdd(B.CreateVectorSplat(VF, C.Start), ConstantVector::get(Steps)), Check);
+                    return Vectors[V] = Lanes;
+                }
+                return Vectors[V] = B.CreateVectorSplat(VF, V);
+            };
+
+            std::vector<std::pair<PHINode *, Reduction *>> Accumulators;
+            for (Reduction &R : C.Reductions)
+            {
+                PHINode *Acc = VB.CreatePHI(VectorTy, 2, "vector.acc");
+                Acc->addIncoming(B.CreateVectorSplat(VF, identity(R.Update->getOpcode(), I32)), Check);
+                Vectors[R.Phi] = Acc;
+                Accumulators.push_back(std::make_pair(Acc, &R));
+            }
+
+            Value *Index64 = VB.CreateSExt(Index, I64);
+            for (Instruction *I : C.Body)
+            {
+                if (isa<SExtInst>(I))
+                    continue;
+
+                if (LoadInst *Load = dyn_cast<LoadInst>(I))
+                {
+                    Access *A = &*find_if(C.Accesses, [&](Access &A)
+                                          { return A.I == Load; });
+                    Value *Ptr = VB.CreateBitCast(elementPtr(VB, *A, Index64), VectorTy->getPointerTo());
+                    Vectors[Load] = VB.CreateAlignedLoad(VectorTy, Ptr, MaybeAlign(4));
+                }
+                else if (StoreInst *Store = dyn_cast<StoreInst>(I))
+                {
+                    Access *A = &*find_if(C.Accesses, [&](Access &A)
+                                          { return A.I == Store; });
+                    Value *Ptr = VB.CreateBitCast(elementPtr(VB, *A, Index64), VectorTy->getPointerTo());
+                    VB.CreateAlignedStore(vectorOf(Store->getValueOperand()), Ptr, MaybeAlign(4));
+                }
+                else
+                {
+                    BinaryOperator *Op = cast<BinaryOperator>(I);
+                    Vectors[Op] = VB.CreateBinOp(Op->getOpcode(), vectorOf(Op->getOperand(0)), vectorOf(Op->getOperand(1)));
+                }
+            }
+
+            Value *NextIndex = VB.CreateAdd(Index, ConstantInt::get(I32, VF), "vector.next");
+            Index->addIncoming(NextIndex, Body);
+            if (Lanes)
+                Lanes->addIncoming(VB.CreateAdd(Lanes, VB.CreateVectorSplat(VF, ConstantInt::get(I32, VF))), Body);
+            for (auto &P : Accumulators)
+                P.first->addIncoming(Vectors[P.second->Update], Body);
+            VB.CreateCondBr(VB.CreateICmpEQ(NextIndex, VectorEnd), Middle, Body);
+
+            B.CreateCondBr(Go, Body, C.Header);
+
+            // Fold each reduction's lanes into its starting value, and carry on with the scalar loop
+            IRBuilder<> MB(Middle);
+            std::map<PHINode *, Value *> Results;
+            for (auto &P : Accumulators)
+            {
+                Reduction &R = *P.second;
+                Value *Result = R.Init;
+                for (unsigned lane = 0; lane < VF; lane++)
+                    Result = MB.CreateBinOp(R.Update->getOpcode(), Result, MB.CreateExtractElement(Vectors[R.Update], lane));
+                Results[R.Phi] = Result;
+                NumReductions++;
+            }
+            MB.CreateBr(C.Header);
+
+            for (PHINode &Phi : C.Header->phis())
+            {
+                Phi.setIncomingBlock(Phi.getBasicBlockIndex(C.Preheader), Check);
+                Phi.addIncoming(&Phi == C.IV ? VectorEnd : Results[&Phi], Middle);
+            }
+
+            NumLoopsVectorized++;
+        }
+
+        virtual bool runOnFunction(Function &F) override
+        {
+            // Spliced in from the cache, already vectorized
+            if (F.hasFnAttribute(CACHE_HIT_ATTR))
+                return false;
+
+            // Target features the function was compiled with, plus -vectorpass-mattr
+            std::string Features;
+            if (F.hasFnAttribute("target-features"))
+                Features = F.getFnAttribute("target-features").getValueAsString().str();
+            if (!VectorFeatures.empty())
+                Features += (Features.empty() ? "" : ",") + VectorFeatures;
+            unsigned VF = (Features.find("+avx2") != std::string::npos) ? 8 : 4;
+
+            DominatorTree DT(F);
+            LoopInfo LI(DT);
+
+            // Find everything first, the loop info doesn't know about the blocks vectorizing adds
+            std::vector<Candidate> Candidates;
+            for (Loop *L : LI.getLoopsInPreorder())
+            {
+                Candidate C;
+                if (analyze(L, C))
+                    Candidates.push_back(C);
+            }
+            if (Candidates.empty())
+                return false;
+
+            for (Candidate &C : Candidates)
+                vectorize(F, C, VF);
+
+            // Tell the generator which instructions it may use
+            F.addFnAttr("target-features", Features);
+            return true;
+        };
+    };
+};
+
+// You can change the friendly and long names in RegisterPass to your own pass
+// name.
+char VectorPass::ID = 0;
+static RegisterPass<VectorPass> X("vectorpass", "Loop Vectorization Pass",
+                                  false,  /* looks at CFG, true changed CFG */
+                                  false); /* analysis pass, true means analysis needs to run again */
+
+FunctionPass *createVectorPass()
+{
+    return new VectorPass();
+}
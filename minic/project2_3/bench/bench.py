@@ -0,0 +1,117 @@
+"""
+Compile-time scaling benchmark for ConstPass, DeadPass and GeneratorPass.
+
+Generates programs with gen_ir.py over a sweep of one parameter, runs each
+pass of the opt-bjc.sh pipeline on its own (feeding it the previous pass's
+output), and records the wall time and peak RSS of every run in a JSON report.
+
+    python3 bench/bench.py --sweep blocks=16,64,256,1024 --functions 4 --out bench.json
+
+Run it from the directory holding the pass libraries (i.e. after `make`).
+"""
+import argparse
+import json
+import os
+import platform
+import subprocess
+import sys
+import tempfile
+import time
+from typing import Dict, List
+
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+import gen_ir  # noqa: E402
+
+# (name, opt arguments) in pipeline order, as in opt-bjc.sh
+PIPELINE = [
+    ("mem2reg", ["-mem2reg"]),
+    ("constpass", ["-load=./ConstPass.so", "--constpass"]),
+    ("rangepass", ["-load=./RangePass.so", "--rangepass"]),
+    ("deadpass", ["-load=./DeadPass.so", "--deadpass"]),
+    ("constpass2", ["-load=./ConstPass.so", "--constpass"]),
+    ("vectorpass", ["-load=./VectorPass.so", "--vectorpass"]),
+    ("ifconvpass", ["-load=./IfConvPass.so", "--ifconvpass"]),
+    ("generatorpass", ["-load=./GeneratorPass.so", "--generatorpass"]),
+]
+
+
+def run_pass(opt: List[str], args: List[str], source: str, dest: str, asm: str) -> Dict:
+    with open(source) as stdin, open(asm, "w") as stdout, tempfile.TemporaryFile() as stderr:
+        start = time.perf_counter()
+        process = subprocess.Popen(opt + ["-S"] + args + ["-o", dest], stdin=stdin, stdout=stdout, stderr=stderr)
+        # wait4 gives the usage of this child alone, unlike getrusage(RUSAGE_CHILDREN)
+        _, status, usage = os.wait4(process.pid, 0)
+        wall = time.perf_counter() - start
+        process.returncode = os.waitstatus_to_exitcode(status)
+        stderr.seek(0)
+        errors = stderr.read().decode(errors="replace")
+
+    return {
+        "wall_s": round(wall, 6),
+        "user_s": round(usage.ru_utime, 6),
+        "peak_rss_kb": usage.ru_maxrss,
+        "exit": process.returncode,
+        "stderr": errors[-2000:],
+    }
+
+
+def measure(opt: List[str], program: str, workdir: str, repeat: int) -> List[Dict]:
+    results = []
+    source = os.path.join(workdir, "input.ll")
+    with open(source, "w") as f:
+        f.write(program)
+
+    for i, (name, args) in enumerate(PIPELINE):
+        dest = os.path.join(workdir, f"stage{i}.ll")
+        asm = os.path.join(workdir, f"stage{i}.s")
+        runs = [run_pass(opt, args, source, dest, asm) for _ in range(repeat)]
+        best = min(runs, key=lambda r: r["wall_s"])
+        best["pass"] = name
+        best["asm_lines"] = sum(1 for _ in open(asm)) if name == "generatorpass" else None
+        results.append(best)
+        if best["exit"] != 0:
+            break
+        source = dest
+
+    return results
+
+
+def main(argv: List[str]):
+    p = gen_ir.parser()
+    p.description = "Compile-time scaling benchmark"
+    p.add_argument("--sweep", required=True, help="parameter=v1,v2,... to vary, e.g. blocks=16,64,256")
+    p.add_argument("--opt", default="opt-10", help="opt command to run the passes with, e.g. \"opt -enable-new-pm=0\"")
+    p.add_argument("--repeat", type=int, default=1, help="runs per measurement (fastest is kept)")
+    p.add_argument("--out", default="bench.json", help="where to write the JSON report")
+    args = p.parse_args(argv)
+
+    param, values = args.sweep.split("=")
+    if not hasattr(args, param):
+        p.error(f"unknown sweep parameter {param}")
+    kind = type(getattr(args, param))
+
+    report = {
+        "host": platform.node(),
+        "opt": args.opt,
+        "sweep": param,
+        "config": {k: getattr(args, k) for k in ["functions", "blocks", "insts", "phi", "calls", "seed"]},
+        "results": [],
+    }
+
+    with tempfile.TemporaryDirectory() as workdir:
+        for raw in values.split(","):
+            setattr(args, param, kind(raw))
+            program = gen_ir.generate(args)
+            for row in measure(args.opt.split(), program, workdir, args.repeat):
+                row[param] = getattr(args, param)
+                row["ir_lines"] = program.count("\n")
+                report["results"].append(row)
+                print(f"{param}={row[param]:<8} {row['pass']:<14} {row['wall_s']:>10.4f}s "
+                      f"{row['peak_rss_kb']:>10} KB", file=sys.stderr)
+
+    with open(args.out, "w") as f:
+        json.dump(report, f, indent=2)
+
+
+if __name__ == "__main__":
+    main(sys.argv[1:])
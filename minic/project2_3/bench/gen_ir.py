@@ -0,0 +1,132 @@
+"""
+Seeded generator of synthetic IR programs for the compile-time benchmarks.
+
+Programs look like what clang + mem2reg hands the passes for MiniC: i32
+functions of at most one argument, integer arithmetic, compares, branches,
+PHI nodes and calls. Every function is a chain of "fans": a run of tests that
+each branch to their own arm, with all the arms meeting again in a join block
+that has one PHI with an incoming value per arm.
+
+    python3 bench/gen_ir.py --functions 10 --blocks 200 --insts 8 --phi 4 --calls 0.05 --seed 1 > big.ll
+"""
+import argparse
+import random
+import sys
+from typing import List
+
+ARITH = ["add nsw", "sub nsw", "mul nsw"]
+PREDICATES = ["eq", "ne", "slt", "sle", "sgt", "sge"]
+
+
+class FunctionBuilder:
+    def __init__(self, rng: random.Random, index: int, callees: List[str], args):
+        self.rng = rng
+        self.name = f"f{index}"
+        self.callees = callees
+        self.args = args
+        self.lines: List[str] = []
+        self.next_value = 0
+        self.next_block = 0
+
+    def value(self) -> str:
+        self.next_value += 1
+        return f"%v{self.next_value}"
+
+    def block(self) -> str:
+        self.next_block += 1
+        return f"b{self.next_block}"
+
+    def operand(self, available: List[str]) -> str:
+        if not available or self.rng.random() < 0.25:
+            return str(self.rng.randint(1, 100))
+        return self.rng.choice(available)
+
+    # Fill a block with straight-line code, returns the values it defined
+    def body(self, available: List[str]) -> List[str]:
+        defined: List[str] = []
+        for _ in range(self.args.insts):
+            scope = available + defined
+            v = self.value()
+            if self.callees and self.rng.random() < self.args.calls:
+                callee = self.rng.choice(self.callees)
+                self.lines.append(f"  {v} = call i32 @{callee}(i32 {self.operand(scope)})")
+            else:
+                op = self.rng.choice(ARITH)
+                self.lines.append(f"  {v} = {op} i32 {self.operand(scope)}, {self.operand(scope)}")
+            defined.append(v)
+        return defined
+
+    def condition(self, available: List[str]) -> str:
+        c = self.value()
+        pred = self.rng.choice(PREDICATES)
+        self.lines.append(f"  {c} = icmp {pred} i32 {self.operand(available)}, {self.operand(available)}")
+        return c
+
+    def build(self) -> str:
+        # Values that dominate the current point
+        available = ["%x"]
+        current = "entry"
+        self.lines.append(f"{current}:")
+        available += self.body(available)
+        blocks = 1
+
+        fan_in = max(2, self.args.phi)
+        while blocks + 2 * fan_in <= self.args.blocks:
+            arms = [self.block() for _ in range(fan_in)]
+            tests = [self.block() for _ in range(fan_in - 2)]
+            join = self.block()
+
+            # Each test block picks its own arm or moves on to the next test
+            incoming = []
+            for i in range(fan_in - 1):
+                cond = self.condition(available)
+                other = tests[i] if i < len(tests) else arms[-1]
+                self.lines.append(f"  br i1 {cond}, label %{arms[i]}, label %{other}")
+                if i < len(tests):
+                    self.lines.append(f"{tests[i]}:")
+
+            for arm in arms:
+                self.lines.append(f"{arm}:")
+                defined = self.body(available)
+                incoming.append((defined[-1] if defined else self.operand(available), arm))
+                self.lines.append(f"  br label %{join}")
+
+            self.lines.append(f"{join}:")
+            phi = self.value()
+            pairs = ", ".join(f"[ {v}, %{b} ]" for v, b in incoming)
+            self.lines.append(f"  {phi} = phi i32 {pairs}")
+            available.append(phi)
+            available += self.body(available)
+            blocks += len(arms) + len(tests) + 1
+
+        self.lines.append(f"  ret i32 {available[-1]}")
+        return f"define i32 @{self.name}(i32 %x) {{\n" + "\n".join(self.lines) + "\n}\n"
+
+
+def generate(args) -> str:
+    rng = random.Random(args.seed)
+    functions = []
+    names: List[str] = []
+    for i in range(args.functions):
+        # Only call functions defined before this one, so there is no recursion
+        builder = FunctionBuilder(rng, i, list(names), args)
+        functions.append(builder.build())
+        names.append(builder.name)
+
+    main = f"define i32 @main() {{\n  %r = call i32 @{names[-1]}(i32 {rng.randint(1, 10)})\n  ret i32 %r\n}}\n"
+    return "\n".join(functions + [main])
+
+
+def parser() -> argparse.ArgumentParser:
+    p = argparse.ArgumentParser(description="Generate a synthetic IR program")
+    p.add_argument("--functions", type=int, default=4, help="number of functions")
+    p.add_argument("--blocks", type=int, default=16, help="basic blocks per function (approximate)")
+    p.add_argument("--insts", type=int, default=4, help="instructions per block")
+    p.add_argument("--phi", type=int, default=2, help="incoming values per PHI node")
+    p.add_argument("--calls", type=float, default=0.05, help="chance an instruction is a call")
+    p.add_argument("--seed", type=int, default=1)
+    return p
+
+
+if __name__ == "__main__":
+    sys.stdout.write(generate(parser().parse_args()))
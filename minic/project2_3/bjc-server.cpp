@@ -0,0 +1,446 @@
+//
+// Persistent compile server for the MiniC pipeline
+//
+// Runs the same pipeline as opt-bjc.sh (mem2reg, constpass, rangepass,
+// deadpass, constpass, vectorpass, ifconvpass, generatorpass), but with the
+// passes linked in and kept warm in one process, so a batch of files pays for
+// startup once instead of per file.
+//
+// Jobs are "<input> <output.s>" lines, where the input is a C file (compiled
+// to IR with clang-10) or an .ll file. They come either from a job file, or
+// one per connection over a Unix domain socket.
+//
+// With -run, each input is instead compiled to an object in memory, loaded
+// into executable memory with RuntimeDyld, and its main called directly,
+// which skips writing files, `ld`, and starting the program.
+//
+//   bjc-server -jobs <file> [-j N]           compile every job in the file
+//   bjc-server -socket <path> [-j N]         serve jobs until killed
+//   bjc-server -connect <path> <in> <out.s>  submit one job to a server
+//   bjc-server -run [-j N] <input>...        compile and run each input
+//
+#include "llvm/ExecutionEngine/JITSymbol.h"
+#include "llvm/ExecutionEngine/RuntimeDyld.h"
+#include "llvm/ExecutionEngine/SectionMemoryManager.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IRReader/IRReader.h"
+#include "llvm/Object/ObjectFile.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/InitLLVM.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Program.h"
+#include "llvm/Support/SourceMgr.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Transforms/Utils.h"
+#include "Passes.h"
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <csignal>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+using namespace llvm;
+
+static cl::opt<std::string> JobFile("jobs", cl::desc("Compile the jobs listed in <file>, one \"<input> <output.s>\" per line"),
+                                    cl::value_desc("file"));
+static cl::opt<std::string> SocketPath("socket", cl::desc("Serve jobs over a Unix domain socket at <path>"),
+                                       cl::value_desc("path"));
+static cl::opt<std::string> ConnectPath("connect", cl::desc("Submit the job given as positional arguments to the server at <path>"),
+                                        cl::value_desc("path"));
+static cl::opt<bool> Run("run", cl::desc("Compile each positional input and run it in-process, printing main's exit status"));
+static cl::opt<unsigned> Workers("j", cl::desc("Number of jobs to compile at once (0 = one per core)"), cl::init(0));
+static cl::list<std::string> JobArgs(cl::Positional, cl::desc("<input> <output.s> | <input>..."));
+
+namespace
+{
+    // A single compile request. Results are written back to @Reply when it is a connection.
+    // Without an output, the input is run instead (-run).
+    struct Job
+    {
+        std::string Input;
+        std::string Output;
+        int Reply = -1;
+    };
+
+    // Write all of @str to @fd
+    void writeAll(int fd, std::string const &str)
+    {
+        size_t done = 0;
+        while (done < str.size())
+        {
+            ssize_t n = write(fd, str.data() + done, str.size() - done);
+            if (n <= 0)
+                return;
+            done += n;
+        }
+    }
+
+    // Turn a C file into IR with clang-10, the same way opt-bjc.sh does
+    bool compileC(std::string const &Input, std::string &IRPath, std::string &Diag)
+    {
+        auto Clang = sys::findProgramByName("clang-10");
+        if (!Clang)
+        {
+            Diag += "error: could not find clang-10\n";
+            return false;
+        }
+
+        SmallString<128> IR, Err;
+        sys::fs::createTemporaryFile("bjc", "ll", IR);
+        sys::fs::createTemporaryFile("bjc", "err", Err);
+        IRPath = IR.str().str();
+
+        StringRef Args[] = {*Clang, "-O", "-S", "-Xclang", "-disable-llvm-passes", "-emit-llvm", Input, "-o", IR};
+        Optional<StringRef> Redirects[] = {None, None, StringRef(Err)};
+        int rc = sys::ExecuteAndWait(*Clang, Args, None, Redirects);
+
+        if (auto Buffer = MemoryBuffer::getFile(Err))
+            Diag += (*Buffer)->getBuffer().str();
+        sys::fs::remove(Err);
+
+        return rc == 0;
+    }
+
+    // Read @Input into @Context as IR, going through clang-10 for C files. Returns null on failure.
+    std::unique_ptr<Module> load(LLVMContext &Context, std::string const &Input, std::string &Diag)
+    {
+        std::string IRPath = Input;
+        bool temporary = StringRef(Input).endswith(".c");
+        if (temporary && !compileC(Input, IRPath, Diag))
+        {
+            sys::fs::remove(IRPath);
+            return nullptr;
+        }
+
+        SMDiagnostic Err;
+        std::unique_ptr<Module> M = parseIRFile(IRPath, Err, Context);
+        if (temporary)
+            sys::fs::remove(IRPath);
+        if (!M)
+        {
+            raw_string_ostream OS(Diag);
+            Err.print("bjc-server", OS);
+        }
+        return M;
+    }
+
+    // The opt-bjc.sh pipeline, writing the generated code to @Out
+    void optimizeAndGenerate(Module &M, raw_ostream &Out, bool Object)
+    {
+        legacy::PassManager PM;
+        PM.add(createPromoteMemoryToRegisterPass());
+        PM.add(createConstPass());
+        PM.add(createRangePass());
+        PM.add(createDeadPass());
+        PM.add(createConstPass());
+        PM.add(createVectorPass());
+        PM.add(createIfConvPass());
+        PM.add(createGeneratorPass(Out, Object));
+        PM.run(M);
+    }
+
+    // Run the whole pipeline on one job, with everything living in @Context.
+    // Returns whether it succeeded, with anything worth telling the user in @Diag.
+    bool compile(LLVMContext &Context, Job const &J, std::string &Diag)
+    {
+        std::unique_ptr<Module> M = load(Context, J.Input, Diag);
+        if (!M)
+            return false;
+
+        std::error_code EC;
+        raw_fd_ostream Out(J.Output, EC, sys::fs::OF_None);
+        if (EC)
+        {
+            Diag += "error: " + J.Output + ": " + EC.message() + "\n";
+            return false;
+        }
+
+        optimizeAndGenerate(*M, Out, false);
+        return true;
+    }
+
+    // Generated code only calls functions of its own program, so there is never anything outside to look up
+    struct NoExternals : public LegacyJITSymbolResolver
+    {
+        JITSymbol findSymbol(std::string const &Name) override
+        {
+            return nullptr;
+        }
+        JITSymbol findSymbolInLogicalDylib(std::string const &Name) override
+        {
+            return nullptr;
+        }
+    };
+
+    // Compile @J's input to an object in memory, load it into executable memory and call its main,
+    // putting main's exit status (what the program would have exited with) in @Status.
+    bool compileAndRun(LLVMContext &Context, Job const &J, int &Status, std::string &Diag)
+    {
+        std::unique_ptr<Module> M = load(Context, J.Input, Diag);
+        if (!M)
+            return false;
+
+        SmallVector<char, 0> Buffer;
+        raw_svector_ostream Out(Buffer);
+        optimizeAndGenerate(*M, Out, true);
+
+        auto Object = object::ObjectFile::createObjectFile(MemoryBufferRef(StringRef(Buffer.data(), Buffer.size()), J.Input));
+        if (!Object)
+        {
+            Diag += "error: " + toString(Object.takeError()) + "\n";
+            return false;
+        }
+
+        // Lays out the sections, applies relocations and makes the code executable
+        SectionMemoryManager Memory;
+        NoExternals Resolver;
+        RuntimeDyld Dyld(Memory, Resolver);
+        Dyld.loadObject(**Object);
+        Dyld.finalizeWithMemoryManagerLocking();
+        if (Dyld.hasError())
+        {
+            Diag += "error: " + Dyld.getErrorString().str() + "\n";
+            return false;
+        }
+
+        JITEvaluatedSymbol Main = Dyld.getSymbol("main");
+        if (!Main)
+        {
+            Diag += "error: " + J.Input + " has no main\n";
+            return false;
+        }
+
+        // Like _start, which hands main's result to exit()
+        auto *Entry = reinterpret_cast<int64_t (*)()>(Main.getAddress());
+        Status = Entry() & 0xff;
+        return true;
+    }
+
+    // Jobs waiting for a worker. Closing it lets the workers finish once it is drained.
+    struct JobQueue
+    {
+        std::mutex Lock;
+        std::condition_variable Ready;
+        std::deque<Job> Jobs;
+        bool closed = false;
+
+        void push(Job J)
+        {
+            {
+                std::lock_guard<std::mutex> Guard(Lock);
+                Jobs.push_back(std::move(J));
+            }
+            Ready.notify_one();
+        }
+
+        void close()
+        {
+            {
+                std::lock_guard<std::mutex> Guard(Lock);
+                closed = true;
+            }
+            Ready.notify_all();
+        }
+
+        // Wait for a job, returns false once the queue is closed and empty
+        bool pop(Job &J)
+        {
+            std::unique_lock<std::mutex> Guard(Lock);
+            Ready.wait(Guard, [this]()
+                       { return closed || !Jobs.empty(); });
+            if (Jobs.empty())
+                return false;
+            J = std::move(Jobs.front());
+            Jobs.pop_front();
+            return true;
+        }
+    };
+
+    // Number of jobs that failed, for the exit code of a job file run
+    std::atomic<unsigned> Failures(0);
+
+    // Each worker keeps its own LLVMContext for its whole life, since a context can't be shared between threads.
+    void worker(JobQueue &Queue, std::mutex &OutputLock)
+    {
+        LLVMContext Context;
+        Job J;
+        while (Queue.pop(J))
+        {
+            std::string Diag;
+            std::string status;
+            bool ok;
+            if (J.Output.empty())
+            {
+                int exit = 0;
+                ok = compileAndRun(Context, J, exit, Diag);
+                status = (ok ? "exit " + std::to_string(exit) + " " : "error ") + J.Input + "\n";
+            }
+            else
+            {
+                ok = compile(Context, J, Diag);
+                status = (ok ? "ok " : "error ") + J.Input + "\n";
+            }
+            if (!ok)
+                Failures++;
+
+            if (J.Reply >= 0)
+            {
+                writeAll(J.Reply, Diag + status);
+                close(J.Reply);
+            }
+            else
+            {
+                std::lock_guard<std::mutex> Guard(OutputLock);
+                errs() << Diag;
+                outs() << status;
+                outs().flush();
+            }
+        }
+    }
+
+    // Read one job line off a connection
+    bool readJob(int fd, Job &J)
+    {
+        std::string line;
+        char c;
+        while (read(fd, &c, 1) == 1 && c != '\n')
+            line += c;
+
+        std::istringstream Stream(line);
+        return static_cast<bool>(Stream >> J.Input >> J.Output);
+    }
+
+    int openSocket(std::string const &Path, sockaddr_un &Addr)
+    {
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        memset(&Addr, 0, sizeof(Addr));
+        Addr.sun_family = AF_UNIX;
+        strncpy(Addr.sun_path, Path.c_str(), sizeof(Addr.sun_path) - 1);
+        return fd;
+    }
+
+    // Send a job to a running server and print what comes back. Returns the process exit code.
+    int submit()
+    {
+        if (JobArgs.size() != 2)
+        {
+            errs() << "usage: bjc-server -connect <path> <input> <output.s>\n";
+            return 1;
+        }
+
+        sockaddr_un Addr;
+        int fd = openSocket(ConnectPath, Addr);
+        if (connect(fd, (sockaddr *)&Addr, sizeof(Addr)) < 0)
+        {
+            errs() << "error: could not connect to " << ConnectPath << "\n";
+            return 1;
+        }
+
+        writeAll(fd, JobArgs[0] + " " + JobArgs[1] + "\n");
+
+        std::string reply;
+        char buffer[4096];
+        ssize_t n;
+        while ((n = read(fd, buffer, sizeof(buffer))) > 0)
+            reply.append(buffer, n);
+        close(fd);
+
+        errs() << reply;
+
+        // The last line is the job's status
+        size_t last = reply.rfind('\n', reply.size() - 2);
+        last = (last == std::string::npos) ? 0 : last + 1;
+        return reply.compare(last, 3, "ok ") == 0 ? 0 : 1;
+    }
+}
+
+int main(int argc, char **argv)
+{
+    InitLLVM X(argc, argv);
+    cl::ParseCommandLineOptions(argc, argv, "MiniC compile server\n");
+
+    if (!ConnectPath.empty())
+        return submit();
+
+    if (JobFile.empty() && SocketPath.empty() && !Run)
+    {
+        errs() << "error: one of -jobs, -socket, -connect or -run is required\n";
+        return 1;
+    }
+
+    unsigned count = Workers ? Workers : std::max(1u, std::thread::hardware_concurrency());
+
+    JobQueue Queue;
+    std::mutex OutputLock;
+    std::vector<std::thread> Pool;
+    for (unsigned i = 0; i < count; i++)
+        Pool.emplace_back(worker, std::ref(Queue), std::ref(OutputLock));
+
+    if (Run)
+    {
+        for (std::string const &Input : JobArgs)
+            Queue.push(Job{Input, "", -1});
+    }
+    else if (!JobFile.empty())
+    {
+        auto Buffer = MemoryBuffer::getFile(JobFile);
+        if (!Buffer)
+        {
+            errs() << "error: could not read " << JobFile << "\n";
+            Queue.close();
+            for (std::thread &T : Pool)
+                T.join();
+            return 1;
+        }
+
+        std::istringstream Stream((*Buffer)->getBuffer().str());
+        Job J;
+        while (Stream >> J.Input >> J.Output)
+            Queue.push(J);
+    }
+    else
+    {
+        // A client hanging up early shouldn't take the server down with it
+        signal(SIGPIPE, SIG_IGN);
+
+        sockaddr_un Addr;
+        int fd = openSocket(SocketPath, Addr);
+        unlink(SocketPath.c_str());
+        if (bind(fd, (sockaddr *)&Addr, sizeof(Addr)) < 0 || listen(fd, 128) < 0)
+        {
+            errs() << "error: could not listen on " << SocketPath << "\n";
+            return 1;
+        }
+
+        while (true)
+        {
+            int client = accept(fd, nullptr, nullptr);
+            if (client < 0)
+                continue;
+
+            Job J;
+            if (!readJob(client, J))
+            {
+                writeAll(client, "error: expected \"<input> <output.s>\"\n");
+                close(client);
+                continue;
+            }
+            J.Reply = client;
+            Queue.push(J);
+        }
+    }
+
+    Queue.close();
+    for (std::thread &T : Pool)
+        T.join();
+
+    return Failures ? 1 : 0;
+}
@@ -0,0 +1,26 @@
+; deadpass makes the branch on false go straight to %live, which leaves
+; %dead without predecessors, and %deader too once %dead is gone. Both are
+; removed, so only %entry, %live and %join are left (Blocks left: 3), and
+; %r is 42 whether or not deadpass has run.
+source_filename = "dead_blocks_test.c"
+target datalayout = "e-m:e-p270:32:32-p271:32:32-p272:64:64-i64:64-f80:128-n8:16:32:64-S128"
+target triple = "x86_64-pc-linux-gnu"
+
+define dso_local i32 @main() {
+entry:
+  br i1 false, label %dead, label %live
+
+dead:
+  %a = add i32 3, 4
+  br label %deader
+
+deader:
+  br label %join
+
+live:
+  br label %join
+
+join:
+  %r = phi i32 [ %a, %deader ], [ 42, %live ]
+  ret i32 %r
+}
@@ -1,9 +1,17 @@
 clang-10 -O -S -Xclang -disable-llvm-passes -emit-llvm $1 -o ./tmp1.ll
 opt-10 -S -mem2reg -o ./tmp2.ll < ./tmp1.ll
-opt-10 -S -load=./ConstPass.so --constpass -o ./tmp3.ll < ./tmp2.ll
-opt-10 -S -load=./DeadPass.so --deadpass -o ./tmp4.ll < ./tmp3.ll
+# With BJC_CACHE set to a directory, functions that haven't changed since the last build are reused from it
+CONSTCACHE=; GENCACHE=
+if [ -n "$BJC_CACHE" ]; then
+    CONSTCACHE="-constpass-cache=$BJC_CACHE -constpass-cache-config=constpass,rangepass,deadpass,constpass,vectorpass,ifconvpass,generatorpass,$(echo $VECTORFLAGS | tr ' ' ',')"
+    GENCACHE="-generatorpass-cache=$BJC_CACHE"
+fi
+opt-10 -S -load=./ConstPass.so --constpass $CONSTCACHE -o ./tmp3.ll < ./tmp2.ll
+opt-10 -S -load=./RangePass.so --rangepass -o ./tmp3r.ll < ./tmp3.ll
+opt-10 -S -load=./DeadPass.so --deadpass -o ./tmp4.ll < ./tmp3r.ll
 opt-10 -S -load=./ConstPass.so --constpass -o ./tmp5.ll < ./tmp4.ll
-opt-10 -S -load=./GeneratorPass.so --generatorpass -o ./$1.out.ll < ./tmp5.ll > $2.s
-as $2.s -o $2.o
+opt-10 -S -load=./VectorPass.so --vectorpass $VECTORFLAGS -o ./tmp6.ll < ./tmp5.ll
+opt-10 -S -load=./IfConvPass.so --ifconvpass -o ./tmp7.ll < ./tmp6.ll
+opt-10 -S -load=./GeneratorPass.so --generatorpass -generatorpass-filetype=obj $GENCACHE -o ./$1.out.ll < ./tmp7.ll > $2.o
 ld $2.o -o $2_f.sh
 chmod +x $2_f.sh
\ No newline at end of file
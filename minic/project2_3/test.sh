@@ -17,13 +17,19 @@ for file in ./ll_tests/*.ll
 do
   echo "------"
   echo "Running: " $file
-  opt-10 -S -load=./GeneratorPass.so --generatorpass -o ./$file.out.ll < $file > $file.s
-  as $file.s -o $file.o
+  opt-10 -S -load=./GeneratorPass.so --generatorpass -generatorpass-filetype=obj -o ./$file.out.ll < $file > $file.o
   ld $file.o -o $file\_f.sh
   chmod +x $file\_f.sh
   $file\_f.sh
   echo "Recieved Output: " $?
 done
 
+for file in ./ll_tests/dead_*.ll
+do
+  echo "------"
+  echo "Running deadpass on: " $file
+  opt-10 -S -load=./DeadPass.so --deadpass -o ./$file.dead < $file
+  echo "Blocks left: " $(grep -c '^[A-Za-z0-9_.]*:' ./$file.dead)
+done
 
-rm -f ll_tests/*.ll.o  ll_tests/*.out* 
\ No newline at end of file
+rm -f ll_tests/*.ll.o ll_tests/*.ll.dead  ll_tests/*.out* 
\ No newline at end of file
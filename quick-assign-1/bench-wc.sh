@@ -0,0 +1,25 @@
+#!/bin/sh
+#
+# Time the flex wc against fastwc on a generated file of SIZE megabytes
+#
+#   ./bench-wc.sh [SIZE] [FILE]
+#
+SIZE=${1:-512}
+FILE=${2:-/tmp/wc-bench.txt}
+
+if [ ! -f "$FILE" ]; then
+	# test.txt over and over, with some binary mixed in
+	yes "$(cat test.txt)" | head -c $((SIZE * 1024 * 1024)) > "$FILE"
+	head -c 1048576 /dev/urandom >> "$FILE"
+fi
+
+expected=$(./wc "$FILE")
+for prog in "./wc" "./fastwc -j 1 -k scalar" "./fastwc -j 1 -k sse2" "./fastwc -j 1 -k avx2" "./fastwc"; do
+	start=$(date +%s.%N)
+	got=$($prog "$FILE")
+	end=$(date +%s.%N)
+	status=ok
+	[ "$got" = "$expected" ] || status="MISMATCH ($got)"
+	elapsed=$(awk "BEGIN { printf \"%.3f\", $end - $start }")
+	printf "%-28s %8ss  %s\n" "$prog" "$elapsed" "$status"
+done
@@ -0,0 +1,248 @@
+/*
+ * caesar-encode.l, caesar-decode.l and rot13.l in one program, with the
+ * rotation given at run time
+ *
+ * Letters are rotated within their case and everything else is copied as
+ * it is, like the flex versions' default ECHO.  Input is transformed a
+ * block at a time with SSE2/AVX2 range compares; regular files are mmapped
+ * and the blocks of a window shared out between threads.
+ *
+ *   caesar [-e | -d | -r] [-n rotation] [-j threads] [-k scalar|sse2|avx2] [file]
+ *
+ * -e encodes (the default), -d decodes and -r is ROT13.  The rotation is 3
+ * unless -n says otherwise.
+ */
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
+
+#define ROTATION 3
+#define BLOCK (1 << 20)		/* bytes transformed and written at a time */
+
+/* A kernel writes in[0..n) rotated forwards by rotation (0-25) to out */
+typedef void (*kernel_fn)(const unsigned char *in, unsigned char *out, size_t n, int rotation);
+
+static void rot_scalar(const unsigned char *in, unsigned char *out, size_t n, int rotation)
+{
+	for (size_t i = 0; i < n; i++) {
+		unsigned char c = in[i], lower = c | 0x20;
+		if (lower >= 'a' && lower <= 'z')
+			c += (lower > 'z' - rotation) ? rotation - 26 : rotation;
+		out[i] = c;
+	}
+}
+
+#ifdef __SSE2__
+/*
+ * Every letter gets rotation added, less 26 if that takes it past the end
+ * of its case.  Bytes >= 0x80 are negative to the signed compares, so they
+ * are never taken for letters.
+ */
+static void rot_sse2(const unsigned char *in, unsigned char *out, size_t n, int rotation)
+{
+	const __m128i lower = _mm_set1_epi8(0x20);
+	const __m128i alpha_lo = _mm_set1_epi8('a' - 1), alpha_hi = _mm_set1_epi8('z' + 1);
+	const __m128i last = _mm_set1_epi8('z' - rotation);
+	const __m128i shift = _mm_set1_epi8(rotation), wrap = _mm_set1_epi8(26);
+	size_t i = 0;
+
+	for (; i + 16 <= n; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(in + i));
+		__m128i l = _mm_or_si128(v, lower);
+		__m128i alpha = _mm_and_si128(_mm_cmpgt_epi8(l, alpha_lo), _mm_cmplt_epi8(l, alpha_hi));
+		__m128i add = _mm_sub_epi8(shift, _mm_and_si128(_mm_cmpgt_epi8(l, last), wrap));
+		_mm_storeu_si128((__m128i *)(out + i), _mm_add_epi8(v, _mm_and_si128(alpha, add)));
+	}
+	rot_scalar(in + i, out + i, n - i, rotation);
+}
+
+/* rot_sse2 on 32 bytes at a time, built for AVX2 whatever -march says */
+__attribute__((target("avx2")))
+static void rot_avx2(const unsigned char *in, unsigned char *out, size_t n, int rotation)
+{
+	const __m256i lower = _mm256_set1_epi8(0x20);
+	const __m256i alpha_lo = _mm256_set1_epi8('a' - 1), alpha_hi = _mm256_set1_epi8('z' + 1);
+	const __m256i last = _mm256_set1_epi8('z' - rotation);
+	const __m256i shift = _mm256_set1_epi8(rotation), wrap = _mm256_set1_epi8(26);
+	size_t i = 0;
+
+	for (; i + 32 <= n; i += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(in + i));
+		__m256i l = _mm256_or_si256(v, lower);
+		__m256i alpha = _mm256_and_si256(_mm256_cmpgt_epi8(l, alpha_lo), _mm256_cmpgt_epi8(alpha_hi, l));
+		__m256i add = _mm256_sub_epi8(shift, _mm256_and_si256(_mm256_cmpgt_epi8(l, last), wrap));
+		_mm256_storeu_si256((__m256i *)(out + i), _mm256_add_epi8(v, _mm256_and_si256(alpha, add)));
+	}
+	rot_scalar(in + i, out + i, n - i, rotation);
+}
+#endif
+
+static kernel_fn pick_kernel(const char *name)
+{
+#ifdef __SSE2__
+	if (name == NULL)
+		return __builtin_cpu_supports("avx2") ? rot_avx2 : rot_sse2;
+	if (strcmp(name, "avx2") == 0 && __builtin_cpu_supports("avx2"))
+		return rot_avx2;
+	if (strcmp(name, "sse2") == 0)
+		return rot_sse2;
+#endif
+	if (name == NULL || strcmp(name, "scalar") == 0)
+		return rot_scalar;
+	fprintf(stderr, "caesar: kernel %s is not available\n", name);
+	exit(1);
+}
+
+/* write all n bytes at p to stdout */
+static int write_all(const unsigned char *p, size_t n)
+{
+	while (n > 0) {
+		ssize_t put = write(1, p, n);
+		if (put < 0) {
+			perror("caesar");
+			return -1;
+		}
+		p += put;
+		n -= put;
+	}
+	return 0;
+}
+
+struct block
+{
+	kernel_fn kernel;
+	const unsigned char *in;
+	unsigned char *out;
+	size_t n;
+	int rotation;
+};
+
+static void *rot_block(void *arg)
+{
+	struct block *b = arg;
+	b->kernel(b->in, b->out, b->n, b->rotation);
+	return NULL;
+}
+
+/*
+ * Transform the n bytes at p on threads threads: a window of one block per
+ * thread at a time, written out in order once the whole window is done.
+ */
+static int rot_mapped(kernel_fn kernel, const unsigned char *p, size_t n, int rotation, int threads)
+{
+	struct block *blocks = calloc(threads, sizeof *blocks);
+	pthread_t *ids = calloc(threads, sizeof *ids);
+	unsigned char *out = malloc((size_t)threads * BLOCK);
+	int status = 0;
+
+	for (size_t done = 0; done < n && status == 0;) {
+		int used = 0;
+		for (; used < threads && done < n; used++) {
+			blocks[used].kernel = kernel;
+			blocks[used].in = p + done;
+			blocks[used].out = out + (size_t)used * BLOCK;
+			blocks[used].n = (n - done < BLOCK) ? n - done : BLOCK;
+			blocks[used].rotation = rotation;
+			done += blocks[used].n;
+			if (used > 0)
+				pthread_create(&ids[used], NULL, rot_block, &blocks[used]);
+		}
+		rot_block(&blocks[0]);
+
+		for (int b = 0; b < used; b++) {
+			if (b > 0)
+				pthread_join(ids[b], NULL);
+			if (status == 0)
+				status = write_all(blocks[b].out, blocks[b].n);
+		}
+	}
+
+	free(blocks);
+	free(ids);
+	free(out);
+	return status;
+}
+
+/* Transform whatever can be read from fd, a block at a time */
+static int rot_stream(kernel_fn kernel, int fd, int rotation)
+{
+	unsigned char *buf = malloc(BLOCK);
+	int status = 0;
+	ssize_t got;
+
+	while (status == 0 && (got = read(fd, buf, BLOCK)) > 0) {
+		kernel(buf, buf, got, rotation);
+		status = write_all(buf, got);
+	}
+	if (status == 0 && got < 0) {
+		perror("caesar");
+		status = -1;
+	}
+	free(buf);
+	return status;
+}
+
+int main (int argc, char **argv)
+{
+	int rotation = ROTATION, decode = 0;
+	int threads = sysconf(_SC_NPROCESSORS_ONLN);
+	const char *kernel_name = NULL;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "edrn:j:k:")) != -1) {
+		if (opt == 'e')
+			decode = 0;
+		else if (opt == 'd')
+			decode = 1;
+		else if (opt == 'r')
+			decode = 0, rotation = 13;
+		else if (opt == 'n')
+			rotation = atoi(optarg);
+		else if (opt == 'j')
+			threads = atoi(optarg);
+		else if (opt == 'k')
+			kernel_name = optarg;
+		else {
+			fprintf(stderr, "usage: %s [-e | -d | -r] [-n rotation] [-j threads] [-k scalar|sse2|avx2] [file]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (threads < 1)
+		threads = 1;
+	kernel_fn kernel = pick_kernel(kernel_name);
+
+	/* decoding is rotating the rest of the way round */
+	rotation = ((rotation % 26) + 26) % 26;
+	if (decode)
+		rotation = (26 - rotation) % 26;
+
+	int fd = 0;
+	if (optind < argc && (fd = open(argv[optind], O_RDONLY)) < 0) {
+		perror(argv[optind]);
+		return 1;
+	}
+
+	int status;
+	struct stat st;
+	void *map = MAP_FAILED;
+	if (threads > 1 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > BLOCK)
+		map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+	if (map != MAP_FAILED) {
+		madvise(map, st.st_size, MADV_SEQUENTIAL);
+		status = rot_mapped(kernel, map, st.st_size, rotation, threads);
+		munmap(map, st.st_size);
+	} else {
+		status = rot_stream(kernel, fd, rotation);
+	}
+
+	return status == 0 ? 0 : 1;
+}
@@ -0,0 +1,486 @@
+/*
+ * wc.l without flex: counts Chars/Words/Lines with SSE2/AVX2 bitmasks
+ *
+ * Counts by the same rules as wc.l: every byte is a char, \n and \r each
+ * end a line, and a word is a run of [0-9A-Za-z-].  Regular files are
+ * mmapped and split across threads, anything else (pipes, stdin) is read
+ * in large blocks.
+ *
+ *   fastwc [-j threads] [-k scalar|sse2|avx2] [-c checkpoint] [-f] [file]
+ *
+ * -c keeps the counts so far in a checkpoint file: how far into the file
+ * they go, and whether they stop in the middle of a word.  The next run
+ * starts from there and counts only what has been appended since, unless
+ * the file has been truncated or replaced (rotated) in the meantime, when
+ * it counts the whole file again.  -f follows the file as it grows, with
+ * inotify, printing the counts again each time they change.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
+
+#define BLOCK (1 << 20)		/* read size for pipes */
+#define MIN_PIECE (8 << 20)	/* smallest piece of a file worth a thread */
+#define HEAD_MAX 4096		/* bytes at the start of a file a checkpoint recognises it by */
+
+struct counts
+{
+	long long chars;
+	long long words;
+	long long lines;
+};
+
+/*
+ * A kernel counts the words and lines in p[0..n).  *in_word says whether
+ * the byte before p was part of a word, and is left saying whether the
+ * last byte was.
+ */
+typedef void (*kernel_fn)(const unsigned char *p, size_t n, int *in_word, struct counts *c);
+
+static int is_word(unsigned char c)
+{
+	return (c >= '0' && c <= '9') || ((c | 0x20) >= 'a' && (c | 0x20) <= 'z') || c == '-';
+}
+
+static void count_scalar(const unsigned char *p, size_t n, int *in_word, struct counts *c)
+{
+	int prev = *in_word;
+	for (size_t i = 0; i < n; i++) {
+		int w = is_word(p[i]);
+		c->words += w && !prev;
+		c->lines += p[i] == '\n' || p[i] == '\r';
+		prev = w;
+	}
+	*in_word = prev;
+}
+
+#ifdef __SSE2__
+/*
+ * One bit per byte: which bytes are word characters and which end a line.
+ * A word starts at every word bit whose lower neighbour (or the carried-in
+ * bit, for bit 0) is clear.  Bytes >= 0x80 are negative to the signed
+ * compares, so they never land in a range.
+ */
+static void count_sse2(const unsigned char *p, size_t n, int *in_word, struct counts *c)
+{
+	const __m128i nl = _mm_set1_epi8('\n'), cr = _mm_set1_epi8('\r'), dash = _mm_set1_epi8('-');
+	const __m128i digit_lo = _mm_set1_epi8('0' - 1), digit_hi = _mm_set1_epi8('9' + 1);
+	const __m128i alpha_lo = _mm_set1_epi8('a' - 1), alpha_hi = _mm_set1_epi8('z' + 1);
+	const __m128i lower = _mm_set1_epi8(0x20);
+	unsigned prev = *in_word;
+	long long words = 0, lines = 0;
+	size_t i = 0;
+
+	for (; i + 16 <= n; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+		__m128i l = _mm_or_si128(v, lower);
+		__m128i digit = _mm_and_si128(_mm_cmpgt_epi8(v, digit_lo), _mm_cmplt_epi8(v, digit_hi));
+		__m128i alpha = _mm_and_si128(_mm_cmpgt_epi8(l, alpha_lo), _mm_cmplt_epi8(l, alpha_hi));
+		__m128i word = _mm_or_si128(_mm_or_si128(digit, alpha), _mm_cmpeq_epi8(v, dash));
+		__m128i end = _mm_or_si128(_mm_cmpeq_epi8(v, nl), _mm_cmpeq_epi8(v, cr));
+
+		unsigned w = _mm_movemask_epi8(word);
+		words += __builtin_popcount(w & ~((w << 1) | prev));
+		lines += __builtin_popcount(_mm_movemask_epi8(end));
+		prev = w >> 15;
+	}
+
+	c->words += words;
+	c->lines += lines;
+	*in_word = prev;
+	count_scalar(p + i, n - i, in_word, c);
+}
+
+/* count_sse2 on 32 bytes at a time, built for AVX2 whatever -march says */
+__attribute__((target("avx2,popcnt")))
+static void count_avx2(const unsigned char *p, size_t n, int *in_word, struct counts *c)
+{
+	const __m256i nl = _mm256_set1_epi8('\n'), cr = _mm256_set1_epi8('\r'), dash = _mm256_set1_epi8('-');
+	const __m256i digit_lo = _mm256_set1_epi8('0' - 1), digit_hi = _mm256_set1_epi8('9' + 1);
+	const __m256i alpha_lo = _mm256_set1_epi8('a' - 1), alpha_hi = _mm256_set1_epi8('z' + 1);
+	const __m256i lower = _mm256_set1_epi8(0x20);
+	unsigned prev = *in_word;
+	long long words = 0, lines = 0;
+	size_t i = 0;
+
+	for (; i + 32 <= n; i += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(p + i));
+		__m256i l = _mm256_or_si256(v, lower);
+		__m256i digit = _mm256_and_si256(_mm256_cmpgt_epi8(v, digit_lo), _mm256_cmpgt_epi8(digit_hi, v));
+		__m256i alpha = _mm256_and_si256(_mm256_cmpgt_epi8(l, alpha_lo), _mm256_cmpgt_epi8(alpha_hi, l));
+		__m256i word = _mm256_or_si256(_mm256_or_si256(digit, alpha), _mm256_cmpeq_epi8(v, dash));
+		__m256i end = _mm256_or_si256(_mm256_cmpeq_epi8(v, nl), _mm256_cmpeq_epi8(v, cr));
+
+		unsigned w = _mm256_movemask_epi8(word);
+		words += __builtin_popcount(w & ~((w << 1) | prev));
+		lines += __builtin_popcount(_mm256_movemask_epi8(end));
+		prev = w >> 31;
+	}
+
+	c->words += words;
+	c->lines += lines;
+	*in_word = prev;
+	count_scalar(p + i, n - i, in_word, c);
+}
+#endif
+
+static kernel_fn pick_kernel(const char *name)
+{
+#ifdef __SSE2__
+	if (name == NULL)
+		return __builtin_cpu_supports("avx2") ? count_avx2 : count_sse2;
+	if (strcmp(name, "avx2") == 0 && __builtin_cpu_supports("avx2"))
+		return count_avx2;
+	if (strcmp(name, "sse2") == 0)
+		return count_sse2;
+#endif
+	if (name == NULL || strcmp(name, "scalar") == 0)
+		return count_scalar;
+	fprintf(stderr, "fastwc: kernel %s is not available\n", name);
+	exit(1);
+}
+
+struct piece
+{
+	kernel_fn kernel;
+	const unsigned char *start;
+	const unsigned char *p;
+	size_t n;
+	int in_word;		/* for the first piece: whether a word runs into it */
+	struct counts c;
+};
+
+static void *count_piece(void *arg)
+{
+	struct piece *piece = arg;
+	/* a word running into the piece was counted by the piece before it */
+	int in_word = piece->p > piece->start ? is_word(piece->p[-1]) : piece->in_word;
+	piece->kernel(piece->p, piece->n, &in_word, &piece->c);
+	return NULL;
+}
+
+/*
+ * Count the n bytes at p on up to threads threads.  *in_word is as for a
+ * kernel.
+ */
+static struct counts count_mapped(kernel_fn kernel, const unsigned char *p, size_t n, int threads, int *in_word)
+{
+	struct counts total = { n, 0, 0 };
+	if (n / threads < MIN_PIECE)
+		threads = n / MIN_PIECE > 0 ? n / MIN_PIECE : 1;
+
+	struct piece *pieces = calloc(threads, sizeof *pieces);
+	pthread_t *ids = calloc(threads, sizeof *ids);
+	size_t size = n / threads;
+	for (int t = 0; t < threads; t++) {
+		pieces[t].kernel = kernel;
+		pieces[t].start = p;
+		pieces[t].p = p + t * size;
+		pieces[t].n = (t == threads - 1) ? n - t * size : size;
+		pieces[t].in_word = *in_word;
+		if (t > 0)
+			pthread_create(&ids[t], NULL, count_piece, &pieces[t]);
+	}
+	count_piece(&pieces[0]);
+
+	for (int t = 0; t < threads; t++) {
+		if (t > 0)
+			pthread_join(ids[t], NULL);
+		total.words += pieces[t].c.words;
+		total.lines += pieces[t].c.lines;
+	}
+	free(pieces);
+	free(ids);
+	if (n > 0)
+		*in_word = is_word(p[n - 1]);
+	return total;
+}
+
+/* Count whatever can be read from fd, a block at a time */
+static struct counts count_stream(kernel_fn kernel, int fd)
+{
+	struct counts total = { 0, 0, 0 };
+	unsigned char *buf = malloc(BLOCK);
+	int in_word = 0;
+	ssize_t got;
+
+	while ((got = read(fd, buf, BLOCK)) > 0) {
+		kernel(buf, got, &in_word, &total);
+		total.chars += got;
+	}
+	if (got < 0)
+		perror("fastwc");
+	free(buf);
+	return total;
+}
+
+/*
+ * How far counting a file has got: c.chars is also the offset to go on
+ * from.  The file is known again by its device and inode, and a hash of
+ * its first head_len bytes for one truncated and written again in place.
+ */
+struct checkpoint
+{
+	dev_t dev;
+	ino_t ino;
+	struct counts c;
+	int in_word;		/* the last byte counted was part of a word */
+	unsigned head_len;
+	uint64_t head_hash;
+};
+
+/* FNV-1a of the first len (at most HEAD_MAX) bytes of the file open on fd */
+static uint64_t hash_head(int fd, unsigned len)
+{
+	unsigned char buf[HEAD_MAX];
+	uint64_t h = 14695981039346656037ULL;
+	ssize_t got = pread(fd, buf, len, 0);
+	for (ssize_t i = 0; i < got; i++)
+		h = (h ^ buf[i]) * 1099511628211ULL;
+	return h;
+}
+
+/* Read the checkpoint at path into cp; -1, with cp zeroed, if there isn't one */
+static int load_checkpoint(const char *path, struct checkpoint *cp)
+{
+	unsigned long long dev, ino, hash;
+	FILE *f = fopen(path, "r");
+	if (f == NULL) {
+		if (errno != ENOENT)
+			perror(path);
+		return -1;
+	}
+	int got = fscanf(f, "fastwc 1 %llu %llu %lld %lld %lld %d %u %llx", &dev, &ino,
+	                 &cp->c.chars, &cp->c.words, &cp->c.lines, &cp->in_word, &cp->head_len, &hash);
+	fclose(f);
+	if (got != 8 || cp->c.chars < 0 || cp->head_len > HEAD_MAX) {
+		fprintf(stderr, "fastwc: %s is not a checkpoint; counting from the start\n", path);
+		*cp = (struct checkpoint){ 0 };
+		return -1;
+	}
+	cp->dev = dev;
+	cp->ino = ino;
+	cp->head_hash = hash;
+	return 0;
+}
+
+/*
+ * Write cp to path, by way of path.tmp so that it is the old checkpoint or
+ * the new one.  It isn't synced: a checkpoint lost in a crash only costs
+ * counting the whole file again.
+ */
+static void save_checkpoint(const char *path, const struct checkpoint *cp)
+{
+	char tmp[4096];
+	snprintf(tmp, sizeof tmp, "%s.tmp", path);
+	FILE *f = fopen(tmp, "w");
+	if (f == NULL) {
+		perror(tmp);
+		exit(1);
+	}
+	fprintf(f, "fastwc 1 %llu %llu %lld %lld %lld %d %u %llx\n",
+	        (unsigned long long)cp->dev, (unsigned long long)cp->ino, cp->c.chars, cp->c.words,
+	        cp->c.lines, cp->in_word, cp->head_len, (unsigned long long)cp->head_hash);
+	if (fclose(f) != 0 || rename(tmp, path) != 0) {
+		perror(path);
+		exit(1);
+	}
+}
+
+/*
+ * Bring cp up to the end of the regular file open on fd, counting only
+ * what has been appended since, or the whole file again if it isn't the
+ * one cp was counting or has been cut shorter than cp got.  Returns 1 if
+ * the counts changed.
+ */
+static int catch_up(kernel_fn kernel, int fd, int threads, struct checkpoint *cp)
+{
+	struct stat st;
+	int changed = 0;
+
+	if (fstat(fd, &st) < 0) {
+		perror("fastwc");
+		exit(1);
+	}
+	if (st.st_dev != cp->dev || st.st_ino != cp->ino || st.st_size < cp->c.chars
+	    || hash_head(fd, cp->head_len) != cp->head_hash) {
+		if (cp->c.chars > 0)
+			fprintf(stderr, "fastwc: the file has been truncated or replaced; counting it again\n");
+		*cp = (struct checkpoint){ .dev = st.st_dev, .ino = st.st_ino, .head_hash = hash_head(fd, 0) };
+		changed = 1;
+	}
+
+	if (st.st_size > cp->c.chars) {
+		/* map from the page the new bytes start in */
+		off_t base = cp->c.chars & ~(off_t)(sysconf(_SC_PAGESIZE) - 1);
+		size_t len = st.st_size - base;
+		unsigned char *map = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, base);
+		if (map == MAP_FAILED) {
+			perror("fastwc");
+			exit(1);
+		}
+		madvise(map, len, MADV_SEQUENTIAL);
+		struct counts c = count_mapped(kernel, map + (cp->c.chars - base), st.st_size - cp->c.chars,
+		                               threads, &cp->in_word);
+		munmap(map, len);
+		cp->c.chars += c.chars;
+		cp->c.words += c.words;
+		cp->c.lines += c.lines;
+		changed = 1;
+	}
+
+	if (cp->head_len < HEAD_MAX && cp->head_len < cp->c.chars) {
+		cp->head_len = cp->c.chars < HEAD_MAX ? cp->c.chars : HEAD_MAX;
+		cp->head_hash = hash_head(fd, cp->head_len);
+	}
+	return changed;
+}
+
+static void report(const struct checkpoint *cp, const char *checkpoint)
+{
+	printf ("Chars: %lld, Words: %lld, Lines: %lld\n", cp->c.chars, cp->c.words, cp->c.lines);
+	fflush(stdout);
+	if (checkpoint != NULL)
+		save_checkpoint(checkpoint, cp);
+}
+
+#define FILE_EVENTS (IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF)
+
+/*
+ * Count path, open on fd, as it grows, reporting each time the counts
+ * change.  When another file takes its name (it has been rotated) the rest
+ * of the old one is counted, and then the new one from the start.  Only
+ * returns on an error.
+ */
+static void follow(kernel_fn kernel, const char *path, int fd, int threads, struct checkpoint *cp,
+                   const char *checkpoint)
+{
+	char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	char *dir = strdup(path);
+	int in = inotify_init1(IN_CLOEXEC);
+	int wd = -1;
+
+	/* the directory too, to see a new file appear under the name */
+	if (in < 0 || inotify_add_watch(in, dirname(dir), IN_CREATE | IN_MOVED_TO) < 0
+	    || (wd = inotify_add_watch(in, path, FILE_EVENTS)) < 0) {
+		perror(path);
+		free(dir);
+		return;
+	}
+	free(dir);
+
+	/* anything appended before the watch was set up */
+	if (catch_up(kernel, fd, threads, cp))
+		report(cp, checkpoint);
+
+	for (;;) {
+		if (read(in, events, sizeof events) < 0 && errno != EINTR) {
+			perror("inotify");
+			return;
+		}
+		if (catch_up(kernel, fd, threads, cp))
+			report(cp, checkpoint);
+
+		struct stat st;
+		if (stat(path, &st) < 0 || (st.st_dev == cp->dev && st.st_ino == cp->ino))
+			continue;
+		int new_fd = open(path, O_RDONLY);
+		if (new_fd < 0)
+			continue;
+		close(fd);
+		fd = new_fd;
+		inotify_rm_watch(in, wd);
+		if ((wd = inotify_add_watch(in, path, FILE_EVENTS)) < 0) {
+			perror(path);
+			return;
+		}
+		if (catch_up(kernel, fd, threads, cp))
+			report(cp, checkpoint);
+	}
+}
+
+int main (int argc, char **argv)
+{
+	int threads = sysconf(_SC_NPROCESSORS_ONLN);
+	const char *kernel_name = NULL, *checkpoint = NULL;
+	int following = 0;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "j:k:c:f")) != -1) {
+		if (opt == 'j')
+			threads = atoi(optarg);
+		else if (opt == 'k')
+			kernel_name = optarg;
+		else if (opt == 'c')
+			checkpoint = optarg;
+		else if (opt == 'f')
+			following = 1;
+		else {
+			fprintf(stderr, "usage: %s [-j threads] [-k scalar|sse2|avx2] [-c checkpoint] [-f] [file]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (threads < 1)
+		threads = 1;
+	kernel_fn kernel = pick_kernel(kernel_name);
+
+	if ((checkpoint != NULL || following) && optind >= argc) {
+		fprintf(stderr, "fastwc: -c and -f need a file\n");
+		return 1;
+	}
+
+	int fd = 0;
+	if (optind < argc && (fd = open(argv[optind], O_RDONLY)) < 0) {
+		perror(argv[optind]);
+		return 1;
+	}
+
+	struct counts c;
+	struct stat st;
+	void *map = MAP_FAILED;
+	int regular = fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
+
+	if (checkpoint != NULL || following) {
+		struct checkpoint cp = { 0 };
+		if (!regular) {
+			fprintf(stderr, "fastwc: %s: -c and -f need a regular file\n", argv[optind]);
+			return 1;
+		}
+		if (checkpoint != NULL)
+			load_checkpoint(checkpoint, &cp);
+		catch_up(kernel, fd, threads, &cp);
+		report(&cp, checkpoint);
+		if (following) {
+			follow(kernel, argv[optind], fd, threads, &cp, checkpoint);
+			return 1;
+		}
+		return 0;
+	}
+
+	if (regular && st.st_size > 0)
+		map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+	if (map != MAP_FAILED) {
+		int in_word = 0;
+		madvise(map, st.st_size, MADV_SEQUENTIAL);
+		c = count_mapped(kernel, map, st.st_size, threads, &in_word);
+		munmap(map, st.st_size);
+	} else {
+		c = count_stream(kernel, fd);
+	}
+
+	printf ("Chars: %lld, Words: %lld, Lines: %lld\n", c.chars, c.words, c.lines);
+	return 0;
+}
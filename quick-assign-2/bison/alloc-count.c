@@ -0,0 +1,113 @@
+/*
+ * Counts the allocations a program makes, for bench.py
+ *
+ *   LD_PRELOAD=./alloc-count.so ./bluster -q commands.txt
+ *
+ * Wraps malloc, calloc and realloc, passing each on to libc's, and writes
+ * "allocations: N bytes: M" to stderr as the program exits.  dlsym may
+ * itself allocate while libc's functions are being looked up, so what it
+ * asks for comes from a static buffer and is never freed.
+ */
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+static void *(*real_malloc)(size_t);
+static void *(*real_calloc)(size_t, size_t);
+static void *(*real_realloc)(void *, size_t);
+static void (*real_free)(void *);
+
+static long long allocations, bytes;
+
+static char early[4096] __attribute__((aligned(16)));
+static size_t early_used;
+static int resolving;
+
+static void resolve(void)
+{
+  resolving = 1;
+  real_malloc = dlsym(RTLD_NEXT, "malloc");
+  real_calloc = dlsym(RTLD_NEXT, "calloc");
+  real_realloc = dlsym(RTLD_NEXT, "realloc");
+  real_free = dlsym(RTLD_NEXT, "free");
+  resolving = 0;
+}
+
+/* Zeroed, as the buffer starts out and nothing in it is reused */
+static void *early_alloc(size_t size)
+{
+  size_t want = (size + 15) & ~(size_t)15;
+  if (early_used + want > sizeof early)
+    return NULL;
+  void *p = early + early_used;
+  early_used += want;
+  return p;
+}
+
+static int is_early(const void *p)
+{
+  return (const char *)p >= early && (const char *)p < early + sizeof early;
+}
+
+static void counted(size_t size)
+{
+  __atomic_add_fetch(&allocations, 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&bytes, size, __ATOMIC_RELAXED);
+}
+
+void *malloc(size_t size)
+{
+  if (resolving)
+    return early_alloc(size);
+  if (real_malloc == NULL)
+    resolve();
+  counted(size);
+  return real_malloc(size);
+}
+
+void *calloc(size_t n, size_t size)
+{
+  if (resolving)
+    return early_alloc(n * size);
+  if (real_calloc == NULL)
+    resolve();
+  counted(n * size);
+  return real_calloc(n, size);
+}
+
+void *realloc(void *p, size_t size)
+{
+  if (resolving)
+    return NULL;
+  if (real_realloc == NULL)
+    resolve();
+  counted(size);
+  if (is_early(p)) {
+    /* how big it was isn't kept; copy what there could be of it */
+    size_t left = early + sizeof early - (char *)p;
+    void *q = real_malloc(size);
+    if (q != NULL)
+      memcpy(q, p, size < left ? size : left);
+    return q;
+  }
+  return real_realloc(p, size);
+}
+
+void free(void *p)
+{
+  if (p == NULL || is_early(p))
+    return;
+  if (real_free == NULL)
+    resolve();
+  real_free(p);
+}
+
+__attribute__((destructor)) static void report(void)
+{
+  char line[64];
+  int n = snprintf(line, sizeof line, "allocations: %lld bytes: %lld\n", allocations, bytes);
+  if (write(2, line, n) < 0)
+    return;
+}
@@ -0,0 +1,113 @@
+/*
+ * Per-command arena and message spans for bluster
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#include "bluster.h"
+
+#define ARENA_BLOCK_SIZE 4096
+
+struct arena_block {
+  struct arena_block *next;
+  size_t used;
+  size_t size;
+  char data[];
+};
+
+static struct arena_block *block_new(size_t size)
+{
+  struct arena_block *b = malloc(sizeof *b + size);
+  if (b == NULL) {
+    perror("bluster");
+    exit(1);
+  }
+  b->next = NULL;
+  b->used = 0;
+  b->size = size;
+  return b;
+}
+
+void *arena_alloc(struct arena *a, size_t n)
+{
+  n = (n + 15) & ~(size_t)15;
+
+  if (a->current == NULL)
+    a->first = a->current = block_new(n > ARENA_BLOCK_SIZE ? n : ARENA_BLOCK_SIZE);
+
+  /* Move on to the next block (reusing one from an earlier command if there is one) until it fits */
+  while (a->current->used + n > a->current->size) {
+    if (a->current->next == NULL)
+      a->current->next = block_new(n > ARENA_BLOCK_SIZE ? n : ARENA_BLOCK_SIZE);
+    a->current = a->current->next;
+    a->current->used = 0;
+  }
+
+  void *p = a->current->data + a->current->used;
+  a->current->used += n;
+  return p;
+}
+
+struct span arena_copy(struct arena *a, struct span s)
+{
+  char *p = arena_alloc(a, s.len);
+  memcpy(p, s.ptr, s.len);
+  return (struct span){ p, s.len };
+}
+
+void arena_reset(struct arena *a)
+{
+  a->current = a->first;
+  if (a->current != NULL)
+    a->current->used = 0;
+}
+
+void arena_free(struct arena *a)
+{
+  struct arena_block *b = a->first;
+  while (b != NULL) {
+    struct arena_block *next = b->next;
+    free(b);
+    b = next;
+  }
+  a->first = a->current = NULL;
+}
+
+void message_add(struct arena *a, struct message *m, struct span text)
+{
+  m->len += (m->first != NULL) + text.len;
+  if (m->len > MESSAGE_MAX)
+    m->too_long = 1;
+  if (m->too_long)
+    return;
+
+  struct word *w = arena_alloc(a, sizeof *w);
+  w->text = arena_copy(a, text);
+  w->next = NULL;
+  if (m->last != NULL)
+    m->last->next = w;
+  else
+    m->first = w;
+  m->last = w;
+}
+
+void message_print(FILE *out, const struct message *m)
+{
+  for (const struct word *w = m->first; w != NULL; w = w->next) {
+    if (w != m->first)
+      putc(' ', out);
+    fwrite(w->text.ptr, 1, w->text.len, out);
+  }
+}
+
+int message_join(const struct message *m, char *out)
+{
+  int len = 0;
+  for (const struct word *w = m->first; w != NULL; w = w->next) {
+    if (w != m->first)
+      out[len++] = ' ';
+    memcpy(out + len, w->text.ptr, w->text.len);
+    len += w->text.len;
+  }
+  return len;
+}
@@ -0,0 +1,133 @@
+#!/usr/bin/env python3
+"""Time bluster over a command file, in each of the ways it can run one.
+
+  bench.py [--bluster ./bluster] [--corpus file | gen-commands.py options]
+           [--modes default,flex,workers,log] [--repeat N] [--json]
+
+Writes a corpus with gen-commands.py (any options it doesn't know are passed
+on to that) unless --corpus names one, then runs `bluster -q -k` over it in
+each mode:
+
+  default   as it is
+  flex      with -F, every line scanned by flex
+  workers   with -w 2, commands carried out on two delivery threads
+  log       with -d, writing every message to a log in a new directory
+
+and reports, for the best of --repeat runs, commands/s and MB/s of input,
+and the peak RSS.  With alloc-count.so next to bluster (`make alloc-count.so`)
+it runs each mode once more under it and reports allocations per command.
+--json prints the same as one JSON object, for keeping next to a commit.
+"""
+
+import argparse
+import json
+import os
+import shutil
+import subprocess
+import sys
+import tempfile
+import time
+
+MODES = {
+    "default": [],
+    "flex": ["-F"],
+    "workers": ["-w", "2"],
+    "log": ["-d", None],
+}
+
+
+def run(cmd, env=None):
+    """Run @cmd with its output thrown away; returns (seconds, peak RSS KB, stderr)"""
+    with tempfile.TemporaryFile() as err:
+        start = time.perf_counter()
+        p = subprocess.Popen(cmd, stdout=subprocess.DEVNULL, stderr=err, env=env)
+        _, status, usage = os.wait4(p.pid, 0)
+        secs = time.perf_counter() - start
+        p.returncode = os.waitstatus_to_exitcode(status)
+        err.seek(0)
+        text = err.read().decode(errors="replace")
+    if p.returncode != 0:
+        sys.exit("%s: exit %d\n%s" % (" ".join(cmd), p.returncode, text))
+    return secs, usage.ru_maxrss, text
+
+
+def bench(bluster, mode, corpus, repeat, alloc):
+    best = None
+    for _ in range(repeat):
+        logdir = tempfile.mkdtemp(prefix="bluster-bench-")
+        shutil.rmtree(logdir)
+        args = [logdir if a is None else a for a in MODES[mode]]
+        result = run([bluster, "-q", "-k"] + args + [corpus])
+        shutil.rmtree(logdir, ignore_errors=True)
+        if best is None or result[0] < best[0]:
+            best = result
+    allocations = None
+    if alloc:
+        logdir = tempfile.mkdtemp(prefix="bluster-bench-")
+        shutil.rmtree(logdir)
+        args = [logdir if a is None else a for a in MODES[mode]]
+        env = dict(os.environ, LD_PRELOAD=alloc)
+        _, _, err = run([bluster, "-q", "-k"] + args + [corpus], env)
+        shutil.rmtree(logdir, ignore_errors=True)
+        for line in err.splitlines():
+            if line.startswith("allocations: "):
+                allocations = int(line.split()[1])
+    return best[0], best[1], allocations
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    ap.add_argument("--bluster", default="./bluster")
+    ap.add_argument("--corpus")
+    ap.add_argument("--modes", default=",".join(MODES))
+    ap.add_argument("--repeat", type=int, default=3)
+    ap.add_argument("--json", action="store_true")
+    args, gen_args = ap.parse_known_args()
+
+    here = os.path.dirname(os.path.abspath(__file__))
+    corpus = args.corpus
+    if corpus is None:
+        fd, corpus = tempfile.mkstemp(prefix="bench-corpus-", suffix=".txt")
+        with os.fdopen(fd, "w") as out:
+            subprocess.run([sys.executable, os.path.join(here, "gen-commands.py")] + gen_args,
+                           stdout=out, check=True)
+    elif gen_args:
+        ap.error("gen-commands.py options with --corpus: %s" % " ".join(gen_args))
+
+    alloc = os.path.join(os.path.dirname(os.path.abspath(args.bluster)), "alloc-count.so")
+    alloc = alloc if os.path.exists(alloc) else None
+    size = os.path.getsize(corpus)
+    with open(corpus, "rb") as f:
+        commands = sum(1 for _ in f)
+
+    results = {}
+    try:
+        for mode in args.modes.split(","):
+            if mode not in MODES:
+                ap.error("no mode %r; there are %s" % (mode, ", ".join(MODES)))
+            secs, rss, allocations = bench(args.bluster, mode, corpus, args.repeat, alloc)
+            results[mode] = {
+                "seconds": secs,
+                "commands_per_sec": commands / secs,
+                "mb_per_sec": size / 1e6 / secs,
+                "peak_rss_kb": rss,
+                "allocations_per_command": None if allocations is None else allocations / commands,
+            }
+    finally:
+        if args.corpus is None:
+            os.unlink(corpus)
+
+    if args.json:
+        json.dump({"commands": commands, "bytes": size, "gen_args": gen_args, "modes": results},
+                  sys.stdout, indent=2)
+        print()
+        return
+    print("%d commands, %.1f MB" % (commands, size / 1e6))
+    for mode, r in results.items():
+        allocs = "-" if r["allocations_per_command"] is None else "%.3f" % r["allocations_per_command"]
+        print("%-8s %8.3f s %12.0f commands/s %8.1f MB/s %8d KB peak RSS %8s allocations/command"
+              % (mode, r["seconds"], r["commands_per_sec"], r["mb_per_sec"], r["peak_rss_kb"], allocs))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,141 @@
+/*
+ * Types shared by the bluster scanner and parser
+ */
+#ifndef BLUSTER_H
+#define BLUSTER_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+#define MAX_MESSAGE_LEN 80
+/* The longest message kept: the first bluster checked strlen - 1 against MAX_MESSAGE_LEN, which lets one more byte by */
+#define MESSAGE_MAX (MAX_MESSAGE_LEN + 1)
+
+/* A piece of text, not NUL-terminated */
+struct span {
+  const char *ptr;
+  int len;
+};
+
+/* A word of a message, and the one after it */
+struct word {
+  struct span text;
+  struct word *next;
+};
+
+/*
+ * The words of a message, and how long it is when they are joined with
+ * single spaces.  Once that goes over MESSAGE_MAX the message is marked
+ * too long and no more of its words are kept.
+ */
+struct message {
+  struct word *first;
+  struct word *last;
+  int len;
+  int too_long;
+};
+
+/*
+ * Memory for a single command.  Everything allocated from it is dropped at
+ * once by arena_reset when the command is done; its blocks are kept for the
+ * next command, so a session settles at the size of its biggest command.
+ */
+struct arena_block;
+struct arena {
+  struct arena_block *first;
+  struct arena_block *current;
+};
+
+void *arena_alloc(struct arena *a, size_t n);
+struct span arena_copy(struct arena *a, struct span s);
+void arena_reset(struct arena *a);
+void arena_free(struct arena *a);
+
+/* Add @text to the end of @m, keeping it in @a */
+void message_add(struct arena *a, struct message *m, struct span text);
+/* Write the words of @m to @out, separated by single spaces */
+void message_print(FILE *out, const struct message *m);
+/* Copy them to @out (at least MESSAGE_MAX bytes, no NUL), returning the length */
+int message_join(const struct message *m, char *out);
+
+enum session_status {
+  SESSION_OPEN,
+  SESSION_EXITED,		/* ran EXIT */
+  SESSION_ENDED,		/* ran out of input after a whole command */
+  SESSION_FAILED,		/* syntax error, or a message too long */
+};
+
+/*
+ * One command stream: its own scanner, parser and arena, so any number of
+ * them can be parsed at once, on one thread as their bytes arrive or on
+ * several.  Sessions on different threads need different engines.
+ */
+struct engine;
+struct user;
+struct yypstate;
+struct session {
+  struct engine *engine;
+  FILE *out;
+  FILE *err;			/* syntax errors, stderr unless told otherwise */
+  int quiet;			/* run the commands without printing them */
+  int keep_going;		/* skip bad commands instead of failing the session */
+  int flex_only;		/* scan every line with flex, not just the ones fast_scan can't */
+  FILE *tokens;			/* if set, print the tokens here instead of parsing them */
+  /* called with each user ADD names, new or not, if set */
+  void (*added)(struct session *s, struct user *u);
+
+  void *scanner;
+  struct yypstate *parser;
+  struct arena command;
+
+  /* input read since the last complete line */
+  char *line;
+  size_t len;
+  size_t cap;
+
+  long long commands;
+  enum session_status status;
+};
+
+void session_init(struct session *s, struct engine *e, FILE *out);
+void session_free(struct session *s);
+/* Run the complete lines in the next @n bytes of input, keeping the rest for later */
+enum session_status session_feed(struct session *s, const char *p, size_t n);
+/* Run whatever is left when the input ends */
+enum session_status session_end(struct session *s);
+
+/* The session's scanner, in bluster.lex */
+int scan_init(struct session *s);
+void scan_free(struct session *s);
+/*
+ * Scan @buf[0..len), which has room for two more bytes after it, and push
+ * its tokens to the parser until it wants no more.  Returns the last of
+ * bison's push statuses.
+ */
+int scan_lines(struct session *s, char *buf, size_t len);
+
+/* A token found without flex, by the fast path in fastscan.c */
+struct token {
+  int type;
+  struct span text;
+};
+
+#define TOKENS_MAX 256		/* a line with more is left to flex */
+
+/*
+ * The tokens of the first line in [p, end), and the EOL that ends it if
+ * there is one before end, the same as flex would make of it.  Like
+ * yy_scan_buffer, it wants two more bytes after end that can be read.  *next is
+ * set to where the line after it starts.  Returns how many tokens there
+ * are, or -1 if the line has to be scanned by flex after all.
+ */
+int fast_scan(const char *p, const char *end, struct token *out, const char **next);
+
+/*
+ * Serve sessions over the Unix domain socket @path until SIGINT/SIGTERM,
+ * recording them in @log if it isn't NULL, in server.c
+ */
+struct msglog;
+int serve(const char *path, int stats, struct msglog *log);
+
+#endif
@@ -1,27 +1,58 @@
+%code requires {
+#include "bluster.h"
+}
+
 %{
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "engine.h"
+#include "msglog.h"
+
+#define READ_SIZE (1 << 16)
 
-int yylex();
-void yyerror(char *s);
+void yyerror(struct session *s, const char *msg);
 
-#define MAX_MESSAGE_LEN 80
+/*
+ * Tokens point into the scanner's buffer, which is only good until the next
+ * batch of lines is scanned.  Whatever a command needs for longer (its user,
+ * and its message up to MESSAGE_MAX) is copied into the session's
+ * command arena, and dropped once the command is done.
+ */
+static void done(struct session *s)
+{
+  arena_reset(&s->command);
+  s->commands++;
+}
+
+static void too_long(struct session *s)
+{
+  fprintf(s->out, "Message too long.\n");
+}
 
 %}
 
+%define api.pure full
+%define api.push-pull push
+%parse-param {struct session *s}
+
 %start prog
 
 %union {
-  char *val;
-  int len;
+  struct span tok;
+  struct message msg;
 }
 
-%token <val> WORD USER ADD BLAST SEND
+%token <tok> WORD USER ADD BLAST SEND
 %token EOL EXIT SPACE
 
-%type <val> message
-%type <val> word
+%type <msg> message
+%type <tok> word user
 
 %%
 
@@ -29,44 +60,345 @@ prog: exp
   |   prog exp
   ;
 
-exp:    EXIT EOL                                { exit(0); }
-    |   ADD SPACE USER EOL                      { printf("Adding user: %s\n", $3); }
-    |   BLAST message EOL                       { 
-      if (strlen($2)-1 > MAX_MESSAGE_LEN) {
-        printf("Message too long.\n");
-        exit(1);
+exp:    EXIT EOL                                { s->commands++; s->status = SESSION_EXITED; YYACCEPT; }
+    |   ADD SPACE user EOL                      {
+      engine_add(s->engine, $3);
+      if (s->added != NULL)
+        s->added(s, engine_find(s->engine, $3));
+      if (!s->quiet)
+        fprintf(s->out, "Adding user: %.*s\n", $3.len, $3.ptr);
+      done(s);
+    }
+    |   BLAST message EOL                       {
+      if ($2.too_long) {
+        too_long(s);
+        if (!s->keep_going)
+          YYABORT;
+      } else {
+        engine_blast(s->engine, &$2);
+        if (!s->quiet) {
+          flockfile(s->out);
+          fprintf(s->out, "Blasting: ");
+          message_print(s->out, &$2);
+          fprintf(s->out, "\n");
+          funlockfile(s->out);
+        }
       }
-      printf("Blasting: %s\n", $2); 
+      done(s);
     }
-    |   SEND SPACE USER message EOL             { 
-      if (strlen($4)-1 > MAX_MESSAGE_LEN) {
-        printf("Message too long.\n");
-        exit(1);
+    |   SEND SPACE user message EOL             {
+      if ($4.too_long) {
+        too_long(s);
+        if (!s->keep_going)
+          YYABORT;
+      } else {
+        engine_send(s->engine, $3, &$4);
+        if (!s->quiet) {
+          flockfile(s->out);
+          fprintf(s->out, "Sending: \"");
+          message_print(s->out, &$4);
+          fprintf(s->out, "\" to %.*s\n", $3.len, $3.ptr);
+          funlockfile(s->out);
+        }
       }
-      printf("Sending: \"%s\" to %s\n", $4, $3); 
+      done(s);
+    }
+    /* With keep_going, the rest of a bad line is thrown away and the next one parsed as usual */
+    |   error EOL                               {
+      if (!s->keep_going)
+        YYABORT;
+      yyerrok;
+      arena_reset(&s->command);
     }
     ;
 
-message:  SPACE word { $$ = $2; }                      
-    |     message SPACE word { $$ = $1; strcat($$, " "); strcat($$, $3); }
-    ;  
+message:  SPACE word { $$ = (struct message){ 0 }; message_add(&s->command, &$$, $2); }
+    |     message SPACE word { $$ = $1; message_add(&s->command, &$$, $3); }
+    ;
 
 word: WORD | BLAST | ADD | SEND;
 
+/* Reduced as soon as USER is shifted, while its text is still in the scanner's buffer */
+user: USER { $$ = arena_copy(&s->command, $1); };
+
 
 %%
 
-int main(int argc, char **argv)
+void session_init(struct session *s, struct engine *e, FILE *out)
 {
-  yyparse();
+  memset(s, 0, sizeof *s);
+  s->engine = e;
+  s->out = out;
+  s->err = stderr;
+  s->parser = yypstate_new();
+  if (s->parser == NULL || scan_init(s) != 0) {
+    perror("bluster");
+    exit(1);
+  }
+  s->status = SESSION_OPEN;
+}
+
+void session_free(struct session *s)
+{
+  scan_free(s);
+  yypstate_delete(s->parser);
+  arena_free(&s->command);
+  free(s->line);
+  s->line = NULL;
+}
+
+/* Append @n bytes to the unfinished line, leaving room for scan_lines' two NULs */
+static void append(struct session *s, const char *p, size_t n)
+{
+  if (s->len + n + 2 > s->cap) {
+    while (s->len + n + 2 > s->cap)
+      s->cap = s->cap ? s->cap * 2 : 4096;
+    s->line = realloc(s->line, s->cap);
+    if (s->line == NULL) {
+      perror("bluster");
+      exit(1);
+    }
+  }
+  memcpy(s->line + s->len, p, n);
+  s->len += n;
+}
+
+/* Scan what has been collected so far and take in what the parser made of it */
+static enum session_status run(struct session *s)
+{
+  s->line[s->len] = s->line[s->len + 1] = '\0';
+  int status = scan_lines(s, s->line, s->len);
+  s->len = 0;
 
-  return 1;
+  if (status == 0 && s->status == SESSION_OPEN)
+    s->status = SESSION_ENDED;
+  else if (status != 0 && status != YYPUSH_MORE)
+    s->status = SESSION_FAILED;
+  return s->status;
 }
 
-void yyerror(char *s)
+/*
+ * Everything up to the last line ending in @p is scanned in one go; only
+ * what follows it has to wait for the rest of its line.
+ */
+enum session_status session_feed(struct session *s, const char *p, size_t n)
 {
-  fprintf(stderr, "error: %s\n", s);
+  if (s->status != SESSION_OPEN)
+    return s->status;
+
+  size_t whole = n;
+  while (whole > 0 && p[whole - 1] != '\n' && p[whole - 1] != '\r')
+    whole--;
 
-  exit(1);
+  if (whole > 0) {
+    append(s, p, whole);
+    if (run(s) != SESSION_OPEN)
+      return s->status;
+  }
+  append(s, p + whole, n - whole);
+  return s->status;
 }
 
+enum session_status session_end(struct session *s)
+{
+  if (s->status != SESSION_OPEN)
+    return s->status;
+  if (s->len > 0 && run(s) != SESSION_OPEN)
+    return s->status;
+
+  if (s->tokens != NULL)
+    return s->status = SESSION_ENDED;
+  YYSTYPE lval = { 0 };
+  int status = yypush_parse(s->parser, 0, &lval, s);	/* end of input */
+  if (s->status == SESSION_OPEN)
+    s->status = (status == 0) ? SESSION_ENDED : SESSION_FAILED;
+  return s->status;
+}
+
+void yyerror(struct session *s, const char *msg)
+{
+  fprintf(s->err, "error: %s\n", msg);
+  if (!s->keep_going)
+    s->status = SESSION_FAILED;
+}
+
+/* A command stream and the engine it runs against */
+struct job {
+  const char *path;
+  struct engine engine;
+  struct session session;
+};
+
+static void *run_job(void *arg)
+{
+  struct job *job = arg;
+  struct session *s = &job->session;
+  int fd = 0;
+
+  if (job->path != NULL && (fd = open(job->path, O_RDONLY)) < 0) {
+    perror(job->path);
+    s->status = SESSION_FAILED;
+    return NULL;
+  }
+
+  char *buf = malloc(READ_SIZE);
+  ssize_t got;
+  while (s->status == SESSION_OPEN && (got = read(fd, buf, READ_SIZE)) > 0)
+    session_feed(s, buf, got);
+  session_end(s);
+  free(buf);
+
+  if (fd != 0)
+    close(fd);
+  return NULL;
+}
+
+static void print_log_stats(const struct msglog *log)
+{
+  const struct msglog_stats *st = &log->stats;
+  fprintf(stderr, "log: %lld records, %.1f MB, %lld syncs; %lld replayed and %lld torn on opening\n",
+          st->records, st->bytes / 1e6, st->syncs, st->replayed, st->truncated);
+}
+
+static void print_stats(struct job *jobs, int njobs, double secs)
+{
+  long long commands = 0, users = 0;
+  struct engine_stats st = { 0 };
+  for (int i = 0; i < njobs; i++) {
+    const struct engine_stats *js = &jobs[i].engine.stats;
+    commands += jobs[i].session.commands;
+    users += jobs[i].engine.nusers;
+    st.adds += js->adds;
+    st.sends += js->sends;
+    st.unknown += js->unknown;
+    st.blasts += js->blasts;
+    st.deliveries += js->deliveries;
+    st.dropped += js->dropped;
+    st.blast_ns += js->blast_ns;
+  }
+
+  fprintf(stderr, "commands: %lld in %.3f s (%.0f/s)\n", commands, secs, secs > 0 ? commands / secs : 0);
+  fprintf(stderr, "users: %lld, adds: %lld, sends: %lld (%lld to unknown users), blasts: %lld\n",
+          users, st.adds, st.sends, st.unknown, st.blasts);
+  fprintf(stderr, "deliveries: %lld, dropped: %lld, fan-out: %.3f s (%.1f ns per delivery)\n",
+          st.deliveries, st.dropped, st.blast_ns / 1e9,
+          st.deliveries ? (double)st.blast_ns / st.deliveries : 0);
+}
+
+/*
+ *   bluster [-q] [-s] [-k] [-F] [-t] [-w workers] [-d dir] [file...]
+ *   bluster -l socket [-s] [-d dir]
+ *
+ * Runs the commands in each file (or stdin).  Every file is its own session,
+ * with its own users, and they are all run at once on a thread each.  With
+ * -w, the sessions share one set of users instead, and their commands are
+ * queued and carried out on that many threads of the engine's own.  -q
+ * stops it printing each command, -s prints how many commands ran, how fast,
+ * and what the engines did with them to stderr at the end, for replaying big
+ * command files.  -k reports a bad command and goes on with the next line,
+ * as the server does, where it would otherwise stop there.  -F scans every
+ * line with flex, rather than only the ones the fast path in fastscan.c
+ * can't, and -t prints the tokens of each file instead of running it; the
+ * two are for checking one against the other.
+ * -d records the users and their messages in a log in dir (see msglog.c),
+ * and brings back the users already in it; more than one file then needs
+ * -w, to run them all against the one engine.
+ *
+ * Exits 0 if every session ended with EXIT.  With -l it serves sessions on
+ * a Unix domain socket instead (see server.c).
+ */
+int main(int argc, char **argv)
+{
+  int quiet = 0, stats = 0, keep_going = 0, workers = 0, flex_only = 0, tokens = 0;
+  const char *listen_path = NULL, *log_dir = NULL;
+  int opt;
+  while ((opt = getopt(argc, argv, "qskFtw:d:l:")) != -1) {
+    if (opt == 'q')
+      quiet = 1;
+    else if (opt == 'k')
+      keep_going = 1;
+    else if (opt == 'F')
+      flex_only = 1;
+    else if (opt == 't')
+      tokens = 1;
+    else if (opt == 's')
+      stats = 1;
+    else if (opt == 'w')
+      workers = atoi(optarg);
+    else if (opt == 'd')
+      log_dir = optarg;
+    else if (opt == 'l')
+      listen_path = optarg;
+    else {
+      fprintf(stderr, "usage: %s [-q] [-s] [-k] [-F] [-t] [-w workers] [-d dir] [file...] | -l socket [-s] [-d dir]\n",
+              argv[0]);
+      return 1;
+    }
+  }
+
+  struct msglog log;
+  msglog_init(&log);
+  if (log_dir != NULL && msglog_open(&log, log_dir) < 0)
+    return 1;
+  if (listen_path != NULL) {
+    int status = serve(listen_path, stats, log_dir != NULL ? &log : NULL);
+    if (stats && log_dir != NULL)
+      print_log_stats(&log);
+    msglog_close(&log);
+    return status;
+  }
+
+  int njobs = (optind < argc) ? argc - optind : 1;
+  if (log_dir != NULL && njobs > 1 && workers == 0) {
+    fprintf(stderr, "%s: -d with more than one file needs -w\n", argv[0]);
+    return 1;
+  }
+  struct job *jobs = calloc(njobs, sizeof *jobs);
+  pthread_t *ids = calloc(njobs, sizeof *ids);
+  for (int i = 0; i < njobs; i++) {
+    jobs[i].path = (optind < argc) ? argv[optind + i] : NULL;
+    engine_init(&jobs[i].engine);
+    session_init(&jobs[i].session, workers > 0 ? &jobs[0].engine : &jobs[i].engine, stdout);
+    jobs[i].session.quiet = quiet;
+    jobs[i].session.keep_going = keep_going;
+    jobs[i].session.flex_only = flex_only;
+    if (tokens)
+      jobs[i].session.tokens = stdout;
+  }
+  if (log_dir != NULL)
+    engine_log_to(&jobs[0].engine, &log);
+  if (workers > 0)
+    engine_start(&jobs[0].engine, workers);
+
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (int i = 1; i < njobs; i++)
+    pthread_create(&ids[i], NULL, run_job, &jobs[i]);
+  run_job(&jobs[0]);
+
+  int status = 0;
+  for (int i = 0; i < njobs; i++) {
+    if (i > 0)
+      pthread_join(ids[i], NULL);
+    if (jobs[i].session.status != SESSION_EXITED)
+      status = 1;
+  }
+  if (workers > 0)
+    engine_stop(&jobs[0].engine);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  fflush(stdout);
+  if (stats)
+    print_stats(jobs, njobs, (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
+  if (stats && log_dir != NULL)
+    print_log_stats(&log);
+
+  for (int i = 0; i < njobs; i++) {
+    session_free(&jobs[i].session);
+    engine_free(&jobs[i].engine);
+  }
+  msglog_close(&log);
+  free(jobs);
+  free(ids);
+  return status;
+}
@@ -0,0 +1,419 @@
+/*
+ * Delivery threads for the engine
+ *
+ * Sessions queue their commands on a bounded lock-free MPSC queue (a ring
+ * of cells with sequence numbers, after Vyukov), so a session never waits
+ * on delivery, only on a full queue.  One thread, the dispatcher, takes the
+ * commands off in the order they were queued, a batch at a time.  It does
+ * everything that changes the registry or the message pool itself: ADD,
+ * looking up who a SEND is for, storing each message once, and recording
+ * it in the engine's log if it has one.  That
+ * leaves a list of steps, each a message and who it goes to.
+ *
+ * A batch with a BLAST in it has its steps carried out in parallel.  The
+ * users are cut into shards of SHARD_SIZE, and one task does every step of
+ * the batch for the users of one shard, in order.  Each worker starts on a
+ * run of shards of its own and, when that is done, steals what is left of
+ * the others' runs.  No two threads touch the same inbox, and each inbox
+ * gets its messages in the order they were queued, so messages from one
+ * session arrive in the order it sent them.  The workers hold on to the
+ * messages they push out of full inboxes, and they are let go of once the
+ * round is over.
+ */
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "delivery.h"
+#include "engine.h"
+#include "msglog.h"
+
+#define QUEUE_SIZE 4096		/* commands, a power of two */
+#define BATCH_MAX 1024		/* commands taken off the queue at a time */
+#define SHARD_SIZE 4096		/* users to a task */
+#define DROPS_MAX 4096		/* runs of pushed out messages a worker keeps */
+
+struct command {
+  atomic_size_t seq;
+  enum command_type type;
+  int handle_len;
+  int text_len;
+  char handle[HANDLE_MAX];
+  char text[MESSAGE_MAX];
+};
+
+/* A command once it is off the queue: message id goes to user, or to the first users */
+struct step {
+  uint32_t id;
+  uint32_t user;
+  int blast;
+};
+
+struct worker {
+  struct delivery *d;
+  pthread_t thread;
+  /* this round's shards [next, end) that nobody has taken yet */
+  atomic_uint next;
+  unsigned end;
+  struct engine_stats stats;
+
+  /*
+   * Messages pushed out of full inboxes, let go of after the round rather
+   * than each on its own: a BLAST pushes the same old message out of most
+   * inboxes, and the workers would be fighting over its reference count.
+   * Runs of the same message are kept as one.
+   */
+  struct {
+    uint32_t id;
+    int n;
+  } drops[DROPS_MAX];
+  int ndrops;
+};
+
+struct delivery {
+  struct engine *e;
+
+  struct command *queue;
+  atomic_size_t enqueue_pos;
+  size_t dequeue_pos;
+
+  pthread_t dispatcher;
+  atomic_int stopping;		/* no more commands are coming */
+  atomic_int sleeping;		/* the dispatcher is waiting for commands */
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+
+  struct step steps[BATCH_MAX];
+  int nsteps;
+  uint32_t round_users;		/* users to go through this round */
+
+  /* workers[0] is the dispatcher */
+  struct worker *workers;
+  int nworkers;
+  unsigned round;
+  int busy;			/* workers not done with this round */
+  int finished;			/* the queue is drained: no more rounds */
+  pthread_cond_t round_start;
+  pthread_cond_t round_done;
+};
+
+void delivery_queue(struct delivery *d, enum command_type type, struct span handle, struct span text)
+{
+  size_t pos = atomic_load_explicit(&d->enqueue_pos, memory_order_relaxed);
+  struct command *c;
+  for (;;) {
+    c = &d->queue[pos & (QUEUE_SIZE - 1)];
+    size_t seq = atomic_load_explicit(&c->seq, memory_order_acquire);
+    if (seq == pos) {
+      if (atomic_compare_exchange_weak_explicit(&d->enqueue_pos, &pos, pos + 1,
+                                                memory_order_relaxed, memory_order_relaxed))
+        break;
+    } else if (seq < pos) {
+      sched_yield();		/* full: wait for the dispatcher to catch up */
+      pos = atomic_load_explicit(&d->enqueue_pos, memory_order_relaxed);
+    } else {
+      pos = atomic_load_explicit(&d->enqueue_pos, memory_order_relaxed);
+    }
+  }
+
+  c->type = type;
+  c->handle_len = handle.len < HANDLE_MAX ? handle.len : HANDLE_MAX;
+  if (c->handle_len > 0)
+    memcpy(c->handle, handle.ptr, c->handle_len);
+  c->text_len = text.len;
+  if (text.len > 0)
+    memcpy(c->text, text.ptr, text.len);
+  atomic_store_explicit(&c->seq, pos + 1, memory_order_release);
+
+  if (atomic_load_explicit(&d->sleeping, memory_order_acquire)) {
+    pthread_mutex_lock(&d->lock);
+    pthread_cond_signal(&d->wake);
+    pthread_mutex_unlock(&d->lock);
+  }
+}
+
+/* The next command, or NULL if the queue is empty.  Hand it back with done_command. */
+static struct command *next_command(struct delivery *d)
+{
+  struct command *c = &d->queue[d->dequeue_pos & (QUEUE_SIZE - 1)];
+  if (atomic_load_explicit(&c->seq, memory_order_acquire) != d->dequeue_pos + 1)
+    return NULL;
+  return c;
+}
+
+static void done_command(struct delivery *d, struct command *c)
+{
+  atomic_store_explicit(&c->seq, d->dequeue_pos + QUEUE_SIZE, memory_order_release);
+  d->dequeue_pos++;
+}
+
+/* Turn a command into steps, doing on the spot whatever isn't a delivery */
+static int take(struct delivery *d, struct command *c)
+{
+  struct engine *e = d->e;
+  struct span handle = { c->handle, c->handle_len }, text = { c->text, c->text_len };
+
+  switch (c->type) {
+  case COMMAND_ADD:
+    engine_add_now(e, handle);
+    return 0;
+  case COMMAND_SEND: {
+    e->stats.sends++;
+    struct user *u = engine_find(e, handle);
+    if (u == NULL) {
+      e->stats.unknown++;
+      return 0;
+    }
+    if (e->log != NULL)
+      msglog_append(e->log, RECORD_SEND, handle, text);
+    d->steps[d->nsteps++] = (struct step){ engine_store(e, text, 1), u - e->users, 0 };
+    return 0;
+  }
+  case COMMAND_BLAST:
+    e->stats.blasts++;
+    if (e->log != NULL)
+      msglog_append(e->log, RECORD_BLAST, handle, text);
+    if (e->nusers == 0)
+      return 0;
+    d->steps[d->nsteps++] = (struct step){ engine_store(e, text, e->nusers), e->nusers, 1 };
+    return 1;
+  }
+  return 0;
+}
+
+static void deliver(struct delivery *d, struct worker *w, uint32_t user, uint32_t id)
+{
+  uint32_t dropped = engine_deliver(d->e, user, id, &w->stats);
+  if (dropped == NO_MESSAGE)
+    return;
+  if (w->ndrops > 0 && w->drops[w->ndrops - 1].id == dropped) {
+    w->drops[w->ndrops - 1].n++;
+    return;
+  }
+  if (w->ndrops == DROPS_MAX) {
+    /* out of room: let go of them now, other workers or not */
+    for (int i = 0; i < w->ndrops; i++)
+      engine_release_shared(d->e, w->drops[i].id, w->drops[i].n);
+    w->ndrops = 0;
+  }
+  w->drops[w->ndrops].id = dropped;
+  w->drops[w->ndrops].n = 1;
+  w->ndrops++;
+}
+
+/* Once nobody is delivering: let go of what the workers pushed out, and count what they did */
+static void settle(struct delivery *d)
+{
+  struct engine *e = d->e;
+  for (int i = 0; i < d->nworkers; i++) {
+    struct worker *w = &d->workers[i];
+    for (int k = 0; k < w->ndrops; k++)
+      engine_release(e, w->drops[k].id, w->drops[k].n);
+    w->ndrops = 0;
+    e->stats.deliveries += w->stats.deliveries;
+    e->stats.dropped += w->stats.dropped;
+    memset(&w->stats, 0, sizeof w->stats);
+  }
+}
+
+/* Every step of the batch for the users in @shard */
+static void run_shard(struct delivery *d, unsigned shard, struct worker *w)
+{
+  struct engine_stats *st = &w->stats;
+  uint32_t lo = shard * SHARD_SIZE;
+  uint32_t hi = lo + SHARD_SIZE < d->round_users ? lo + SHARD_SIZE : d->round_users;
+
+  for (int s = 0; s < d->nsteps; s++) {
+    const struct step *step = &d->steps[s];
+    if (step->blast) {
+      uint32_t end = step->user < hi ? step->user : hi;
+      for (uint32_t i = lo; i < end; i++)
+        deliver(d, w, i, step->id);
+      if (end > lo)
+        st->deliveries += end - lo;
+    } else if (step->user >= lo && step->user < hi) {
+      deliver(d, w, step->user, step->id);
+      st->deliveries++;
+    }
+  }
+}
+
+/* Do this round's shards, our own first and then anyone else's */
+static void run_round(struct worker *w)
+{
+  struct delivery *d = w->d;
+  int self = w - d->workers;
+  for (int k = 0; k < d->nworkers; k++) {
+    struct worker *v = &d->workers[(self + k) % d->nworkers];
+    unsigned shard;
+    while ((shard = atomic_fetch_add_explicit(&v->next, 1, memory_order_relaxed)) < v->end)
+      run_shard(d, shard, w);
+  }
+}
+
+static void *worker_main(void *arg)
+{
+  struct worker *w = arg;
+  struct delivery *d = w->d;
+  unsigned seen = 0;
+
+  for (;;) {
+    pthread_mutex_lock(&d->lock);
+    while (d->round == seen && !d->finished)
+      pthread_cond_wait(&d->round_start, &d->lock);
+    if (d->round == seen) {
+      pthread_mutex_unlock(&d->lock);
+      return NULL;
+    }
+    seen = d->round;
+    pthread_mutex_unlock(&d->lock);
+
+    run_round(w);
+
+    pthread_mutex_lock(&d->lock);
+    if (--d->busy == 0)
+      pthread_cond_signal(&d->round_done);
+    pthread_mutex_unlock(&d->lock);
+  }
+}
+
+/* Carry out the batch's steps on every worker (if there is enough to go round), and wait for them all */
+static void run_parallel(struct delivery *d)
+{
+  struct engine *e = d->e;
+  d->round_users = e->nusers;
+  unsigned shards = (d->round_users + SHARD_SIZE - 1) / SHARD_SIZE;
+  if (shards <= 1 || d->nworkers == 1) {
+    for (unsigned shard = 0; shard < shards; shard++)
+      run_shard(d, shard, &d->workers[0]);
+    settle(d);
+    return;
+  }
+
+  for (int i = 0; i < d->nworkers; i++) {
+    struct worker *w = &d->workers[i];
+    atomic_store_explicit(&w->next, shards * i / d->nworkers, memory_order_relaxed);
+    w->end = shards * (i + 1) / d->nworkers;
+  }
+
+  pthread_mutex_lock(&d->lock);
+  d->round++;
+  d->busy = d->nworkers - 1;
+  pthread_cond_broadcast(&d->round_start);
+  pthread_mutex_unlock(&d->lock);
+
+  run_round(&d->workers[0]);
+
+  pthread_mutex_lock(&d->lock);
+  while (d->busy > 0)
+    pthread_cond_wait(&d->round_done, &d->lock);
+  pthread_mutex_unlock(&d->lock);
+
+  settle(d);
+}
+
+static void *dispatcher_main(void *arg)
+{
+  struct delivery *d = arg;
+  struct engine *e = d->e;
+
+  for (;;) {
+    /* read before draining: a command queued after the drain came back
+     * empty but before stopping was set is still taken next time round */
+    int stopping = atomic_load(&d->stopping);
+    int taken = 0, blasts = 0;
+    struct command *c;
+    while (taken < BATCH_MAX && (c = next_command(d)) != NULL) {
+      blasts += take(d, c);
+      done_command(d, c);
+      taken++;
+    }
+
+    if (taken == 0) {
+      if (stopping)
+        break;
+      /* nothing to do: sleep until a session queues something (or a
+       * millisecond has gone by, in case it did so just as we looked) */
+      atomic_store(&d->sleeping, 1);
+      if (next_command(d) == NULL) {
+        struct timespec until;
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_nsec += 1000000;
+        if (until.tv_nsec >= 1000000000) {
+          until.tv_sec++;
+          until.tv_nsec -= 1000000000;
+        }
+        pthread_mutex_lock(&d->lock);
+        pthread_cond_timedwait(&d->wake, &d->lock, &until);
+        pthread_mutex_unlock(&d->lock);
+      }
+      atomic_store(&d->sleeping, 0);
+      continue;
+    }
+
+    if (blasts > 0) {
+      struct timespec start, end;
+      clock_gettime(CLOCK_MONOTONIC, &start);
+      run_parallel(d);
+      clock_gettime(CLOCK_MONOTONIC, &end);
+      e->stats.blast_ns += (end.tv_sec - start.tv_sec) * 1000000000LL + (end.tv_nsec - start.tv_nsec);
+    } else {
+      /* only SENDs: not worth waking anyone for */
+      for (int s = 0; s < d->nsteps; s++)
+        deliver(d, &d->workers[0], d->steps[s].user, d->steps[s].id);
+      d->workers[0].stats.deliveries += d->nsteps;
+      settle(d);
+    }
+    d->nsteps = 0;
+  }
+
+  pthread_mutex_lock(&d->lock);
+  d->finished = 1;
+  pthread_cond_broadcast(&d->round_start);
+  pthread_mutex_unlock(&d->lock);
+  for (int i = 1; i < d->nworkers; i++)
+    pthread_join(d->workers[i].thread, NULL);
+  return NULL;
+}
+
+struct delivery *delivery_new(struct engine *e, int workers)
+{
+  struct delivery *d = calloc(1, sizeof *d);
+  d->e = e;
+  d->queue = calloc(QUEUE_SIZE, sizeof *d->queue);
+  for (size_t i = 0; i < QUEUE_SIZE; i++)
+    atomic_init(&d->queue[i].seq, i);
+  pthread_mutex_init(&d->lock, NULL);
+  pthread_cond_init(&d->wake, NULL);
+  pthread_cond_init(&d->round_start, NULL);
+  pthread_cond_init(&d->round_done, NULL);
+
+  d->nworkers = workers > 0 ? workers : 1;
+  d->workers = calloc(d->nworkers, sizeof *d->workers);
+  for (int i = 0; i < d->nworkers; i++) {
+    d->workers[i].d = d;
+    if (i > 0)
+      pthread_create(&d->workers[i].thread, NULL, worker_main, &d->workers[i]);
+  }
+  pthread_create(&d->dispatcher, NULL, dispatcher_main, d);
+  return d;
+}
+
+void delivery_free(struct delivery *d)
+{
+  atomic_store(&d->stopping, 1);
+  pthread_mutex_lock(&d->lock);
+  pthread_cond_signal(&d->wake);
+  pthread_mutex_unlock(&d->lock);
+  pthread_join(d->dispatcher, NULL);
+
+  pthread_mutex_destroy(&d->lock);
+  pthread_cond_destroy(&d->wake);
+  pthread_cond_destroy(&d->round_start);
+  pthread_cond_destroy(&d->round_done);
+  free(d->workers);
+  free(d->queue);
+  free(d);
+}
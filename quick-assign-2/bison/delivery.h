@@ -0,0 +1,25 @@
+/*
+ * Queued commands, carried out on threads of the engine's own
+ */
+#ifndef DELIVERY_H
+#define DELIVERY_H
+
+#include "bluster.h"
+
+struct engine;
+struct delivery;
+
+enum command_type {
+  COMMAND_ADD,
+  COMMAND_SEND,
+  COMMAND_BLAST,
+};
+
+struct delivery *delivery_new(struct engine *e, int workers);
+/* Carry out everything still queued, then stop the threads and free @d */
+void delivery_free(struct delivery *d);
+
+/* Queue a command; @handle and @text are copied */
+void delivery_queue(struct delivery *d, enum command_type type, struct span handle, struct span text);
+
+#endif
@@ -0,0 +1,284 @@
+/*
+ * User registry, inboxes and message fan-out for bluster
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "delivery.h"
+#include "engine.h"
+#include "msglog.h"
+
+static void *grow(void *p, size_t n, size_t size)
+{
+  p = realloc(p, n * size);
+  if (p == NULL) {
+    perror("bluster");
+    exit(1);
+  }
+  return p;
+}
+
+/* FNV-1a */
+static uint32_t hash(struct span s)
+{
+  uint32_t h = 2166136261u;
+  for (int i = 0; i < s.len; i++)
+    h = (h ^ (unsigned char)s.ptr[i]) * 16777619u;
+  return h;
+}
+
+void engine_init(struct engine *e)
+{
+  memset(e, 0, sizeof *e);
+  e->free_list = NO_MESSAGE;
+}
+
+void engine_free(struct engine *e)
+{
+  if (e->delivery != NULL)
+    engine_stop(e);
+  free(e->users);
+  free(e->slots);
+  free(e->table);
+  free(e->pool);
+  engine_init(e);
+}
+
+void engine_start(struct engine *e, int workers)
+{
+  e->delivery = delivery_new(e, workers);
+}
+
+void engine_stop(struct engine *e)
+{
+  delivery_free(e->delivery);
+  e->delivery = NULL;
+}
+
+void engine_log_to(struct engine *e, struct msglog *log)
+{
+  long long adds = e->stats.adds;
+  for (uint32_t i = 0; i < log->nusers; i++)
+    engine_add_now(e, (struct span){ log->users[i].handle, log->users[i].len });
+  e->stats.adds = adds;
+  e->log = log;
+}
+
+/* The table slot for @handle: the one holding it, or the empty one it would go in */
+static uint32_t *lookup(struct engine *e, struct span handle)
+{
+  uint32_t mask = e->table_size - 1;
+  for (uint32_t i = hash(handle) & mask;; i = (i + 1) & mask) {
+    uint32_t *t = &e->table[i];
+    if (*t == 0)
+      return t;
+    struct user *u = &e->users[*t - 1];
+    if (u->len == handle.len && memcmp(u->handle, handle.ptr, handle.len) == 0)
+      return t;
+  }
+}
+
+/* Double the table, keeping it at most half full */
+static void rehash(struct engine *e)
+{
+  free(e->table);
+  e->table_size = e->table_size ? e->table_size * 2 : 64;
+  e->table = calloc(e->table_size, sizeof *e->table);
+  if (e->table == NULL) {
+    perror("bluster");
+    exit(1);
+  }
+  for (uint32_t i = 0; i < e->nusers; i++)
+    *lookup(e, (struct span){ e->users[i].handle, e->users[i].len }) = i + 1;
+}
+
+struct user *engine_find(struct engine *e, struct span handle)
+{
+  if (e->table_size == 0)
+    return NULL;
+  uint32_t t = *lookup(e, handle);
+  return t ? &e->users[t - 1] : NULL;
+}
+
+int engine_add_now(struct engine *e, struct span handle)
+{
+  if (handle.len > HANDLE_MAX)
+    handle.len = HANDLE_MAX;
+  if (2 * (e->nusers + 1) > e->table_size)
+    rehash(e);
+  uint32_t *t = lookup(e, handle);
+  if (*t != 0)
+    return 1;
+
+  if (e->nusers == e->cap_users) {
+    e->cap_users = e->cap_users ? e->cap_users * 2 : 64;
+    e->users = grow(e->users, e->cap_users, sizeof *e->users);
+    e->slots = grow(e->slots, (size_t)e->cap_users * INBOX_SIZE, sizeof *e->slots);
+  }
+  struct user *u = &e->users[e->nusers];
+  memcpy(u->handle, handle.ptr, handle.len);
+  u->len = handle.len;
+  u->head = u->count = 0;
+  u->watcher = NULL;
+  *t = ++e->nusers;
+  e->stats.adds++;
+  if (e->log != NULL)
+    msglog_append(e->log, RECORD_ADD, handle, (struct span){ NULL, 0 });
+  return 0;
+}
+
+/*
+ * Take a free entry of the pool, growing it if there isn't one.  Never
+ * called while another thread is delivering, so the pool can move and the
+ * free list can be popped without a compare-and-swap.
+ */
+uint32_t engine_store(struct engine *e, struct span text, int refs)
+{
+  uint32_t id = atomic_load_explicit(&e->free_list, memory_order_acquire);
+  if (id == NO_MESSAGE) {
+    uint32_t old = e->pool_size;
+    e->pool_size = old ? old * 2 : 256;
+    e->pool = grow(e->pool, e->pool_size, sizeof *e->pool);
+    for (uint32_t i = old; i < e->pool_size; i++)
+      e->pool[i].next = (i + 1 < e->pool_size) ? i + 1 : NO_MESSAGE;
+    id = old;
+  }
+  struct stored *s = &e->pool[id];
+  atomic_store_explicit(&e->free_list, s->next, memory_order_relaxed);
+  atomic_store_explicit(&s->refs, refs, memory_order_relaxed);
+  memcpy(s->text, text.ptr, text.len);
+  s->len = text.len;
+  return id;
+}
+
+/*
+ * Plain loads and stores: the atomics are only for engine_release_shared,
+ * and nothing else touches the pool while this runs.
+ */
+void engine_release(struct engine *e, uint32_t id, int n)
+{
+  struct stored *s = &e->pool[id];
+  int refs = atomic_load_explicit(&s->refs, memory_order_relaxed) - n;
+  atomic_store_explicit(&s->refs, refs, memory_order_relaxed);
+  if (refs == 0) {
+    s->next = atomic_load_explicit(&e->free_list, memory_order_relaxed);
+    atomic_store_explicit(&e->free_list, id, memory_order_relaxed);
+  }
+}
+
+void engine_release_shared(struct engine *e, uint32_t id, int n)
+{
+  struct stored *s = &e->pool[id];
+  if (atomic_fetch_sub_explicit(&s->refs, n, memory_order_acq_rel) == n) {
+    uint32_t head = atomic_load_explicit(&e->free_list, memory_order_relaxed);
+    do
+      s->next = head;
+    while (!atomic_compare_exchange_weak_explicit(&e->free_list, &head, id,
+                                                  memory_order_release, memory_order_relaxed));
+  }
+}
+
+uint32_t engine_deliver(struct engine *e, uint32_t i, uint32_t id, struct engine_stats *st)
+{
+  struct user *u = &e->users[i];
+  uint32_t *slots = &e->slots[(size_t)i * INBOX_SIZE];
+  uint32_t dropped = NO_MESSAGE;
+  if (u->count == INBOX_SIZE) {
+    dropped = slots[u->head];
+    u->head = (u->head + 1) & (INBOX_SIZE - 1);
+    u->count--;
+    st->dropped++;
+  }
+  slots[(u->head + u->count) & (INBOX_SIZE - 1)] = id;
+  u->count++;
+  if (u->watcher != NULL)
+    e->notify(e, u);
+  return dropped;
+}
+
+/* Deliver and let go of whatever was pushed out, for when nothing else is delivering */
+static void deliver(struct engine *e, uint32_t i, uint32_t id)
+{
+  uint32_t dropped = engine_deliver(e, i, id, &e->stats);
+  if (dropped != NO_MESSAGE)
+    engine_release(e, dropped, 1);
+}
+
+int engine_add(struct engine *e, struct span handle)
+{
+  if (e->delivery != NULL) {
+    delivery_queue(e->delivery, COMMAND_ADD, handle, (struct span){ NULL, 0 });
+    return 0;
+  }
+  return engine_add_now(e, handle);
+}
+
+int engine_send(struct engine *e, struct span handle, const struct message *m)
+{
+  char text[MESSAGE_MAX];
+  struct span joined = { text, message_join(m, text) };
+  if (e->delivery != NULL) {
+    delivery_queue(e->delivery, COMMAND_SEND, handle, joined);
+    return 0;
+  }
+
+  e->stats.sends++;
+  struct user *u = engine_find(e, handle);
+  if (u == NULL) {
+    e->stats.unknown++;
+    return -1;
+  }
+  if (e->log != NULL)
+    msglog_append(e->log, RECORD_SEND, handle, joined);
+  deliver(e, u - e->users, engine_store(e, joined, 1));
+  e->stats.deliveries++;
+  return 0;
+}
+
+/*
+ * The message is stored once and takes all of its references up front, so
+ * the fan-out itself only writes an index into each inbox.
+ */
+void engine_blast(struct engine *e, const struct message *m)
+{
+  char text[MESSAGE_MAX];
+  struct span joined = { text, message_join(m, text) };
+  if (e->delivery != NULL) {
+    delivery_queue(e->delivery, COMMAND_BLAST, (struct span){ NULL, 0 }, joined);
+    return;
+  }
+
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  e->stats.blasts++;
+  if (e->log != NULL)
+    msglog_append(e->log, RECORD_BLAST, (struct span){ NULL, 0 }, joined);
+  if (e->nusers > 0) {
+    uint32_t id = engine_store(e, joined, e->nusers);
+    for (uint32_t i = 0; i < e->nusers; i++)
+      deliver(e, i, id);
+    e->stats.deliveries += e->nusers;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  e->stats.blast_ns += (end.tv_sec - start.tv_sec) * 1000000000LL + (end.tv_nsec - start.tv_nsec);
+}
+
+struct span engine_inbox(const struct engine *e, const struct user *u, unsigned i)
+{
+  uint32_t index = u - e->users;
+  uint32_t id = e->slots[(size_t)index * INBOX_SIZE + ((u->head + i) & (INBOX_SIZE - 1))];
+  return (struct span){ e->pool[id].text, e->pool[id].len };
+}
+
+void engine_pop(struct engine *e, struct user *u, unsigned n)
+{
+  uint32_t *slots = &e->slots[(size_t)(u - e->users) * INBOX_SIZE];
+  for (; n > 0 && u->count > 0; n--) {
+    engine_release(e, slots[u->head], 1);
+    u->head = (u->head + 1) & (INBOX_SIZE - 1);
+    u->count--;
+  }
+}
@@ -0,0 +1,122 @@
+/*
+ * The state behind bluster's commands: who has been added, and what is
+ * waiting in their inboxes
+ */
+#ifndef ENGINE_H
+#define ENGINE_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+#include "bluster.h"
+
+#define INBOX_SIZE 64		/* messages kept per user, a power of two */
+#define HANDLE_MAX 16		/* '@' and up to 15 more, as the scanner allows */
+#define NO_MESSAGE UINT32_MAX
+
+/*
+ * A message is stored once however many inboxes it is in, and freed when
+ * the last of them lets go of it.  Free entries are chained through next.
+ */
+struct stored {
+  atomic_int refs;
+  uint32_t next;
+  int len;
+  char text[MESSAGE_MAX];
+};
+
+/* An inbox is the user's INBOX_SIZE slots of engine.slots, oldest at head */
+struct user {
+  char handle[HANDLE_MAX];
+  int len;
+  unsigned head;
+  unsigned count;
+  void *watcher;		/* passed to engine.notify when a message arrives */
+};
+
+struct engine_stats {
+  long long adds;
+  long long sends;
+  long long blasts;
+  long long deliveries;		/* messages put in an inbox */
+  long long dropped;		/* oldest messages pushed out of a full inbox */
+  long long unknown;		/* sends to a user that was never added */
+  long long blast_ns;		/* time spent fanning out blasts */
+};
+
+struct delivery;
+struct msglog;
+
+struct engine {
+  /* users in the order they were added, and their inboxes */
+  struct user *users;
+  uint32_t *slots;
+  uint32_t nusers;
+  uint32_t cap_users;
+
+  /* open addressing over handles, linear probing: 0 is empty, else index + 1 */
+  uint32_t *table;
+  uint32_t table_size;
+
+  struct stored *pool;
+  uint32_t pool_size;
+  _Atomic uint32_t free_list;
+
+  /* called for each delivery to a user with a watcher */
+  void (*notify)(struct engine *e, struct user *u);
+
+  /* the command queue and delivery threads, once engine_start has been called */
+  struct delivery *delivery;
+
+  /* if set, every new user and every message delivered is recorded here (see msglog.c) */
+  struct msglog *log;
+
+  struct engine_stats stats;
+};
+
+void engine_init(struct engine *e);
+void engine_free(struct engine *e);
+
+/*
+ * From now on commands are queued, from any number of threads, and carried
+ * out on @workers threads of the engine's own (see delivery.c).  What
+ * engine_add and engine_send will find isn't known when they return, so
+ * they return 0.  Not for an engine with a notify hook.
+ */
+void engine_start(struct engine *e, int workers);
+/* Carry out everything still queued and stop the threads */
+void engine_stop(struct engine *e);
+
+/* Record what happens from now on in @log, taking in the users it already has */
+void engine_log_to(struct engine *e, struct msglog *log);
+
+/* The user with @handle, or NULL.  Not while there is a queue. */
+struct user *engine_find(struct engine *e, struct span handle);
+
+/* 0 if @handle is new, 1 if it was already added */
+int engine_add(struct engine *e, struct span handle);
+/* 0, or -1 if there is no such user */
+int engine_send(struct engine *e, struct span handle, const struct message *m);
+void engine_blast(struct engine *e, const struct message *m);
+
+/* The i'th oldest message waiting for @u (i < u->count) */
+struct span engine_inbox(const struct engine *e, const struct user *u, unsigned i);
+/* Let go of the @n oldest messages waiting for @u */
+void engine_pop(struct engine *e, struct user *u, unsigned n);
+
+/* What the commands come down to, for delivery.c */
+int engine_add_now(struct engine *e, struct span handle);
+/* Copy @text into the pool with @refs references to it, returning its index */
+uint32_t engine_store(struct engine *e, struct span text, int refs);
+/* Let go of @n references to message @id */
+void engine_release(struct engine *e, uint32_t id, int n);
+/* The same, while other threads may be doing it too */
+void engine_release_shared(struct engine *e, uint32_t id, int n);
+/*
+ * Put message @id at the end of user @i's inbox, counting it in @st.  If
+ * the inbox was full, returns the message pushed out to make room, which
+ * the caller has to release; otherwise NO_MESSAGE.
+ */
+uint32_t engine_deliver(struct engine *e, uint32_t i, uint32_t id, struct engine_stats *st);
+
+#endif
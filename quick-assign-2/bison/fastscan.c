@@ -0,0 +1,216 @@
+/*
+ * A fast path for the bluster scanner: the tokens of an ordinary line,
+ * found with SSE2 bitmasks instead of flex's DFA
+ *
+ * Each 16 bytes of the line are classified at once into word characters,
+ * the characters a user may have, spaces, line ends and '@', one bit per
+ * byte, and the tokens are read off the masks a run at a time.  They are
+ * the tokens the rules in bluster.lex make:
+ *
+ *   - a run of word characters is a WORD, unless the whole run is one of
+ *     the keywords in any case (flex takes the longest match, and the
+ *     keyword rules win a tie by coming first)
+ *   - '@' and up to 15 user characters after it is a USER
+ *   - a run of spaces and tabs is one SPACE, and \n and \r are each an EOL
+ *
+ * A line with anything else in it (a byte only '.' matches, or an '@' with
+ * no user after it) is left to flex, which knows what to print for it.  So
+ * is a line longer than FAST_LINE_MAX bytes or of more than TOKENS_MAX
+ * tokens.
+ */
+#include <stdint.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
+
+#include "bluster.tab.h"
+
+#define FAST_LINE_MAX 1024
+#define MASK_WORDS (FAST_LINE_MAX / 64 + 1)
+
+/* Bit i of each is set if byte i of the line is of that class */
+struct masks {
+  uint64_t word[MASK_WORDS];	/* [a-zA-Z0-9_.,!] */
+  uint64_t user[MASK_WORDS];	/* [a-zA-Z0-9_] */
+  uint64_t space[MASK_WORDS];	/* [ \t] */
+  uint64_t eol[MASK_WORDS];	/* [\n\r] */
+  uint64_t other[MASK_WORDS];	/* none of those, nor '@' */
+};
+
+/* Set the 16 bits of @m for the bytes from @i, a multiple of 16, on */
+static inline void put(uint64_t *m, unsigned i, unsigned bits)
+{
+  if (i % 64 == 0)
+    m[i / 64] = bits;
+  else
+    m[i / 64] |= (uint64_t)bits << (i % 64);
+}
+
+#ifdef __SSE2__
+/*
+ * Bytes >= 0x80 are negative to the signed compares, so they never land in
+ * a range and end up in other.
+ */
+static void classify(const char *p, unsigned i, struct masks *m)
+{
+  const __m128i alpha_lo = _mm_set1_epi8('a' - 1), alpha_hi = _mm_set1_epi8('z' + 1);
+  const __m128i digit_lo = _mm_set1_epi8('0' - 1), digit_hi = _mm_set1_epi8('9' + 1);
+  const __m128i lower = _mm_set1_epi8(0x20);
+
+  __m128i v = _mm_loadu_si128((const __m128i *)p);
+  __m128i l = _mm_or_si128(v, lower);
+  __m128i alpha = _mm_and_si128(_mm_cmpgt_epi8(l, alpha_lo), _mm_cmplt_epi8(l, alpha_hi));
+  __m128i digit = _mm_and_si128(_mm_cmpgt_epi8(v, digit_lo), _mm_cmplt_epi8(v, digit_hi));
+  __m128i user = _mm_or_si128(_mm_or_si128(alpha, digit), _mm_cmpeq_epi8(v, _mm_set1_epi8('_')));
+  __m128i word = _mm_or_si128(_mm_or_si128(user, _mm_cmpeq_epi8(v, _mm_set1_epi8('.'))),
+                              _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(',')),
+                                           _mm_cmpeq_epi8(v, _mm_set1_epi8('!'))));
+  __m128i space = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')), _mm_cmpeq_epi8(v, _mm_set1_epi8('\t')));
+  __m128i eol = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\n')), _mm_cmpeq_epi8(v, _mm_set1_epi8('\r')));
+  __m128i known = _mm_or_si128(_mm_or_si128(word, space), _mm_or_si128(eol, _mm_cmpeq_epi8(v, _mm_set1_epi8('@'))));
+
+  put(m->word, i, _mm_movemask_epi8(word));
+  put(m->user, i, _mm_movemask_epi8(user));
+  put(m->space, i, _mm_movemask_epi8(space));
+  put(m->eol, i, _mm_movemask_epi8(eol));
+  put(m->other, i, ~_mm_movemask_epi8(known) & 0xffff);
+}
+#else
+static void classify(const char *p, unsigned i, struct masks *m)
+{
+  unsigned word = 0, user = 0, space = 0, eol = 0, other = 0;
+  for (int k = 0; k < 16; k++) {
+    unsigned char c = p[k], l = c | 0x20;
+    int u = (l >= 'a' && l <= 'z') || (c >= '0' && c <= '9') || c == '_';
+    int w = u || c == '.' || c == ',' || c == '!';
+    int s = c == ' ' || c == '\t';
+    int e = c == '\n' || c == '\r';
+    word |= w << k;
+    user |= u << k;
+    space |= s << k;
+    eol |= e << k;
+    other |= !(w || s || e || c == '@') << k;
+  }
+  put(m->word, i, word);
+  put(m->user, i, user);
+  put(m->space, i, space);
+  put(m->eol, i, eol);
+  put(m->other, i, other);
+}
+#endif
+
+static inline int bit(const uint64_t *m, unsigned i)
+{
+  return (m[i / 64] >> (i % 64)) & 1;
+}
+
+/* The first byte from @i on that isn't in @m, or @n if they all are */
+static unsigned run_end(const uint64_t *m, unsigned i, unsigned n)
+{
+  while (i < n) {
+    uint64_t rest = ~m[i / 64] >> (i % 64);
+    if (rest != 0)
+      return (i + __builtin_ctzll(rest) < n) ? i + __builtin_ctzll(rest) : n;
+    i = (i / 64 + 1) * 64;
+  }
+  return n;
+}
+
+/*
+ * Four bytes folded to lower case: among word characters only letters are
+ * changed by it, and the bytes that can follow a word never fold into one
+ */
+static inline uint32_t fold4(const char *p)
+{
+  uint32_t w;
+  memcpy(&w, p, 4);
+  return w | 0x20202020u;
+}
+
+/*
+ * What flex makes of a run of word characters: a keyword, if it is all of
+ * one.  Word lengths are all over the place, so rather than branch on them
+ * every keyword is compared and the answer picked without a jump.  A run of
+ * three or more is followed by at least its EOL or the two NULs after the
+ * buffer, so five bytes can be read from it; a shorter one is swapped for
+ * NULs.
+ */
+static int keyword(const char *p, unsigned len)
+{
+  p = (len >= 3) ? p : "\0\0\0\0";
+  uint32_t w = fold4(p), three;
+  memcpy(&three, "\xff\xff\xff", 4);	/* the first three bytes, whichever end they are */
+
+  int t = WORD;
+  t = ((len == 3) & ((w & three) == (fold4("add") & three))) ? ADD : t;
+  t = ((len == 4) & (w == fold4("exit"))) ? EXIT : t;
+  t = ((len == 4) & (w == fold4("send"))) ? SEND : t;
+  t = ((len == 5) & (w == fold4("blas")) & ((p[4] | 0x20) == 't')) ? BLAST : t;
+  return t;
+}
+
+int fast_scan(const char *p, const char *end, struct token *out, const char **next)
+{
+  struct masks m;
+  size_t avail = end - p;
+  unsigned n, i;
+
+  /* classify up to the line's end */
+  for (i = 0;; i += 16) {
+    if (i >= FAST_LINE_MAX) {
+      const char *e = p + i;
+      while (e < end && *e != '\n' && *e != '\r')
+        e++;
+      *next = (e < end) ? e + 1 : end;
+      return -1;
+    }
+    if (avail - i >= 16) {
+      classify(p + i, i, &m);
+    } else {
+      char tail[16] = { 0 };
+      memcpy(tail, p + i, avail - i);
+      classify(tail, i, &m);
+    }
+    unsigned eol = (m.eol[i / 64] >> (i % 64)) & 0xffff;
+    if (eol != 0) {
+      n = i + __builtin_ctz(eol);
+      break;
+    }
+    if (i + 16 >= avail) {
+      n = avail;
+      break;
+    }
+  }
+  *next = p + (n < avail ? n + 1 : n);
+
+  for (unsigned w = 0; w < n / 64; w++)
+    if (m.other[w] != 0)
+      return -1;
+  if (n % 64 != 0 && (m.other[n / 64] & ((1ULL << (n % 64)) - 1)) != 0)
+    return -1;
+
+  int k = 0;
+  for (unsigned at = 0, j; at < n; at = j) {
+    if (k == TOKENS_MAX - 1)
+      return -1;		/* no room left for the EOL */
+    if (bit(m.space, at)) {
+      j = run_end(m.space, at, n);
+      out[k++] = (struct token){ SPACE, { p + at, j - at } };
+    } else if (bit(m.word, at)) {
+      j = run_end(m.word, at, n);
+      out[k++] = (struct token){ keyword(p + at, j - at), { p + at, j - at } };
+    } else {
+      /* an '@', the only other byte left */
+      j = run_end(m.user, at + 1, n);
+      if (j == at + 1)
+        return -1;
+      if (j > at + 16)
+        j = at + 16;		/* as many as {user} takes */
+      out[k++] = (struct token){ USER, { p + at, j - at } };
+    }
+  }
+  if (n < avail)
+    out[k++] = (struct token){ EOL, { p + n, 1 } };
+  return k;
+}
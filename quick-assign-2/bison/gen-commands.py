@@ -0,0 +1,114 @@
+#!/usr/bin/env python3
+"""Write a bluster command file for replaying with `bluster -q -s`.
+
+Adds --users users, then runs --commands commands among them and ends with
+EXIT.  The mix of commands:
+
+  --blast     the fraction that are BLASTs; the rest are SENDs
+  --add       the fraction that ADD a new user, who can be sent to from then on
+  --unknown   the fraction of SENDs to a user nobody added
+
+Messages are --words words long, LO-HI, picked evenly or (--word-dist
+geometric) mostly short with a long tail.  --too-long (a fraction) of them
+are made longer than MESSAGE_MAX, and --malformed (a fraction) of the
+commands are replaced by lines that don't parse; run those with
+`bluster -k`, which goes on past them.
+
+--noise (a fraction) of the commands are mangled, into lines the scanner
+has to work at: keywords in odd cases or run into other words, users too
+long, stray bytes, \r line ends, very long lines.  That is for checking
+the fast-path scanner against flex with `bluster -t`.
+"""
+import argparse
+import random
+import sys
+
+MESSAGE_MAX = 81  # as in bluster.h
+WORDS = "hi there are you at home later the meeting moved to noon bring snacks ok thanks".split()
+ODD = ["@", "@@", "?", "'", "\"", "-", "#", "\t", " \t ", "\r", "\r\n", "\x00", "\xe9", "\u2603",
+       "!", ".", ",", "_", "@_", "@!", "exit", "ExIt", "add", "aDd", "send", "SEND", "blast", "bLaSt",
+       "sendx", "blasts", "adds", "exit!", "add@x", "@" + "a" * 20, "@" + "b" * 15, "9" * 40]
+
+
+def mangle(rng, line):
+    """@line with a few of ODD in it, with its case changed, or made very long"""
+    how = rng.random()
+    if how < 0.1:
+        return "".join(c.upper() if rng.random() < 0.5 else c.lower() for c in line)
+    if how < 0.15:
+        return line + " word" * rng.choice([300, 2000])
+    pieces = list(line)
+    for _ in range(rng.randint(1, 4)):
+        pieces.insert(rng.randint(0, len(pieces)), rng.choice(ODD))
+    return "".join(pieces)
+
+
+MALFORMED = ["send hi there", "send @%s", "add", "add @%s @%s", "blast", "hello @%s", "exit now",
+             "send @%s@%s hi", "add hi", "@%s"]
+
+
+def malformed(rng, users):
+    line = rng.choice(MALFORMED)
+    return line % tuple(rng.choice(users)[1:] for _ in range(line.count("%s")))
+
+
+def message_words(rng, args, lo, hi):
+    if args.word_dist == "geometric":
+        n = lo
+        while n < hi and rng.random() > 1.0 / (1 + (hi - lo) / 4.0):
+            n += 1
+        return n
+    return rng.randint(lo, hi)
+
+
+def message(rng, args, lo, hi):
+    text = " ".join(rng.choice(WORDS) for _ in range(message_words(rng, args, lo, hi)))
+    if args.too_long and rng.random() < args.too_long:
+        while len(text) <= MESSAGE_MAX:
+            text += " " + rng.choice(WORDS)
+    return text
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__)
+    ap.add_argument("--users", type=int, default=1000)
+    ap.add_argument("--commands", type=int, default=100000)
+    ap.add_argument("--blast", type=float, default=0.1)
+    ap.add_argument("--add", type=float, default=0)
+    ap.add_argument("--unknown", type=float, default=0)
+    ap.add_argument("--words", default="1-10", help="LO-HI words to a message")
+    ap.add_argument("--word-dist", choices=["uniform", "geometric"], default="uniform")
+    ap.add_argument("--too-long", type=float, default=0)
+    ap.add_argument("--malformed", type=float, default=0)
+    ap.add_argument("--noise", type=float, default=0)
+    ap.add_argument("--seed", type=int, default=1)
+    args = ap.parse_args()
+
+    lo, _, hi = args.words.partition("-")
+    lo, hi = int(lo), int(hi or lo)
+    rng = random.Random(args.seed)
+    users = ["@u%d" % i for i in range(args.users)]
+    out = sys.stdout
+    for u in users:
+        out.write("add %s\n" % u)
+    for _ in range(args.commands):
+        text = message(rng, args, lo, hi)
+        if args.malformed and rng.random() < args.malformed:
+            line = malformed(rng, users)
+        elif args.add and rng.random() < args.add:
+            users.append("@u%d" % len(users))
+            line = "add %s" % users[-1]
+        elif rng.random() < args.blast:
+            line = "blast %s" % text
+        elif args.unknown and rng.random() < args.unknown:
+            line = "send @x%d %s" % (rng.randrange(1 << 20), text)
+        else:
+            line = "send %s %s" % (rng.choice(users), text)
+        if rng.random() < args.noise:
+            line = mangle(rng, line)
+        out.write(line + "\n")
+    out.write("exit\n")
+
+
+if __name__ == "__main__":
+    main()
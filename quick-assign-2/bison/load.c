@@ -0,0 +1,221 @@
+/*
+ * Load generator for bluster -l: many clients, each sending one command at
+ * a time and timing how long its reply takes
+ *
+ *   bluster-load [-c clients] [-n commands] [-b blast fraction] [-s seed] socket
+ *
+ * Client i adds @ci and then sends -n commands, each a SEND to a random
+ * client or (a -b fraction of them) a BLAST, waiting for the reply to one
+ * before sending the next.  Messages delivered to the clients are counted
+ * as they go by.  At the end it prints the command rate and the p50/p99
+ * reply latency.
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#define READ_SIZE (1 << 16)
+
+struct client {
+  int fd;
+  int id;
+  int sent;			/* commands sent, not counting the add */
+  int waiting;			/* for the reply to the last one */
+  long long sent_at;
+  int done;
+
+  /* the part of a line that hasn't ended yet */
+  char line[256];
+  int len;
+};
+
+static int commands = 1000;
+static double blast = 0.01;
+static int nclients = 100;
+
+static long long *latencies;
+static long long nlatencies;
+static long long deliveries, errors;
+
+static long long now_ns(void)
+{
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+static int cmp_ll(const void *a, const void *b)
+{
+  long long x = *(const long long *)a, y = *(const long long *)b;
+  return (x > y) - (x < y);
+}
+
+static void send_line(struct client *c, const char *line, int len)
+{
+  while (len > 0) {
+    ssize_t put = write(c->fd, line, len);
+    if (put < 0) {
+      if (errno == EINTR)
+        continue;
+      perror("write");
+      exit(1);
+    }
+    line += put;
+    len -= put;
+  }
+}
+
+/* The next command for @c, or exit once it has sent them all */
+static void next_command(struct client *c)
+{
+  char line[128];
+  int len;
+
+  if (c->sent == commands) {
+    send_line(c, "exit\n", 5);
+    c->done = 1;
+    return;
+  }
+  if ((double)rand() / RAND_MAX < blast)
+    len = snprintf(line, sizeof line, "blast hello everyone number %d\n", c->sent);
+  else
+    len = snprintf(line, sizeof line, "send @c%d hi from c%d number %d\n", rand() % nclients, c->id, c->sent);
+  c->sent++;
+  c->waiting = 1;
+  c->sent_at = now_ns();
+  send_line(c, line, len);
+}
+
+static void handle_line(struct client *c, const char *line)
+{
+  if (strncmp(line, "Message to ", 11) == 0) {
+    deliveries++;
+    return;
+  }
+  if (strncmp(line, "error:", 6) == 0 || strncmp(line, "Message too long.", 17) == 0)
+    errors++;
+  if (!c->waiting)
+    return;
+
+  c->waiting = 0;
+  if (c->sent > 0)
+    latencies[nlatencies++] = now_ns() - c->sent_at;
+  next_command(c);
+}
+
+/* Read what the server sent to @c.  Returns 0 once it has hung up. */
+static int client_read(struct client *c, char *buf)
+{
+  ssize_t got = read(c->fd, buf, READ_SIZE);
+  if (got < 0)
+    return errno == EINTR || errno == EAGAIN;
+  if (got == 0)
+    return 0;
+
+  for (ssize_t i = 0; i < got; i++) {
+    if (buf[i] == '\n') {
+      c->line[c->len] = '\0';
+      handle_line(c, c->line);
+      c->len = 0;
+    } else if (c->len < (int)sizeof c->line - 1) {
+      c->line[c->len++] = buf[i];
+    }
+  }
+  return 1;
+}
+
+int main(int argc, char **argv)
+{
+  int opt, seed = 1;
+  while ((opt = getopt(argc, argv, "c:n:b:s:")) != -1) {
+    if (opt == 'c')
+      nclients = atoi(optarg);
+    else if (opt == 'n')
+      commands = atoi(optarg);
+    else if (opt == 'b')
+      blast = atof(optarg);
+    else if (opt == 's')
+      seed = atoi(optarg);
+    else
+      break;
+  }
+  if (optind != argc - 1 || nclients < 1 || commands < 0) {
+    fprintf(stderr, "usage: %s [-c clients] [-n commands] [-b blast fraction] [-s seed] socket\n", argv[0]);
+    return 1;
+  }
+  srand(seed);
+
+  struct rlimit rl;
+  if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+  }
+
+  struct sockaddr_un addr = { .sun_family = AF_UNIX };
+  strncpy(addr.sun_path, argv[optind], sizeof addr.sun_path - 1);
+
+  int ep = epoll_create1(0);
+  struct client *clients = calloc(nclients, sizeof *clients);
+  latencies = malloc(((size_t)nclients * commands + 1) * sizeof *latencies);
+
+  for (int i = 0; i < nclients; i++) {
+    struct client *c = &clients[i];
+    c->id = i;
+    c->fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (c->fd < 0 || connect(c->fd, (struct sockaddr *)&addr, sizeof addr) < 0) {
+      perror(argv[optind]);
+      return 1;
+    }
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = c };
+    epoll_ctl(ep, EPOLL_CTL_ADD, c->fd, &ev);
+  }
+
+  /* everyone is added before anyone sends to them */
+  char add[32];
+  for (int i = 0; i < nclients; i++) {
+    int len = snprintf(add, sizeof add, "add @c%d\n", i);
+    clients[i].waiting = 1;
+    send_line(&clients[i], add, len);
+  }
+
+  char *buf = malloc(READ_SIZE);
+  struct epoll_event events[256];
+  int open = nclients;
+  long long start = now_ns();
+
+  while (open > 0) {
+    int n = epoll_wait(ep, events, 256, -1);
+    for (int i = 0; i < n; i++) {
+      struct client *c = events[i].data.ptr;
+      if (!client_read(c, buf)) {
+        if (!c->done)
+          fprintf(stderr, "c%d: server hung up after %d commands\n", c->id, c->sent);
+        close(c->fd);
+        open--;
+      }
+    }
+  }
+
+  double secs = (now_ns() - start) / 1e9;
+  qsort(latencies, nlatencies, sizeof *latencies, cmp_ll);
+  long long p50 = nlatencies ? latencies[nlatencies / 2] : 0;
+  long long p99 = nlatencies ? latencies[nlatencies * 99 / 100] : 0;
+  long long max = nlatencies ? latencies[nlatencies - 1] : 0;
+
+  printf("clients: %d, commands: %lld in %.3f s (%.0f/s)\n", nclients, nlatencies, secs, nlatencies / secs);
+  printf("latency: p50 %.1f us, p99 %.1f us, max %.1f us\n", p50 / 1e3, p99 / 1e3, max / 1e3);
+  printf("messages delivered: %lld, errors: %lld\n", deliveries, errors);
+
+  free(buf);
+  free(latencies);
+  free(clients);
+  close(ep);
+  return 0;
+}
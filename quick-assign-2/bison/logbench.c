@@ -0,0 +1,148 @@
+/*
+ * Benchmark for bluster's message log (msglog.c)
+ *
+ *   bluster-logbench [-u users] [-n records] [-b blast fraction] [-m sync ms] [-k sync KB] [-r reads] [-s seed] dir
+ *
+ * Appends an ADD for each of -u users and then -n messages, each a SEND to
+ * a random user or (a -b fraction of them) a BLAST, of random lengths up
+ * to MAX_MESSAGE_LEN, and reports the append rate.  Then it closes the log
+ * and times opening it again, first with the saved index and then, having
+ * deleted it, replaying the whole log.  Last it reads the inbox (the last
+ * INBOX_SIZE messages) of -r random users and reports the p50/p99 latency
+ * of a read.  dir must not exist yet; the log is left in it.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "msglog.h"
+
+static long long now_ns(void)
+{
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+static int cmp_ll(const void *a, const void *b)
+{
+  long long x = *(const long long *)a, y = *(const long long *)b;
+  return (x > y) - (x < y);
+}
+
+static void reopen(struct msglog *log, const char *dir, const char *how)
+{
+  long long start = now_ns();
+  if (msglog_open(log, dir) < 0)
+    exit(1);
+  double secs = (now_ns() - start) / 1e9;
+  printf("open %s: %.3f s, %lld records replayed\n", how, secs, log->stats.replayed);
+}
+
+static void count(void *arg, struct span text)
+{
+  *(long long *)arg += text.len > 0;
+}
+
+int main(int argc, char **argv)
+{
+  int users = 10000, records = 1000000, reads = 10000, seed = 1;
+  double blast = 0.01;
+  struct msglog log;
+  msglog_init(&log);
+
+  int opt;
+  while ((opt = getopt(argc, argv, "u:n:b:m:k:r:s:")) != -1) {
+    if (opt == 'u')
+      users = atoi(optarg);
+    else if (opt == 'n')
+      records = atoi(optarg);
+    else if (opt == 'b')
+      blast = atof(optarg);
+    else if (opt == 'm')
+      log.sync_ms = atoi(optarg);
+    else if (opt == 'k')
+      log.sync_bytes = (size_t)atoi(optarg) << 10;
+    else if (opt == 'r')
+      reads = atoi(optarg);
+    else if (opt == 's')
+      seed = atoi(optarg);
+    else
+      break;
+  }
+  if (optind != argc - 1 || users < 1 || records < 0 || reads < 0) {
+    fprintf(stderr, "usage: %s [-u users] [-n records] [-b blast fraction] [-m sync ms] [-k sync KB] [-r reads] [-s seed] dir\n",
+            argv[0]);
+    return 1;
+  }
+  const char *dir = argv[optind];
+  struct stat st;
+  if (stat(dir, &st) == 0) {
+    fprintf(stderr, "%s: already there; the benchmark wants a new log\n", dir);
+    return 1;
+  }
+  srand(seed);
+
+  char (*handles)[HANDLE_MAX] = malloc((size_t)users * HANDLE_MAX);
+  int *lens = malloc(users * sizeof *lens);
+  for (int i = 0; i < users; i++)
+    lens[i] = snprintf(handles[i], HANDLE_MAX, "@u%d", i);
+  char text[MAX_MESSAGE_LEN];
+  for (int i = 0; i < MAX_MESSAGE_LEN; i++)
+    text[i] = 'a' + rand() % 26;
+
+  /* appending */
+  if (msglog_open(&log, dir) < 0)
+    return 1;
+  long long start = now_ns();
+  for (int i = 0; i < users; i++)
+    msglog_append(&log, RECORD_ADD, (struct span){ handles[i], lens[i] }, (struct span){ NULL, 0 });
+  for (int i = 0; i < records; i++) {
+    struct span message = { text, 1 + rand() % MAX_MESSAGE_LEN };
+    if ((double)rand() / RAND_MAX < blast) {
+      msglog_append(&log, RECORD_BLAST, (struct span){ NULL, 0 }, message);
+    } else {
+      int u = rand() % users;
+      msglog_append(&log, RECORD_SEND, (struct span){ handles[u], lens[u] }, message);
+    }
+  }
+  msglog_sync(&log);
+  double secs = (now_ns() - start) / 1e9;
+  long long total = log.stats.records;
+  printf("append: %lld records, %.1f MB in %.3f s (%.0f records/s, %.1f MB/s), %lld syncs, %u segments\n",
+         total, log.stats.bytes / 1e6, secs, total / secs, log.stats.bytes / 1e6 / secs,
+         log.stats.syncs, log.nsegments);
+  msglog_close(&log);
+
+  /* opening again, with and without the index */
+  reopen(&log, dir, "with the index");
+  msglog_close(&log);
+  char path[4096];
+  snprintf(path, sizeof path, "%s/index", dir);
+  unlink(path);
+  reopen(&log, dir, "without it");
+
+  /* reading inboxes */
+  long long *latencies = malloc((reads + 1) * sizeof *latencies);
+  long long messages = 0;
+  for (int i = 0; i < reads; i++) {
+    int u = rand() % users;
+    long long t = now_ns();
+    msglog_inbox(&log, (struct span){ handles[u], lens[u] }, INBOX_SIZE, count, &messages);
+    latencies[i] = now_ns() - t;
+  }
+  qsort(latencies, reads, sizeof *latencies, cmp_ll);
+  if (reads > 0)
+    printf("inbox reads: %d, %.1f messages each, p50 %.1f us, p99 %.1f us, max %.1f us\n",
+           reads, (double)messages / reads, latencies[reads / 2] / 1e3,
+           latencies[(long long)reads * 99 / 100] / 1e3, latencies[reads - 1] / 1e3);
+  msglog_close(&log);
+
+  free(latencies);
+  free(handles);
+  free(lens);
+  return 0;
+}
@@ -0,0 +1,593 @@
+/*
+ * The message log and its index
+ *
+ * Records are appended to the last of a directory of segment files,
+ * 00000000.log and on, each created at segment_size and mapped whole, so
+ * appending one is a memcpy.  msync writes them out in groups: once
+ * sync_bytes have built up or sync_ms have gone by, whichever comes first.
+ * When a record doesn't fit, the segment is synced, cut down to what it
+ * holds, and the next one started.
+ *
+ * A record is length-prefixed and checksummed, and padded to 8 bytes:
+ *
+ *   len  sum  type  handle_len  text_len  handle  text
+ *
+ * A len of 0 is the end of the log (the rest of the segment is still the
+ * zeros it was created with).  A crash can leave a record half written;
+ * opening the log stops at the first record whose checksum is wrong and
+ * cuts it and everything after it off.
+ *
+ * The index is kept in memory, and saved to a file named index on closing
+ * along with how much of the log it covers.  Opening the log reads it back
+ * and only replays what comes after.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "msglog.h"
+
+#define INDEX_MAGIC 0x58494c42	/* "BLIX" */
+
+struct record {
+  uint32_t len;			/* the whole record, padded; 0 past the end of the log */
+  uint32_t sum;			/* FNV-1a of the rest of it */
+  uint8_t type;
+  uint8_t handle_len;
+  uint16_t text_len;
+  char data[];			/* handle, then text */
+};
+
+static void *grow(void *p, size_t n, size_t size)
+{
+  p = realloc(p, n * size);
+  if (p == NULL) {
+    perror("bluster");
+    exit(1);
+  }
+  return p;
+}
+
+static void fail(const char *what)
+{
+  perror(what);
+  exit(1);
+}
+
+static long long now_ns(void)
+{
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+/* FNV-1a */
+static uint32_t hash(const void *p, size_t n, uint32_t h)
+{
+  const unsigned char *c = p;
+  for (size_t i = 0; i < n; i++)
+    h = (h ^ c[i]) * 16777619u;
+  return h;
+}
+
+static uint32_t record_sum(const struct record *r)
+{
+  return hash(&r->type, offsetof(struct record, data) - offsetof(struct record, type) + r->handle_len + r->text_len,
+              2166136261u);
+}
+
+static const struct record *record_at(const struct msglog *log, uint64_t pos)
+{
+  return (const struct record *)(log->segments[LOG_SEGMENT(pos)].map + LOG_OFFSET(pos));
+}
+
+void msglog_init(struct msglog *log)
+{
+  memset(log, 0, sizeof *log);
+  log->segment_size = SEGMENT_SIZE;
+  log->sync_bytes = SYNC_BYTES;
+  log->sync_ms = SYNC_MS;
+}
+
+/* The index */
+
+static uint32_t *lookup(const struct msglog *log, struct span handle)
+{
+  uint32_t mask = log->table_size - 1;
+  for (uint32_t i = hash(handle.ptr, handle.len, 2166136261u) & mask;; i = (i + 1) & mask) {
+    uint32_t t = log->table[i];
+    if (t == 0)
+      return &log->table[i];
+    const struct log_user *u = &log->users[t - 1];
+    if (u->len == handle.len && memcmp(u->handle, handle.ptr, handle.len) == 0)
+      return &log->table[i];
+  }
+}
+
+static void rehash(struct msglog *log)
+{
+  uint32_t old_size = log->table_size;
+  uint32_t *old = log->table;
+  log->table_size = old_size ? old_size * 2 : 1024;
+  log->table = calloc(log->table_size, sizeof *log->table);
+  if (log->table == NULL)
+    fail("bluster");
+  for (uint32_t i = 0; i < old_size; i++) {
+    if (old[i] != 0) {
+      const struct log_user *u = &log->users[old[i] - 1];
+      *lookup(log, (struct span){ u->handle, u->len }) = old[i];
+    }
+  }
+  free(old);
+}
+
+static struct log_user *find(const struct msglog *log, struct span handle)
+{
+  if (log->table_size == 0)
+    return NULL;
+  uint32_t t = *lookup(log, handle);
+  return t ? &log->users[t - 1] : NULL;
+}
+
+static struct log_user *add_user(struct msglog *log, struct span handle, uint64_t added)
+{
+  if (2 * (log->nusers + 1) > log->table_size)
+    rehash(log);
+  uint32_t *t = lookup(log, handle);
+  if (*t != 0)
+    return &log->users[*t - 1];
+
+  if (log->nusers == log->cap_users) {
+    log->cap_users = log->cap_users ? log->cap_users * 2 : 64;
+    log->users = grow(log->users, log->cap_users, sizeof *log->users);
+  }
+  struct log_user *u = &log->users[log->nusers];
+  memset(u, 0, sizeof *u);
+  memcpy(u->handle, handle.ptr, handle.len);
+  u->len = handle.len;
+  u->added = added;
+  *t = ++log->nusers;
+  return u;
+}
+
+static void add_send(struct log_user *u, uint64_t pos)
+{
+  if (u->nsends == u->cap_sends) {
+    u->cap_sends = u->cap_sends ? u->cap_sends * 2 : 4;
+    u->sends = grow(u->sends, u->cap_sends, sizeof *u->sends);
+  }
+  u->sends[u->nsends++] = pos;
+}
+
+static void add_blast(struct msglog *log, uint64_t pos)
+{
+  if (log->nblasts == log->cap_blasts) {
+    log->cap_blasts = log->cap_blasts ? log->cap_blasts * 2 : 64;
+    log->blasts = grow(log->blasts, log->cap_blasts, sizeof *log->blasts);
+  }
+  log->blasts[log->nblasts++] = pos;
+}
+
+/* Take the record at @pos into the index */
+static void index_record(struct msglog *log, const struct record *r, uint64_t pos)
+{
+  struct span handle = { r->data, r->handle_len };
+  switch (r->type) {
+  case RECORD_ADD:
+    add_user(log, handle, pos);
+    break;
+  case RECORD_SEND: {
+    struct log_user *u = find(log, handle);
+    if (u != NULL)
+      add_send(u, pos);
+    break;
+  }
+  case RECORD_BLAST:
+    add_blast(log, pos);
+    break;
+  }
+}
+
+static void index_free(struct msglog *log)
+{
+  for (uint32_t i = 0; i < log->nusers; i++)
+    free(log->users[i].sends);
+  free(log->users);
+  free(log->table);
+  free(log->blasts);
+  log->users = NULL;
+  log->table = NULL;
+  log->blasts = NULL;
+  log->nusers = log->cap_users = log->table_size = 0;
+  log->nblasts = log->cap_blasts = 0;
+}
+
+/*
+ * The index file: how much of the log it covers, then each user with the
+ * positions of its SENDs, then the positions of the BLASTs
+ */
+static void index_save(struct msglog *log, uint64_t covers)
+{
+  char path[4096], tmp[4096];
+  snprintf(path, sizeof path, "%s/index", log->dir);
+  snprintf(tmp, sizeof tmp, "%s/index.tmp", log->dir);
+  FILE *f = fopen(tmp, "w");
+  if (f == NULL) {
+    perror(tmp);
+    return;
+  }
+
+  uint32_t magic = INDEX_MAGIC;
+  fwrite(&magic, sizeof magic, 1, f);
+  fwrite(&covers, sizeof covers, 1, f);
+  fwrite(&log->nusers, sizeof log->nusers, 1, f);
+  for (uint32_t i = 0; i < log->nusers; i++) {
+    const struct log_user *u = &log->users[i];
+    fwrite(u->handle, sizeof u->handle, 1, f);
+    fwrite(&u->len, sizeof u->len, 1, f);
+    fwrite(&u->added, sizeof u->added, 1, f);
+    fwrite(&u->nsends, sizeof u->nsends, 1, f);
+    if (u->nsends > 0)
+      fwrite(u->sends, sizeof *u->sends, u->nsends, f);
+  }
+  fwrite(&log->nblasts, sizeof log->nblasts, 1, f);
+  if (log->nblasts > 0)
+    fwrite(log->blasts, sizeof *log->blasts, log->nblasts, f);
+
+  if (fflush(f) != 0 || fsync(fileno(f)) != 0 || ferror(f)) {
+    perror(tmp);
+    fclose(f);
+    unlink(tmp);
+    return;
+  }
+  fclose(f);
+  rename(tmp, path);
+}
+
+/* Read the index back, returning how much of the log it covers; 0 if there is none to read */
+static uint64_t index_load(struct msglog *log)
+{
+  char path[4096];
+  snprintf(path, sizeof path, "%s/index", log->dir);
+  FILE *f = fopen(path, "r");
+  if (f == NULL)
+    return 0;
+
+  uint32_t magic = 0, nusers = 0, nblasts = 0;
+  uint64_t covers = 0;
+  int ok = fread(&magic, sizeof magic, 1, f) == 1 && magic == INDEX_MAGIC
+    && fread(&covers, sizeof covers, 1, f) == 1 && fread(&nusers, sizeof nusers, 1, f) == 1;
+
+  for (uint32_t i = 0; ok && i < nusers; i++) {
+    char handle[HANDLE_MAX];
+    int len;
+    uint64_t added;
+    uint32_t nsends;
+    ok = fread(handle, sizeof handle, 1, f) == 1 && fread(&len, sizeof len, 1, f) == 1
+      && len > 0 && len <= HANDLE_MAX && fread(&added, sizeof added, 1, f) == 1
+      && fread(&nsends, sizeof nsends, 1, f) == 1;
+    if (!ok)
+      break;
+    struct log_user *u = add_user(log, (struct span){ handle, len }, added);
+    u->cap_sends = u->nsends = nsends;
+    u->sends = grow(u->sends, nsends ? nsends : 1, sizeof *u->sends);
+    ok = fread(u->sends, sizeof *u->sends, nsends, f) == nsends;
+  }
+  if (ok && fread(&nblasts, sizeof nblasts, 1, f) == 1) {
+    log->cap_blasts = log->nblasts = nblasts;
+    log->blasts = grow(log->blasts, nblasts ? nblasts : 1, sizeof *log->blasts);
+    ok = fread(log->blasts, sizeof *log->blasts, nblasts, f) == nblasts;
+  } else {
+    ok = 0;
+  }
+  fclose(f);
+
+  /* it can only be trusted for a log at least as long as it says */
+  if (ok && LOG_SEGMENT(covers) < log->nsegments && LOG_OFFSET(covers) <= log->segments[LOG_SEGMENT(covers)].size)
+    return covers;
+  index_free(log);
+  return 0;
+}
+
+/* Segments */
+
+static void segment_path(const struct msglog *log, uint32_t n, char *path, size_t size)
+{
+  snprintf(path, size, "%s/%08u.log", log->dir, n);
+}
+
+static int segment_map(struct segment *seg)
+{
+  seg->map = NULL;
+  if (seg->size == 0)
+    return 0;
+  void *map = mmap(NULL, seg->size, PROT_READ | PROT_WRITE, MAP_SHARED, seg->fd, 0);
+  if (map == MAP_FAILED)
+    return -1;
+  seg->map = map;
+  return 0;
+}
+
+/* Give the last segment its full size again, to append to */
+static int segment_extend(struct msglog *log)
+{
+  struct segment *seg = &log->segments[log->nsegments - 1];
+  if (seg->size >= log->segment_size)
+    return 0;
+  if (seg->map != NULL)
+    munmap(seg->map, seg->size);
+  seg->size = log->segment_size;
+  if (ftruncate(seg->fd, seg->size) < 0)
+    return -1;
+  return segment_map(seg);
+}
+
+/* Start segment number log->nsegments */
+static int segment_new(struct msglog *log)
+{
+  char path[4096];
+  segment_path(log, log->nsegments, path, sizeof path);
+  log->segments = grow(log->segments, log->nsegments + 1, sizeof *log->segments);
+  struct segment *seg = &log->segments[log->nsegments];
+  seg->fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+  seg->size = 0;
+  seg->map = NULL;
+  if (seg->fd < 0)
+    return -1;
+  log->nsegments++;
+  if (segment_extend(log) < 0)
+    return -1;
+
+  /* the new file has to outlast a crash too */
+  int dfd = open(log->dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (dfd >= 0) {
+    fsync(dfd);
+    close(dfd);
+  }
+  log->end = log->synced = 0;
+  return 0;
+}
+
+/* Cut the last segment down to what it holds */
+static void segment_seal(struct msglog *log)
+{
+  struct segment *seg = &log->segments[log->nsegments - 1];
+  if (seg->map != NULL)
+    munmap(seg->map, seg->size);
+  seg->size = log->end;
+  if (ftruncate(seg->fd, seg->size) < 0 || segment_map(seg) < 0)
+    fail(log->dir);
+}
+
+static void rollover(struct msglog *log)
+{
+  msglog_sync(log);
+  segment_seal(log);
+  if (segment_new(log) < 0)
+    fail(log->dir);
+}
+
+/*
+ * The length of the record at @off in @seg if it is whole, 0 if the log
+ * ends there, -1 if it is torn
+ */
+static long record_check(const struct segment *seg, size_t off)
+{
+  if (off + sizeof(struct record) > seg->size)
+    return 0;
+  const struct record *r = (const struct record *)(seg->map + off);
+  if (r->len == 0)
+    return 0;
+  if (r->len % 8 != 0 || r->len > seg->size - off
+      || sizeof(struct record) + r->handle_len + r->text_len > r->len
+      || r->type < RECORD_ADD || r->type > RECORD_BLAST || r->sum != record_sum(r))
+    return -1;
+  return r->len;
+}
+
+/* Index the records from @from on, and cut off the log where they stop being whole */
+static void replay(struct msglog *log, uint64_t from)
+{
+  for (uint32_t s = LOG_SEGMENT(from); s < log->nsegments; s++) {
+    struct segment *seg = &log->segments[s];
+    size_t off = (s == LOG_SEGMENT(from)) ? LOG_OFFSET(from) : 0;
+    long len;
+    while ((len = record_check(seg, off)) > 0) {
+      index_record(log, (const struct record *)(seg->map + off), LOG_POS(s, off));
+      log->stats.replayed++;
+      off += len;
+    }
+    if (len == 0 && s + 1 < log->nsegments && off == seg->size)
+      continue;		/* a sealed segment, read to the end */
+
+    /*
+     * The log ends here.  Whatever follows, a torn record or segments
+     * started after it, is cut off; truncating and growing the file again
+     * leaves zeros in place of it.
+     */
+    if (len < 0)
+      log->stats.truncated++;
+    if (ftruncate(seg->fd, off) < 0 || ftruncate(seg->fd, seg->size) < 0)
+      fail(log->dir);
+    for (uint32_t t = s + 1; t < log->nsegments; t++) {
+      char path[4096];
+      segment_path(log, t, path, sizeof path);
+      if (log->segments[t].map != NULL)
+        munmap(log->segments[t].map, log->segments[t].size);
+      close(log->segments[t].fd);
+      unlink(path);
+    }
+    log->nsegments = s + 1;
+    log->end = off;
+    return;
+  }
+}
+
+int msglog_open(struct msglog *log, const char *dir)
+{
+  if (mkdir(dir, 0777) < 0 && errno != EEXIST) {
+    perror(dir);
+    return -1;
+  }
+  log->dir = strdup(dir);
+
+  for (;;) {
+    char path[4096];
+    segment_path(log, log->nsegments, path, sizeof path);
+    int fd = open(path, O_RDWR | O_CLOEXEC);
+    if (fd < 0 && errno == ENOENT)
+      break;
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+      perror(path);
+      return -1;
+    }
+    log->segments = grow(log->segments, log->nsegments + 1, sizeof *log->segments);
+    struct segment *seg = &log->segments[log->nsegments++];
+    seg->fd = fd;
+    seg->size = st.st_size;
+    if (segment_map(seg) < 0) {
+      perror(path);
+      return -1;
+    }
+  }
+
+  if (log->nsegments == 0) {
+    if (segment_new(log) < 0) {
+      perror(log->dir);
+      return -1;
+    }
+  } else {
+    /* the last segment was cut down when it was closed; it needs its room back to scan */
+    if (segment_extend(log) < 0) {
+      perror(log->dir);
+      return -1;
+    }
+    replay(log, index_load(log));
+    if (segment_extend(log) < 0) {
+      perror(log->dir);
+      return -1;
+    }
+  }
+  log->synced = log->end;
+  log->synced_at = now_ns();
+  return 0;
+}
+
+void msglog_close(struct msglog *log)
+{
+  if (log->nsegments > 0) {
+    msglog_sync(log);
+    segment_seal(log);
+    index_save(log, LOG_POS(log->nsegments - 1, log->end));
+  }
+  for (uint32_t s = 0; s < log->nsegments; s++) {
+    if (log->segments[s].map != NULL)
+      munmap(log->segments[s].map, log->segments[s].size);
+    close(log->segments[s].fd);
+  }
+  free(log->segments);
+  free(log->dir);
+  index_free(log);
+  msglog_init(log);
+}
+
+/* Appending */
+
+uint64_t msglog_append(struct msglog *log, enum record_type type, struct span handle, struct span text)
+{
+  size_t len = (sizeof(struct record) + handle.len + text.len + 7) & ~(size_t)7;
+  if (log->end + len > log->segments[log->nsegments - 1].size)
+    rollover(log);
+
+  uint64_t pos = LOG_POS(log->nsegments - 1, log->end);
+  struct record *r = (struct record *)(log->segments[log->nsegments - 1].map + log->end);
+  r->type = type;
+  r->handle_len = handle.len;
+  r->text_len = text.len;
+  if (handle.len > 0)
+    memcpy(r->data, handle.ptr, handle.len);
+  if (text.len > 0)
+    memcpy(r->data + handle.len, text.ptr, text.len);
+  r->sum = record_sum(r);
+  r->len = len;
+  log->end += len;
+
+  index_record(log, r, pos);
+  log->stats.records++;
+  log->stats.bytes += len;
+
+  if (log->end - log->synced >= log->sync_bytes)
+    msglog_sync(log);
+  else
+    msglog_tick(log);
+  return pos;
+}
+
+void msglog_sync(struct msglog *log)
+{
+  if (log->end > log->synced) {
+    struct segment *seg = &log->segments[log->nsegments - 1];
+    size_t from = log->synced & ~(size_t)(sysconf(_SC_PAGESIZE) - 1);
+    if (msync(seg->map + from, log->end - from, MS_SYNC) < 0)
+      fail(log->dir);
+    log->synced = log->end;
+    log->stats.syncs++;
+  }
+  log->synced_at = now_ns();
+}
+
+void msglog_tick(struct msglog *log)
+{
+  if (log->end > log->synced && now_ns() - log->synced_at >= log->sync_ms * 1000000LL)
+    msglog_sync(log);
+}
+
+/* Reading */
+
+int msglog_inbox(const struct msglog *log, struct span handle, int limit,
+                 void (*fn)(void *arg, struct span text), void *arg)
+{
+  const struct log_user *u = find(log, handle);
+  if (u == NULL)
+    return -1;
+
+  /* the BLASTs it got are the ones after its ADD */
+  uint32_t lo = 0, hi = log->nblasts;
+  while (lo < hi) {
+    uint32_t mid = lo + (hi - lo) / 2;
+    if (log->blasts[mid] < u->added)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  /* step back over the last @limit of the two lists together... */
+  uint32_t i = u->nsends, j = log->nblasts;
+  int n = 0;
+  for (; n < limit && (i > 0 || j > lo); n++) {
+    if (j > lo && (i == 0 || log->blasts[j - 1] > u->sends[i - 1]))
+      j--;
+    else
+      i--;
+  }
+
+  /* ...and read them in log order */
+  for (int k = 0; k < n; k++) {
+    uint64_t pos;
+    if (j < log->nblasts && (i == u->nsends || log->blasts[j] < u->sends[i]))
+      pos = log->blasts[j++];
+    else
+      pos = u->sends[i++];
+    const struct record *r = record_at(log, pos);
+    fn(arg, (struct span){ r->data + r->handle_len, r->text_len });
+  }
+  return n;
+}
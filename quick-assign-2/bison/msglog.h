@@ -0,0 +1,107 @@
+/*
+ * A durable record of what bluster's users were sent: an append-only log of
+ * segment files, and an index of which records are in whose inbox
+ */
+#ifndef MSGLOG_H
+#define MSGLOG_H
+
+#include <stdint.h>
+
+#include "engine.h"
+
+#define SEGMENT_SIZE (64 << 20)	/* bytes to a segment file */
+#define SYNC_BYTES (1 << 20)	/* msync once this much is unsynced... */
+#define SYNC_MS 10		/* ...or this long after the last one */
+
+enum record_type {
+  RECORD_ADD = 1,
+  RECORD_SEND,
+  RECORD_BLAST,
+};
+
+/*
+ * Where a record is in the log: the segment's number in the top 32 bits
+ * and the byte offset in it below, so positions sort in log order.
+ */
+#define LOG_POS(seg, off) ((uint64_t)(seg) << 32 | (uint32_t)(off))
+#define LOG_SEGMENT(pos) ((uint32_t)((pos) >> 32))
+#define LOG_OFFSET(pos) ((uint32_t)(pos))
+
+/* A user's inbox: the SENDs to it, and every BLAST after it was added */
+struct log_user {
+  char handle[HANDLE_MAX];
+  int len;
+  uint64_t added;
+  uint64_t *sends;
+  uint32_t nsends;
+  uint32_t cap_sends;
+};
+
+/* A segment file, mapped whole; only the last one is still written to */
+struct segment {
+  int fd;
+  char *map;
+  size_t size;
+};
+
+struct msglog_stats {
+  long long records;		/* appended since it was opened */
+  long long bytes;
+  long long syncs;
+  long long replayed;		/* records read back into the index on opening */
+  long long truncated;		/* bytes of a torn record cut off the end */
+};
+
+struct msglog {
+  /* set these between msglog_init and msglog_open to change them */
+  size_t segment_size;
+  size_t sync_bytes;		/* 0 syncs every record */
+  int sync_ms;
+
+  char *dir;
+  struct segment *segments;
+  uint32_t nsegments;
+  size_t end;			/* where the next record goes in the last segment */
+  size_t synced;		/* how much of the last segment msync has written */
+  long long synced_at;
+
+  /* the index: users in the order they were added, and every BLAST */
+  struct log_user *users;
+  uint32_t nusers;
+  uint32_t cap_users;
+  uint32_t *table;		/* as in struct engine */
+  uint32_t table_size;
+  uint64_t *blasts;
+  uint32_t nblasts;
+  uint32_t cap_blasts;
+
+  struct msglog_stats stats;
+};
+
+void msglog_init(struct msglog *log);
+/*
+ * Open the log in directory @dir, creating it if need be.  A torn record at
+ * the end, left by a crash in the middle of writing it, is cut off.  The
+ * index is read back from where msglog_close left it, and brought up to
+ * date from the records after that.  Returns -1 (having said why) if the
+ * log can't be opened.
+ */
+int msglog_open(struct msglog *log, const char *dir);
+/* Sync the log, save the index next to it, and free everything */
+void msglog_close(struct msglog *log);
+
+/* Append a record, syncing it along with any others due; returns its position */
+uint64_t msglog_append(struct msglog *log, enum record_type type, struct span handle, struct span text);
+/* Make everything appended so far durable */
+void msglog_sync(struct msglog *log);
+/* Sync if it has been sync_ms since the last one, for when nothing is being appended */
+void msglog_tick(struct msglog *log);
+
+/*
+ * Call @fn with each of the last @limit messages in @handle's inbox, oldest
+ * first.  Returns how many there were, or -1 if @handle was never added.
+ */
+int msglog_inbox(const struct msglog *log, struct span handle, int limit,
+                 void (*fn)(void *arg, struct span text), void *arg);
+
+#endif
@@ -0,0 +1,367 @@
+/*
+ * bluster over a Unix domain socket: every connection is its own session,
+ * all of them against one engine
+ *
+ * Connections are multiplexed with edge-triggered epoll on a single thread.
+ * What a connection's commands print is collected in a buffer of its own
+ * (through a stdio stream, so the parser's actions don't change), and a
+ * user that was added over a connection has its messages sent down that
+ * connection as they arrive:
+ *
+ *   Message to @bob: hi there
+ *
+ * Replies and messages are written out together with writev once a round of
+ * events has been handled, straight from the engine's message pool.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "engine.h"
+#include "msglog.h"
+
+#define READ_SIZE (1 << 16)
+#define MAX_EVENTS 256
+#define MAX_IOV 1020		/* under IOV_MAX, a multiple of the 5 a message takes */
+#define OUT_LIMIT (1 << 20)	/* stop reading from a client this far behind */
+
+struct conn {
+  int fd;
+  struct session session;
+
+  /* replies written by the session, and anything writev didn't get to */
+  char *out;
+  size_t out_head;
+  size_t out_len;
+  size_t out_cap;
+
+  /* the users added over this connection */
+  uint32_t *users;
+  int nusers;
+  int cap_users;
+
+  int closing;			/* drop the connection once out is written */
+  int throttled;		/* stopped reading at OUT_LIMIT */
+  int dirty;			/* on the dirty list */
+  struct conn *next_dirty;
+};
+
+static struct engine engine;
+static struct conn *dirty;
+static volatile sig_atomic_t stopping;
+
+static void *grow(void *p, size_t n, size_t size)
+{
+  p = realloc(p, n * size);
+  if (p == NULL) {
+    perror("bluster");
+    exit(1);
+  }
+  return p;
+}
+
+static void mark_dirty(struct conn *c)
+{
+  if (!c->dirty) {
+    c->dirty = 1;
+    c->next_dirty = dirty;
+    dirty = c;
+  }
+}
+
+static void notify(struct engine *e, struct user *u)
+{
+  (void)e;
+  mark_dirty(u->watcher);
+}
+
+static void put(struct conn *c, const char *p, size_t n)
+{
+  if (c->out_head > 0 && c->out_len + n > c->out_cap) {
+    memmove(c->out, c->out + c->out_head, c->out_len);
+    c->out_head = 0;
+  }
+  if (c->out_head + c->out_len + n > c->out_cap) {
+    while (c->out_head + c->out_len + n > c->out_cap)
+      c->out_cap = c->out_cap ? c->out_cap * 2 : 4096;
+    c->out = grow(c->out, c->out_cap, 1);
+  }
+  memcpy(c->out + c->out_head + c->out_len, p, n);
+  c->out_len += n;
+}
+
+/* The session's out and err: a stdio stream that appends to c->out */
+static ssize_t write_out(void *cookie, const char *p, size_t n)
+{
+  put(cookie, p, n);
+  mark_dirty(cookie);
+  return n;
+}
+
+/* A user added over a connection nobody else is watching gets its messages sent there */
+static void added(struct session *s, struct user *u)
+{
+  struct conn *c = (struct conn *)((char *)s - offsetof(struct conn, session));
+  if (u->watcher != NULL)
+    return;
+  u->watcher = c;
+  if (c->nusers == c->cap_users) {
+    c->cap_users = c->cap_users ? c->cap_users * 2 : 4;
+    c->users = grow(c->users, c->cap_users, sizeof *c->users);
+  }
+  c->users[c->nusers++] = u - engine.users;
+}
+
+static struct conn *conn_new(int fd)
+{
+  struct conn *c = calloc(1, sizeof *c);
+  c->fd = fd;
+  session_init(&c->session, &engine, fopencookie(c, "w", (cookie_io_functions_t){ .write = write_out }));
+  setvbuf(c->session.out, NULL, _IOFBF, 4096);
+  c->session.err = c->session.out;
+  c->session.keep_going = 1;
+  c->session.added = added;
+  return c;
+}
+
+static void conn_free(struct conn *c)
+{
+  for (int i = 0; i < c->nusers; i++)
+    engine.users[c->users[i]].watcher = NULL;
+  fclose(c->session.out);
+  session_free(&c->session);
+  close(c->fd);
+  free(c->out);
+  free(c->users);
+  free(c);
+}
+
+/*
+ * Write out c->out and then every message waiting for c's users, as much
+ * of it as the socket takes.  Whole messages that were written are popped
+ * from the inboxes; one that was cut off is copied to c->out to finish
+ * next time.  Returns -1 if the connection is gone.
+ */
+static int conn_flush(struct conn *c)
+{
+  static const char prefix[] = "Message to ", colon[] = ": ", newline[] = "\n";
+  struct iovec iov[MAX_IOV];
+
+  for (;;) {
+    int n = 0;
+    size_t total = 0;
+    if (c->out_len > 0)
+      iov[n++] = (struct iovec){ c->out + c->out_head, c->out_len };
+
+    /* messages, oldest first for each user, as many as fit */
+    int u = 0;
+    unsigned m = 0;
+    for (; u < c->nusers && n + 5 <= MAX_IOV; u++) {
+      struct user *user = &engine.users[c->users[u]];
+      for (m = 0; m < user->count && n + 5 <= MAX_IOV; m++) {
+        struct span text = engine_inbox(&engine, user, m);
+        iov[n++] = (struct iovec){ (void *)prefix, sizeof prefix - 1 };
+        iov[n++] = (struct iovec){ user->handle, user->len };
+        iov[n++] = (struct iovec){ (void *)colon, sizeof colon - 1 };
+        iov[n++] = (struct iovec){ (void *)text.ptr, text.len };
+        iov[n++] = (struct iovec){ (void *)newline, sizeof newline - 1 };
+      }
+      if (m < user->count)
+        break;
+    }
+    if (n == 0)
+      return 0;
+    for (int i = 0; i < n; i++)
+      total += iov[i].iov_len;
+
+    ssize_t put_n = writev(c->fd, iov, n);
+    if (put_n < 0)
+      return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+
+    /* take off what was written, in the order it went out */
+    size_t left = put_n;
+    int i = 0;
+    if (c->out_len > 0) {
+      size_t took = left < c->out_len ? left : c->out_len;
+      c->out_head += took;
+      c->out_len -= took;
+      left -= took;
+      i = 1;
+      if (c->out_len == 0)
+        c->out_head = 0;
+    }
+    for (int v = 0; left > 0 && v < c->nusers; v++) {
+      struct user *user = &engine.users[c->users[v]];
+      unsigned done = 0;
+      while (left > 0 && i < n && done < user->count) {
+        size_t len = 0;
+        for (int k = 0; k < 5; k++)
+          len += iov[i + k].iov_len;
+        if (left < len) {
+          /* cut off: keep the rest of this message to go first next time */
+          size_t skip = left;
+          for (int k = 0; k < 5; k++) {
+            if (skip >= iov[i + k].iov_len) {
+              skip -= iov[i + k].iov_len;
+              continue;
+            }
+            put(c, (char *)iov[i + k].iov_base + skip, iov[i + k].iov_len - skip);
+            skip = 0;
+          }
+          left = 0;
+        } else {
+          left -= len;
+        }
+        i += 5;
+        done++;
+      }
+      engine_pop(&engine, user, done);
+    }
+
+    if ((size_t)put_n < total)
+      return 0;		/* wait for EPOLLOUT */
+  }
+}
+
+/* Read and run everything the client has sent.  Returns -1 if it is done with. */
+static int conn_read(struct conn *c, char *buf)
+{
+  struct session *s = &c->session;
+  for (;;) {
+    if (c->out_len > OUT_LIMIT) {
+      c->throttled = 1;
+      return 0;		/* picked up again from the flush that drains it */
+    }
+    ssize_t got = read(c->fd, buf, READ_SIZE);
+    if (got < 0)
+      return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+    if (got == 0)
+      session_end(s);
+    else
+      session_feed(s, buf, got);
+    fflush(s->out);
+
+    if (s->status != SESSION_OPEN) {
+      c->closing = 1;
+      shutdown(c->fd, SHUT_RD);
+      mark_dirty(c);
+      return 0;
+    }
+  }
+}
+
+static void stop(int sig)
+{
+  (void)sig;
+  stopping = 1;
+}
+
+int serve(const char *path, int stats, struct msglog *log)
+{
+  int lfd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  struct sockaddr_un addr = { .sun_family = AF_UNIX };
+  strncpy(addr.sun_path, path, sizeof addr.sun_path - 1);
+  unlink(path);
+  if (lfd < 0 || bind(lfd, (struct sockaddr *)&addr, sizeof addr) < 0 || listen(lfd, SOMAXCONN) < 0) {
+    perror(path);
+    return 1;
+  }
+
+  /* thousands of clients need thousands of descriptors */
+  struct rlimit rl;
+  if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+  }
+
+  engine_init(&engine);
+  engine.notify = notify;
+  if (log != NULL)
+    engine_log_to(&engine, log);
+  signal(SIGPIPE, SIG_IGN);
+  signal(SIGINT, stop);
+  signal(SIGTERM, stop);
+
+  int ep = epoll_create1(EPOLL_CLOEXEC);
+  struct epoll_event ev = { .events = EPOLLIN | EPOLLET, .data.ptr = NULL };
+  epoll_ctl(ep, EPOLL_CTL_ADD, lfd, &ev);
+
+  char *buf = malloc(READ_SIZE);
+  struct epoll_event events[MAX_EVENTS];
+  long long connections = 0;
+
+  while (!stopping) {
+    /* with a log, wake up in time to sync what a quiet spell left unsynced */
+    int n = epoll_wait(ep, events, MAX_EVENTS, log != NULL ? log->sync_ms : -1);
+    if (n < 0 && errno != EINTR) {
+      perror("epoll_wait");
+      break;
+    }
+
+    for (int i = 0; i < n; i++) {
+      struct conn *c = events[i].data.ptr;
+      if (c == NULL) {
+        int fd;
+        while ((fd = accept4(lfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+          c = conn_new(fd);
+          struct epoll_event cev = { .events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, .data.ptr = c };
+          epoll_ctl(ep, EPOLL_CTL_ADD, fd, &cev);
+          connections++;
+        }
+        continue;
+      }
+      if ((events[i].events & EPOLLIN) && !c->closing && conn_read(c, buf) < 0) {
+        c->closing = 1;
+        mark_dirty(c);
+      }
+      if (events[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP))
+        mark_dirty(c);
+    }
+
+    /* write out everything this round produced */
+    while (dirty != NULL) {
+      struct conn *c = dirty;
+      dirty = c->next_dirty;
+      c->dirty = 0;
+
+      int status = conn_flush(c);
+      int drained = c->out_len == 0;
+      for (int u = 0; drained && u < c->nusers; u++)
+        drained = engine.users[c->users[u]].count == 0;
+
+      if (status < 0 || (c->closing && drained) || (c->closing && c->session.status == SESSION_OPEN)) {
+        conn_free(c);
+      } else if (c->throttled && !c->closing && c->out_len <= OUT_LIMIT) {
+        /* a client that was held back for being slow gets read again here */
+        c->throttled = 0;
+        if (conn_read(c, buf) < 0) {
+          c->closing = 1;
+          mark_dirty(c);
+        }
+      }
+    }
+    if (log != NULL)
+      msglog_tick(log);
+  }
+
+  if (stats)
+    fprintf(stderr, "connections: %lld, users: %u, sends: %lld, blasts: %lld, deliveries: %lld, dropped: %lld\n",
+            connections, engine.nusers, engine.stats.sends, engine.stats.blasts,
+            engine.stats.deliveries, engine.stats.dropped);
+  free(buf);
+  close(ep);
+  close(lfd);
+  unlink(path);
+  return 0;
+}
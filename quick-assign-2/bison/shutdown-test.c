@@ -0,0 +1,98 @@
+/*
+ * Test that engine_stop carries out every command queued before it
+ *
+ *   bluster-shutdown-test [-r rounds] [-p producers] [-n commands] [-w workers]
+ *
+ * Each round starts an engine with -w delivery threads, has -p threads
+ * queue -n SENDs each (every 16th a BLAST), and then queues one last SEND
+ * itself, after a pause of up to a couple of milliseconds so the
+ * dispatcher may be asleep or just waking, right before stopping the
+ * engine.  Every command has to have been taken by the time engine_stop
+ * returns.  Prints how many rounds failed and how many commands they lost
+ * between them, and exits 1 if any round failed.
+ */
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "engine.h"
+
+static int commands = 1000;
+
+static struct span user = { "@a", 2 };
+
+static void *producer(void *arg)
+{
+  struct engine *e = arg;
+  struct word w = { { "hello", 5 }, NULL };
+  struct message m = { &w, &w, 5, 0 };
+  for (int i = 0; i < commands; i++) {
+    if (i % 16 == 15)
+      engine_blast(e, &m);
+    else
+      engine_send(e, user, &m);
+  }
+  return NULL;
+}
+
+int main(int argc, char **argv)
+{
+  int rounds = 1000, producers = 4, workers = 2;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "r:p:n:w:")) != -1) {
+    if (opt == 'r')
+      rounds = atoi(optarg);
+    else if (opt == 'p')
+      producers = atoi(optarg);
+    else if (opt == 'n')
+      commands = atoi(optarg);
+    else if (opt == 'w')
+      workers = atoi(optarg);
+    else {
+      fprintf(stderr, "usage: %s [-r rounds] [-p producers] [-n commands] [-w workers]\n", argv[0]);
+      return 2;
+    }
+  }
+
+  pthread_t *threads = calloc(producers, sizeof *threads);
+  struct word w = { { "last", 4 }, NULL };
+  struct message last = { &w, &w, 4, 0 };
+  long long blasts = (long long)producers * (commands / 16);
+  long long sends = (long long)producers * commands - blasts + 1;
+  int failed = 0;
+  long long lost = 0;
+  srand(1);
+
+  for (int r = 0; r < rounds; r++) {
+    struct engine e;
+    engine_init(&e);
+    engine_start(&e, workers);
+    engine_add(&e, user);
+    for (int i = 0; i < producers; i++)
+      pthread_create(&threads[i], NULL, producer, &e);
+    for (int i = 0; i < producers; i++)
+      pthread_join(threads[i], NULL);
+
+    struct timespec pause = { 0, (rand() % 2000) * 1000L };
+    nanosleep(&pause, NULL);
+    engine_send(&e, user, &last);
+    engine_stop(&e);
+
+    /* one user, so each SEND and each BLAST is one delivery */
+    if (e.stats.adds != 1 || e.stats.sends != sends || e.stats.blasts != blasts
+        || e.stats.deliveries != sends + blasts) {
+      fprintf(stderr, "round %d: %lld adds, %lld sends, %lld blasts taken, %lld delivered; queued 1, %lld, %lld\n",
+              r, e.stats.adds, e.stats.sends, e.stats.blasts, e.stats.deliveries, sends, blasts);
+      failed++;
+      lost += (1 - e.stats.adds) + (sends - e.stats.sends) + (blasts - e.stats.blasts);
+    }
+    engine_free(&e);
+  }
+
+  printf("%d rounds, %d failed, %lld lost commands\n", rounds, failed, lost);
+  free(threads);
+  return failed > 0;
+}